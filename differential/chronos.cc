@@ -2,13 +2,13 @@
 #include "chronos.hh"
 #include <cstring>
 #include <stdexcept>
-#include <sys/time.h>
+#include <time.h>
 
 using namespace driver_differential;
 
-Chronos::Chronos ( double seconds_since_epoch )
+Chronos::Chronos ( double start )
 {
-  clock_ = seconds_since_epoch;
+  clock_ = start;
 }
 
 double Chronos::elapsed ( void ) const
@@ -23,12 +23,12 @@ void Chronos::reset ( void )
 
 double Chronos::now ( void )
   {
-    struct timeval clock;
+    struct timespec clock;
 
-    if ( gettimeofday ( &clock, NULL ) != 0 )
+    if ( clock_gettime ( CLOCK_MONOTONIC, &clock ) != 0 )
       throw std::runtime_error ( strerror ( errno ) );
 
     return
       static_cast<double> ( clock.tv_sec ) +
-      static_cast<double> ( clock.tv_usec ) * 1e-6;
+      static_cast<double> ( clock.tv_nsec ) * 1e-9;
   }
@@ -3,10 +3,11 @@
 
 namespace driver_differential {
 
+// Seconds on the monotonic clock, so NTP or date changes don't disturb it
 class Chronos
   {
   public:
-    Chronos ( double seconds_since_epoch = now() );
+    Chronos ( double start = now() );
     double elapsed ( void ) const;
     void reset ( void );
 
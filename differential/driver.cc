@@ -28,6 +28,10 @@ This driver takes two @ref interface_position1d sources
 and considers them the two motors of a differential steer machine,
 providing in turn a @ref interface_position2d for control of such machine.
 
+Each velocity command becomes one per wheel, which start at slightly different times.
+With both wheels on the same NXT brick, its driver can provide the position2d itself
+(see @ref driver_nxt), driving them as a pair synchronized by the brick with half the traffic.
+
 @par Compile-time dependencies
 
 - none
@@ -43,6 +47,9 @@ providing in turn a @ref interface_position2d for control of such machine.
 
 - @ref interface_position2d
     - The differential steer interface obtained coupling the two position1d interfaces.
+    - Odometry is integrated each time both wheels have a new reading: their positions are interpolated
+      to a common time, by their timestamps, and the pose follows the exact arc they describe.
+      Data is published with that time.
 
 @par Configuration file options
 
@@ -50,7 +57,12 @@ providing in turn a @ref interface_position2d for control of such machine.
     - Distance between wheels at its pivot point.
 
 - period (float [s] default 0.05)
-    - Period used for integration of odometry, since we have unsyncronized sources for each wheel.
+    - Longest wait for messages. Odometry doesn't go by it: it is integrated as soon as a new
+      reading of both wheels has arrived.
+
+- stats_period (float [s] default 10.0)
+    - Seconds between dumps of odometry timing, at message level 1: pairs of readings integrated,
+      and latency from the common time of a pair to the publication of its pose. 0 disables them.
 
 @par Example
 
@@ -85,6 +97,7 @@ driver
 */
 /** @} */
 
+#include <algorithm>
 #include "chronos.hh"
 #include <cstring>
 #include "libplayercore/device.h"
@@ -103,6 +116,9 @@ const int kL = 0;
 const int kR = 1;
 const char *kMotorNames[kNumMotors] = { "left", "right" };
 
+const double kMinTurn        = 1e-9; // [rad] Below this a step is taken as straight
+const double kResetTolerance = 0.05; // [length] Most a wheel turns between its odometry reset and its next reading
+
 
 class Differential : public ThreadedDriver
   {
@@ -123,15 +139,36 @@ class Differential : public ThreadedDriver
 
     player_position2d_data_t p2d_state_;
 
-    player_position1d_data_t p1d_state_     [kNumMotors]; // Just read status.
-    player_position1d_data_t p1d_state_prev_[kNumMotors]; // Previous status to integrate speed.
+    // Last two readings of each wheel, to interpolate between
+    typedef struct
+      {
+        player_position1d_data_t state;
+        double                   time;  // [s] Of the reading, as stamped by its source
+      } wheel_sample;
+
+    wheel_sample     sample_     [kNumMotors];
+    wheel_sample     sample_prev_[kNumMotors];
+    int              num_samples_[kNumMotors]; // Up to 2
+    bool             resetting_  [kNumMotors]; // Since a reset was asked, till the wheel reads near zero
+
+    bool             integrated_;             // Whether there is a first pair to integrate from
+    double           integrated_time_;        // Common time of the last pair integrated
+    double           integrated_pos_[kNumMotors];
 
     double           axis_length_;
 
     double           period_;
-    Chronos          timer_period_;
-
-    void             CheckMotors ( void );
+    double           stats_period_;
+    Chronos          timer_stats_;
+    uint64_t         pairs_;                  // Since last stats dump
+    double           latency_sum_;
+    double           latency_max_;
+
+    void             AddSample ( int wheel, const player_position1d_data_t &state, double time );
+    void             Integrate ( void );
+    double           PositionAt ( int wheel, double time ) const;
+    void             ResetOdometry ( void );
+    void             LogStats ( void );
     int              GetMotor ( const player_devaddr_t & addr ) const;
     void             SetVel ( const player_pose2d_t & vel );
   };
@@ -149,7 +186,11 @@ void differential_Register ( DriverTable* table )
 Differential::Differential ( ConfigFile *cf, int section )
     : ThreadedDriver ( cf, section ),
     axis_length_ ( cf->ReadLength ( section, "axis_length", 0.25 ) ),
-    period_ ( cf->ReadFloat ( section, "period", 0.05 ) )
+    period_ ( cf->ReadFloat ( section, "period", 0.05 ) ),
+    stats_period_ ( cf->ReadFloat ( section, "stats_period", 10.0 ) ),
+    pairs_ ( 0 ),
+    latency_sum_ ( 0.0 ),
+    latency_max_ ( 0.0 )
 {
   for ( int i = 0; i < kNumMotors; i++ )
     {
@@ -160,11 +201,6 @@ Differential::Differential ( ConfigFile *cf, int section )
           SetError ( -1 );
           return;
         }
-      else
-        {
-          memset ( &p1d_state_[i],      0, sizeof ( p1d_state_[i] ) );
-          memset ( &p1d_state_prev_[i], 0, sizeof ( p1d_state_[i] ) );
-        }
     }
 
   if ( cf->ReadDeviceAddr ( &p2d_addr_, section, "provides", PLAYER_POSITION2D_CODE, -1, NULL ) == 0 )
@@ -172,7 +208,7 @@ Differential::Differential ( ConfigFile *cf, int section )
       if ( AddInterface ( p2d_addr_ ) != 0 )
         throw std::runtime_error ( "Cannot add position2d interface" );
       else
-        memset ( &p2d_state_, 0, sizeof ( p2d_state_ ) );
+        ResetOdometry();
     }
   else
     throw std::runtime_error ( "Cannot find position2d interface" );
@@ -199,51 +235,157 @@ void Differential::Main ( void )
 {
   while ( true )
     {
-      // Wait till we get new data or we need to measure something
+      // Wait till we get new data; odometry is integrated as it arrives
       Wait ( period_ );
 
       pthread_testcancel();
 
       ProcessMessages ( 0 );
 
-      CheckMotors();
+      if ( stats_period_ > 0.0 && timer_stats_.elapsed() > stats_period_ )
+        {
+          timer_stats_.reset();
+          LogStats();
+        }
+    }
+}
+
+void Differential::AddSample ( int wheel, const player_position1d_data_t &state, double time )
+{
+  if ( num_samples_[wheel] > 0 && time <= sample_[wheel].time ) // Out of order, or repeated
+    return;
+
+  // Readings already on their way when the reset was asked, or sent before the wheel driver did it
+  if ( resetting_[wheel] )
+    {
+      if ( fabs ( state.pos ) > kResetTolerance )
+        return;
+
+      resetting_[wheel] = false;
     }
+
+  sample_prev_[wheel] = sample_[wheel];
+  sample_[wheel].state = state;
+  sample_[wheel].time  = time;
+  num_samples_[wheel]  = std::min ( num_samples_[wheel] + 1, 2 );
+
+  Integrate();
 }
 
-void Differential::CheckMotors ( void )
+// Linear between the last two readings, or beyond them
+double Differential::PositionAt ( int wheel, double time ) const
+  {
+    const wheel_sample &last = sample_[wheel];
+    const wheel_sample &prev = sample_prev_[wheel];
+
+    if ( num_samples_[wheel] < 2 || last.time == time )
+      return last.state.pos;
+
+    return prev.state.pos + ( last.state.pos - prev.state.pos ) * ( time - prev.time ) / ( last.time - prev.time );
+  }
+
+void Differential::Integrate ( void )
 {
   // THESE CALCULATIONS ARE mostly TAKEN FROM
   // http://rossum.sourceforge.net/papers/DiffSteer/
 
-  if ( timer_period_.elapsed() < period_ )
+  if ( num_samples_[kL] == 0 || num_samples_[kR] == 0 )
     return;
 
-  timer_period_.reset();
+  // The latest time both wheels have been read at
+  const double time = std::min ( sample_[kL].time, sample_[kR].time );
 
-  p2d_state_.stall = p1d_state_[kL].stall || p1d_state_[kR].stall;
+  if ( integrated_ && time <= integrated_time_ )
+    return;
 
-  p2d_state_.vel.px = ( p1d_state_[kL].vel + p1d_state_[kR].vel ) / 2.0;
+  double pos[kNumMotors];
+  for ( int i = 0; i < kNumMotors; i++ )
+    pos[i] = PositionAt ( i, time );
+
+  if ( integrated_ )
+    {
+      const double dl    = pos[kL] - integrated_pos_[kL];
+      const double dr    = pos[kR] - integrated_pos_[kR];
+      const double dist  = ( dl + dr ) / 2.0;
+      const double turn  = ( dr - dl ) / axis_length_;
+      const double theta = p2d_state_.pos.pa;
+
+      // Along the arc of constant curvature through both readings, straight if there is no turn
+      if ( fabs ( turn ) < kMinTurn )
+        {
+          p2d_state_.pos.px += dist * cos ( theta );
+          p2d_state_.pos.py += dist * sin ( theta );
+        }
+      else
+        {
+          const double radius = dist / turn;
+          p2d_state_.pos.px += radius * ( sin ( theta + turn ) - sin ( theta ) );
+          p2d_state_.pos.py -= radius * ( cos ( theta + turn ) - cos ( theta ) );
+        }
+
+      p2d_state_.pos.pa = atan2 ( sin ( theta + turn ), cos ( theta + turn ) );
+    }
+
+  integrated_          = true;
+  integrated_time_     = time;
+  integrated_pos_[kL]  = pos[kL];
+  integrated_pos_[kR]  = pos[kR];
+
+  const player_position1d_data_t &left  = sample_[kL].state;
+  const player_position1d_data_t &right = sample_[kR].state;
+
+  p2d_state_.stall = left.stall || right.stall;
+
+  p2d_state_.vel.px = ( left.vel + right.vel ) / 2.0;
   p2d_state_.vel.py = 0.0;
-  p2d_state_.vel.pa = ( p1d_state_[kR].vel - p1d_state_[kL].vel ) / axis_length_;
+  p2d_state_.vel.pa = ( right.vel - left.vel ) / axis_length_;
 
-  const double dist = ( p1d_state_[kL].pos - p1d_state_prev_[kL].pos + p1d_state_[kR].pos - p1d_state_prev_[kR].pos ) / 2.0;
-  p2d_state_.pos.pa += ( ( p1d_state_[kR].pos - p1d_state_prev_[kR].pos ) -
-                         ( p1d_state_[kL].pos - p1d_state_prev_[kL].pos ) ) / ( 2.0 * axis_length_ );
-  p2d_state_.pos.px += dist * cos ( p2d_state_.pos.pa );
-  p2d_state_.pos.py += dist * sin ( p2d_state_.pos.pa );
+  double stamp = time;
 
   if ( HasSubscriptions() )
     Publish ( p2d_addr_,
               PLAYER_MSGTYPE_DATA,
               PLAYER_POSITION2D_DATA_STATE,
-              static_cast<void*> ( &p2d_state_ ) );
+              static_cast<void*> ( &p2d_state_ ),
+              0,
+              &stamp );
 
-  for ( int i = 0; i < kNumMotors; i++ )
-    p1d_state_prev_[i] = p1d_state_[i];
+  double now;
+  GlobalTime->GetTimeDouble ( &now );
+
+  pairs_++;
+  latency_sum_ += now - time;
+  latency_max_  = std::max ( latency_max_, now - time );
 
   PLAYER_MSG5 ( 4, "differential: odom update is ( px, py, pa )( vx, 0.0, va) = ( %7.2f, %7.2f, %7.2f )( %7.2f, 0.0, %7.2f)",
                 p2d_state_.pos.px, p2d_state_.pos.py, p2d_state_.pos.pa, p2d_state_.vel.px, p2d_state_.vel.pa );
+}
 
+// Back to the origin; wheel readings from before don't count any more
+// Those of wheels whose odometry is being reset are only taken once near zero (see AddSample)
+void Differential::ResetOdometry ( void )
+{
+  memset ( &p2d_state_, 0, sizeof ( p2d_state_ ) );
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    {
+      num_samples_[i] = 0;
+      resetting_[i]   = false;
+    }
+
+  integrated_ = false;
+}
+
+void Differential::LogStats ( void )
+{
+  PLAYER_MSG3 ( 1, "differential: %llu wheel pairs integrated, pose latency mean/max %6.2f/%6.2f ms",
+                static_cast<unsigned long long> ( pairs_ ),
+                pairs_ > 0 ? latency_sum_ * 1e3 / pairs_ : 0.0,
+                latency_max_ * 1e3 );
+
+  pairs_       = 0;
+  latency_sum_ = 0.0;
+  latency_max_ = 0.0;
 }
 
 int Differential::ProcessMessage ( QueuePointer  & resp_queue,
@@ -252,8 +394,7 @@ int Differential::ProcessMessage ( QueuePointer  & resp_queue,
 {
   if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_DATA, PLAYER_POSITION1D_DATA_STATE ) )
     {
-      // Store last odometry until next integration deadline
-      p1d_state_[ GetMotor ( hdr->addr ) ] = *static_cast<player_position1d_data_t*> ( data );
+      AddSample ( GetMotor ( hdr->addr ), *static_cast<player_position1d_data_t*> ( data ), hdr->timestamp );
       return 0;
     }
 
@@ -303,6 +444,10 @@ int Differential::ProcessMessage ( QueuePointer  & resp_queue,
     {
       p1d_dev_[kL]->PutMsg ( InQueue, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_RESET_ODOM, NULL, 0, NULL );
       p1d_dev_[kR]->PutMsg ( InQueue, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_RESET_ODOM, NULL, 0, NULL );
+      ResetOdometry();
+
+      for ( int i = 0; i < kNumMotors; i++ )
+        resetting_[i] = true;
       return 0;
     }
 
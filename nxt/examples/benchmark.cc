@@ -0,0 +1,290 @@
+#include <algorithm>
+#include "bluetooth.hh"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "emulator.hh"
+#include "nxtdc.hh"
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using namespace NXT;
+using namespace std;
+
+// Latency of brick commands, per opcode, as JSON (to stdout, or to a file)
+// Usage: benchmark [-n samples] [-d depth] [-o file] [link]
+//   link: "usb" (default), "usb:<serial, bus path or name>", "bluetooth:<device>",
+//         "emulator" (no latency), "emulator:usb" or "emulator:bluetooth"
+// Each case is timed:
+//   - without feedback: until the command is handed to the link;
+//   - with feedback, not pipelined: one round trip at a time;
+//   - with feedback, pipelined: depth commands kept in flight, each timed until its reply arrives;
+//   - motor polls: a single motor, and all of them in one snapshot.
+
+typedef struct
+  {
+    string          name;
+    int             opcode;     // -1 for composite operations
+    bool            feedback;
+    bool            pipelined;
+    vector<int64_t> latency_ns;
+    int64_t         elapsed_ns; // Of the whole case
+  } result;
+
+// Records when the reply arrives, from the transport thread
+class arrival : public reply_callback
+  {
+  public:
+    volatile int64_t at_ns;
+
+    virtual void on_reply ( const telegram & ) { at_ns = monotonic_ns(); };
+    virtual void on_error ( const nxt_error & ) { at_ns = -1; };
+  };
+
+telegram with_feedback ( const telegram &command, bool feedback )
+{
+  telegram t = command;
+  t[0] = feedback ? brick::direct_command_with_response : brick::direct_command_without_response;
+  return t;
+}
+
+result single ( brick &b, const string &name, const telegram &command, bool feedback, int samples )
+{
+  result r = { name, command[1], feedback, false, vector<int64_t>(), 0 };
+  r.latency_ns.reserve ( samples );
+
+  const telegram t = with_feedback ( command, feedback );
+  telegram       reply;
+
+  const int64_t start = monotonic_ns();
+
+  for ( int i = 0; i < samples; i++ )
+    {
+      const int64_t t0 = monotonic_ns();
+
+      if ( feedback )
+        b.execute ( t, reply );
+      else
+        b.execute ( t );
+
+      r.latency_ns.push_back ( monotonic_ns() - t0 );
+    }
+
+  r.elapsed_ns = monotonic_ns() - start;
+
+  return r;
+}
+
+result pipelined ( brick &b, const string &name, const telegram &command, int samples, int depth )
+{
+  result r = { name, command[1], true, true, vector<int64_t>(), 0 };
+  r.latency_ns.reserve ( samples );
+
+  const telegram t = with_feedback ( command, true );
+
+  vector<arrival>      arrivals ( depth );
+  vector<int64_t>      posted ( depth );
+  vector<reply_future> replies ( depth );
+
+  const int64_t start = monotonic_ns();
+
+  for ( int done = 0; done < samples; )
+    {
+      const int batch = std::min ( depth, samples - done );
+
+      for ( int i = 0; i < batch; i++ )
+        {
+          posted[i]  = monotonic_ns();
+          replies[i] = b.execute_async ( t, &arrivals[i] );
+        }
+
+      for ( int i = 0; i < batch; i++ )
+        {
+          replies[i].get();
+          r.latency_ns.push_back ( arrivals[i].at_ns - posted[i] );
+        }
+
+      done += batch;
+    }
+
+  r.elapsed_ns = monotonic_ns() - start;
+
+  return r;
+}
+
+result motor_poll ( brick &b, const string &name, uint8_t mask, int samples )
+{
+  result r = { name, -1, true, mask != mask_A, vector<int64_t>(), 0 };
+  r.latency_ns.reserve ( samples );
+
+  const int64_t start = monotonic_ns();
+
+  for ( int i = 0; i < samples; i++ )
+    {
+      const int64_t t0 = monotonic_ns();
+
+      if ( mask == mask_A )
+        b.get_motor_state ( A );
+      else
+        b.get_motor_states ( mask );
+
+      r.latency_ns.push_back ( monotonic_ns() - t0 );
+    }
+
+  r.elapsed_ns = monotonic_ns() - start;
+
+  return r;
+}
+
+// Nearest rank, over sorted samples
+double percentile_us ( const vector<int64_t> &sorted, double p )
+{
+  if ( sorted.empty() )
+    return 0.0;
+
+  size_t rank = static_cast<size_t> ( p * sorted.size() + 0.999999 );
+  rank = std::max ( rank, static_cast<size_t> ( 1 ) );
+
+  return sorted[rank - 1] * 1e-3;
+}
+
+void print_json ( FILE *out, const string &link, int samples, int depth, const vector<result> &results )
+{
+  fprintf ( out, "{\n" );
+  fprintf ( out, "  \"link\": \"%s\",\n", link.c_str() );
+  fprintf ( out, "  \"samples\": %d,\n", samples );
+  fprintf ( out, "  \"depth\": %d,\n", depth );
+  fprintf ( out, "  \"results\": [\n" );
+
+  for ( size_t i = 0; i < results.size(); i++ )
+    {
+      const result   &r = results[i];
+      vector<int64_t> sorted ( r.latency_ns );
+      std::sort ( sorted.begin(), sorted.end() );
+
+      char opcode[16];
+      if ( r.opcode < 0 )
+        strcpy ( opcode, "null" );
+      else
+        snprintf ( opcode, sizeof ( opcode ), "\"0x%02x\"", r.opcode );
+
+      fprintf ( out,
+                "    { \"name\": \"%s\", \"opcode\": %s, \"feedback\": %s, \"pipelined\": %s, \"samples\": %d, "
+                "\"rate_hz\": %.1f, \"latency_us\": { \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f } }%s\n",
+                r.name.c_str(), opcode,
+                r.feedback ? "true" : "false", r.pipelined ? "true" : "false",
+                static_cast<int> ( sorted.size() ),
+                r.elapsed_ns > 0 ? sorted.size() * 1e9 / r.elapsed_ns : 0.0,
+                percentile_us ( sorted, 0.50 ), percentile_us ( sorted, 0.90 ),
+                percentile_us ( sorted, 0.99 ), percentile_us ( sorted, 1.00 ),
+                i + 1 < results.size() ? "," : "" );
+    }
+
+  fprintf ( out, "  ]\n}\n" );
+}
+
+void run ( brick &b, const string &link, int samples, int depth, FILE *out )
+{
+  vector<result> results;
+
+  const telegram tone    = play_tone_telegram ( 440, 0 );
+  const telegram motor   = set_output_state_telegram ( A, 0, motor_brake, regulation_motor_idle, 0, motor_run_state_idle, 0 );
+  const telegram alive   = keep_alive_telegram();
+  const telegram output  = get_output_state_telegram ( A );
+  const telegram input   = get_input_values_telegram ( S1 );
+  const telegram battery = get_battery_level_telegram();
+
+  results.push_back ( single ( b, "play_tone",        tone,    false, samples ) );
+  results.push_back ( single ( b, "play_tone",        tone,    true,  samples ) );
+  results.push_back ( single ( b, "set_output_state", motor,   false, samples ) );
+  results.push_back ( single ( b, "set_output_state", motor,   true,  samples ) );
+  results.push_back ( single ( b, "keep_alive",       alive,   false, samples ) );
+  results.push_back ( single ( b, "keep_alive",       alive,   true,  samples ) );
+  results.push_back ( single ( b, "get_output_state", output,  true,  samples ) );
+  results.push_back ( single ( b, "get_input_values", input,   true,  samples ) );
+  results.push_back ( single ( b, "get_battery_level", battery, true, samples ) );
+
+  results.push_back ( pipelined ( b, "play_tone",         tone,    samples, depth ) );
+  results.push_back ( pipelined ( b, "get_output_state",  output,  samples, depth ) );
+  results.push_back ( pipelined ( b, "get_input_values",  input,   samples, depth ) );
+  results.push_back ( pipelined ( b, "get_battery_level", battery, samples, depth ) );
+
+  results.push_back ( motor_poll ( b, "motor_poll_single", mask_A,   samples ) );
+  results.push_back ( motor_poll ( b, "motor_poll_all",    mask_All, samples ) );
+
+  print_json ( out, link, samples, depth, results );
+}
+
+int main ( int argc, char *argv[] )
+{
+  int   samples = 200;
+  int   depth   = 8;
+  FILE *out     = stdout;
+  int   opt;
+
+  while ( ( opt = getopt ( argc, argv, "n:d:o:" ) ) != -1 )
+    switch ( opt )
+      {
+      case 'n':
+        samples = atoi ( optarg );
+        break;
+      case 'd':
+        depth = std::max ( 1, atoi ( optarg ) );
+        break;
+      case 'o':
+        out = fopen ( optarg, "w" );
+        if ( out == NULL )
+          {
+            perror ( optarg );
+            return 1;
+          }
+        break;
+      default:
+        fprintf ( stderr, "Usage: %s [-n samples] [-d depth] [-o file] [usb[:brick] | bluetooth:device | emulator[:usb|:bluetooth]]\n", argv[0] );
+        return 1;
+      }
+
+  const string link = optind < argc ? argv[optind] : "usb";
+
+  try
+    {
+      if ( link == "usb" || link.compare ( 0, 4, "usb:" ) == 0 )
+        {
+          brick b ( link.size() > 4 ? link.substr ( 4 ) : "" );
+          run ( b, link, samples, depth, out );
+        }
+      else if ( link.compare ( 0, 10, "bluetooth:" ) == 0 )
+        {
+          bluetooth_transport bt ( link.substr ( 10 ) );
+          brick b ( bt );
+          run ( b, link, samples, depth, out );
+        }
+      else if ( link.compare ( 0, 8, "emulator" ) == 0 )
+        {
+          const link_model model =
+            link == "emulator:usb"       ? kLinkUSB :
+            link == "emulator:bluetooth" ? kLinkBluetooth :
+            kLinkInstant;
+
+          emulated_transport emu ( model );
+          brick b ( emu );
+          run ( b, link, samples, depth, out );
+        }
+      else
+        {
+          fprintf ( stderr, "Unknown link: %s\n", link.c_str() );
+          return 1;
+        }
+    }
+  catch ( exception &e )
+    {
+      fprintf ( stderr, "%s\n", e.what() );
+      return 1;
+    }
+
+  if ( out != stdout )
+    fclose ( out );
+
+  return 0;
+}
@@ -0,0 +1,98 @@
+#include "bluetooth.hh"
+#include <cstdio>
+#include "emulator.hh"
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace NXT;
+using namespace std;
+
+// Talks to a brick over bluetooth, given its rfcomm device (e.g. /dev/rfcomm0) as argument.
+// Without argument, an emulated brick stands at the other end of a socketpair.
+
+const uint8_t kDistanceQuery[] = { 0x02, 0x42 };
+
+// Plays the brick side of the link: unframes telegrams for the emulator, frames its replies
+void *bridge ( void *arg )
+{
+  const int fd = *static_cast<int*> ( arg );
+
+  emulated_transport  brick;
+  emulated_ultrasonic echo ( 42 );
+  brick.attach ( S4, &echo );
+
+  uint8_t  prefix[2];
+  telegram buf;
+
+  while ( read ( fd, prefix, 2 ) == 2 )
+    {
+      buf.resize ( prefix[0] );
+      if ( read ( fd, buf.data(), buf.size() ) != buf.size() ) // Fine for a local socket
+        break;
+
+      brick.write ( buf );
+
+      if ( ! ( buf[0] & 0x80 ) )
+        {
+          brick.read ( buf );
+          prefix[0] = buf.size();
+          if ( write ( fd, prefix, 2 ) != 2 || write ( fd, buf.data(), buf.size() ) != buf.size() )
+            break;
+        }
+    }
+
+  return NULL;
+}
+
+void run ( bluetooth_transport &link )
+{
+  brick b ( link );
+
+  b.set_input_mode ( S4, sensor_type_lowspeed_9v, sensor_mode_raw );
+
+  // Motor commands issued faster than the link drains them replace each other
+  for ( int i = 0; i <= 100; i++ )
+    b.execute ( set_output_state_telegram ( B, i ) );
+  b.execute ( set_output_state_telegram ( B, 0 ) );
+
+  ls_transaction ls;
+  ls.start ( S4, kDistanceQuery, sizeof ( kDistanceQuery ), 1 );
+  while ( ! ls.step ( b ) )
+    usleep ( 10000 );
+
+  if ( ls.state() == ls_transaction::done )
+    printf ( "Distance: %d cm\n", ls.data() [0] );
+  else
+    printf ( "Failed: %s\n", ls.error().c_str() );
+
+  printf ( "Motor commands superseded: %llu of 102\n", static_cast<unsigned long long> ( link.superseded() ) );
+}
+
+int main ( int argc, char *argv[] )
+{
+  if ( argc > 1 )
+    {
+      bluetooth_transport link ( argv[1] );
+      run ( link );
+    }
+  else
+    {
+      int fds[2];
+      if ( socketpair ( AF_UNIX, SOCK_STREAM, 0, fds ) != 0 )
+        return 1;
+
+      pthread_t brick_side;
+      pthread_create ( &brick_side, NULL, bridge, &fds[1] );
+
+      {
+        bluetooth_transport link ( fds[0] );
+        run ( link );
+      }
+
+      close ( fds[0] );
+      pthread_join ( brick_side, NULL );
+      close ( fds[1] );
+    }
+
+  return 0;
+}
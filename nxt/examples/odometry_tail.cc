@@ -0,0 +1,64 @@
+#include <cstdio>
+#include <cstdlib>
+#include "odometry_ring.hh"
+#include <unistd.h>
+
+using namespace nxt_driver;
+
+// Follows the samples exported by a running nxt driver (see its odometry_ring option), printing them.
+// Usage: odometry_tail [ring file, default /dev/shm/nxt_odometry]
+// Builds on its own: g++ -Isrc examples/odometry_tail.cc src/odometry_ring.cc
+
+const int kBatch     = 64;
+const int kIdleSleep = 1000; // [us] When there is nothing new
+
+int main ( int argc, char *argv[] )
+{
+  const char *path = argc > 1 ? argv[1] : "/dev/shm/nxt_odometry";
+
+  OdometryReader reader;
+  odometry_sample samples[kBatch];
+  uint64_t        lost = 0;
+
+  while ( true )
+    {
+      if ( ! reader.is_open() && ! reader.open ( path ) )
+        {
+          fprintf ( stderr, "Waiting for %s\n", path );
+          sleep ( 1 );
+          continue;
+        }
+
+      const int got = reader.read ( samples, kBatch );
+
+      if ( got <= 0 )
+        {
+          usleep ( kIdleSleep );
+          continue;
+        }
+
+      if ( reader.lost() != lost )
+        {
+          printf ( "(%llu samples lost)\n", static_cast<unsigned long long> ( reader.lost() - lost ) );
+          lost = reader.lost();
+        }
+
+      for ( int i = 0; i < got; i++ )
+        {
+          const odometry_sample &s = samples[i];
+
+          if ( s.kind == odometry_motors )
+            printf ( "%8llu %.6f motors%s tacho [ %7d %7d %7d ] pose ( %7.3f %7.3f %6.3f )\n",
+                     static_cast<unsigned long long> ( s.index ), s.stamp_ns * 1e-9, s.stale ? " (stale)" : "",
+                     s.tacho[0], s.tacho[1], s.tacho[2], s.pose[0], s.pose[1], s.pose[2] );
+          else if ( s.kind == odometry_sensor )
+            printf ( "%8llu %.6f sensor S%d raw %d scaled %d value %.3f\n",
+                     static_cast<unsigned long long> ( s.index ), s.stamp_ns * 1e-9,
+                     s.mask + 1, s.raw, s.scaled, s.value );
+        }
+
+      fflush ( stdout );
+    }
+
+  return 0;
+}
@@ -1,4 +1,6 @@
 #include <cstdio>
+#include <cstring>
+#include "emulator.hh"
 #include "nxtdc.hh"
 #include <unistd.h>
 
@@ -13,18 +15,44 @@ void set_power ( brick &b, int power )
   b.set_motor ( C, -i );
  
   usleep ( 100000 );
-  const output_state st_b = b.get_motor_state ( B );
-  const output_state st_c = b.get_motor_state ( C );
+  const motor_states  st   = b.get_motor_states ( mask_B | mask_C );
+  const output_state &st_b = st.state[B];
+  const output_state &st_c = st.state[C];
   printf ( "Power: %4d B:[%6d/%6d/%6d/%6d] C:[%6d/%6d/%6d/%6d]\n",
            i,
            st_b.tacho_limit, st_b.tacho_count, st_b.block_tacho_count, st_b.rotation_count,
            st_c.tacho_limit, st_c.tacho_count, st_c.block_tacho_count, st_c.rotation_count );
 }
 
-int main ( void )
+void run ( brick &b );
+
+// Optional argument: serial number, bus path or name of the brick to use,
+//   or "emulator" for an emulated brick with USB timing
+int main ( int argc, char *argv[] )
 {
-  NXT::brick b;
+  if ( argc > 1 && strcmp ( argv[1], "emulator" ) == 0 )
+    {
+      emulated_transport link ( kLinkUSB );
+      brick b ( link );
+      run ( b );
+
+      return 0;
+    }
+
+  const vector<usb_brick> bricks = USB_transport::enumerate();
+  for ( size_t i = 0; i < bricks.size(); i++ )
+    printf ( "Found brick at %s: serial %s, name %s\n",
+             bricks[i].path.c_str(), bricks[i].serial.c_str(),
+             bricks[i].name.empty() ? "(in use)" : bricks[i].name.c_str() );
 
+  NXT::brick b ( argc > 1 ? argv[1] : "" );
+  run ( b );
+
+  return 0;
+}
+
+void run ( brick &b )
+{
   const NXT::versions v = b.get_version();
 
   printf ( "Connected to NXT brick named %s, protocol %d.%d firmware %d.%d\n",
@@ -44,8 +72,4 @@ int main ( void )
     set_power ( b, i );
 
   printf ( "Battery: %d\n", b.get_battery_level() );
-
-  // b.msg_rate_check();
-
-  return 0;
 }
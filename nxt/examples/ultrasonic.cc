@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstring>
+#include "emulator.hh"
+#include "nxtdc.hh"
+#include <unistd.h>
+
+using namespace NXT;
+using namespace std;
+
+// Reads an ultrasonic sensor at S4 while polling motors, never waiting for the I2C exchange.
+// Runs against an emulated brick unless "usb" is given as argument.
+
+const uint8_t kDistanceQuery[] = { 0x02, 0x42 };
+
+void run ( brick &b, emulated_ultrasonic *echo )
+{
+  b.set_input_mode ( S4, sensor_type_lowspeed_9v, sensor_mode_raw );
+
+  ls_transaction ls;
+
+  for ( int reading = 0; reading < 20; )
+    {
+      if ( ! ls.busy() )
+        {
+          if ( echo != NULL )
+            echo->set_distance ( 20 + reading * 5 );
+
+          ls.start ( S4, kDistanceQuery, sizeof ( kDistanceQuery ), 1 );
+        }
+
+      const motor_states st = b.get_motor_states ( mask_B | mask_C );
+
+      if ( ls.step ( b ) )
+        {
+          if ( ls.state() == ls_transaction::done )
+            printf ( "Distance: %3d cm  B:%6d C:%6d\n", ls.data() [0], st.state[B].tacho_count, st.state[C].tacho_count );
+          else
+            printf ( "Failed: %s\n", ls.error().c_str() );
+
+          ls = ls_transaction();
+          reading++;
+        }
+
+      usleep ( 5000 );
+    }
+}
+
+int main ( int argc, char *argv[] )
+{
+  if ( argc > 1 && strcmp ( argv[1], "usb" ) == 0 )
+    {
+      brick b;
+      run ( b, NULL );
+    }
+  else
+    {
+      emulated_transport  link;
+      emulated_ultrasonic echo;
+      link.attach ( S4, &echo );
+
+      brick b ( link );
+      run ( b, &echo );
+    }
+
+  return 0;
+}
@@ -0,0 +1,366 @@
+#include <cerrno>
+#include <cstring>
+#include "bluetooth.hh"
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace NXT;
+using namespace std;
+
+const int kPollTimeout = 100; // [ms] Bounds the time for the reader to notice stopping_
+
+// Motor commands without reply are the ones that a newer one for the same motor makes moot
+bool is_motor_command ( const telegram &buf )
+{
+  return buf.size() > 2 &&
+         buf[0] == brick::direct_command_without_response &&
+         buf[1] == command_set_output_state;
+}
+
+// Whether buf reads or changes the motor on port (All addressing all of them)
+bool addresses_motor ( const telegram &buf, uint8_t port )
+{
+  if ( buf.size() <= 2 ||
+       ( buf[1] != command_set_output_state &&
+         buf[1] != command_get_output_state &&
+         buf[1] != command_reset_motor_position ) )
+    return false;
+
+  return buf[2] == port || buf[2] == All || port == All;
+}
+
+bluetooth_transport::bluetooth_transport ( const string &device )
+    : fd_ ( ::open ( device.c_str(), O_RDWR | O_NOCTTY ) ),
+    owns_fd_ ( true )
+{
+  if ( fd_ < 0 )
+    throw runtime_error ( "bluetooth_transport: cannot open " + device + ": " + strerror ( errno ) );
+
+  start();
+}
+
+bluetooth_transport::bluetooth_transport ( int fd, bool owns_fd ) : fd_ ( fd ), owns_fd_ ( owns_fd )
+{
+  start();
+}
+
+void bluetooth_transport::start ( void )
+{
+  stopping_     = false;
+  failed_       = false;
+  first_queued_ = 0;
+  num_queued_   = 0;
+  superseded_   = 0;
+  first_reply_  = 0;
+  num_replies_  = 0;
+
+  // rfcomm devices and ptys are ttys: the line discipline must not touch the binary telegrams
+  struct termios tio;
+  if ( isatty ( fd_ ) && tcgetattr ( fd_, &tio ) == 0 )
+    {
+      cfmakeraw ( &tio );
+      tcsetattr ( fd_, TCSANOW, &tio );
+    }
+
+  pthread_mutex_init ( &queue_mutex_, NULL );
+  pthread_cond_init ( &queued_, NULL );
+  pthread_cond_init ( &dequeued_, NULL );
+  pthread_mutex_init ( &reply_mutex_, NULL );
+  pthread_cond_init ( &replied_, NULL );
+
+  if ( pthread_create ( &writer_, NULL, write_loop, this ) != 0 )
+    throw runtime_error ( "bluetooth_transport: cannot start writer thread." );
+  if ( pthread_create ( &reader_, NULL, read_loop, this ) != 0 )
+    throw runtime_error ( "bluetooth_transport: cannot start reader thread." );
+}
+
+bluetooth_transport::~bluetooth_transport ( void )
+{
+  pthread_mutex_lock ( &queue_mutex_ );
+  stopping_ = true;
+  pthread_cond_broadcast ( &queued_ );
+  pthread_cond_broadcast ( &dequeued_ );
+  pthread_mutex_unlock ( &queue_mutex_ );
+
+  pthread_join ( writer_, NULL );
+  pthread_join ( reader_, NULL );
+
+  pthread_cond_destroy ( &replied_ );
+  pthread_mutex_destroy ( &reply_mutex_ );
+  pthread_cond_destroy ( &dequeued_ );
+  pthread_cond_destroy ( &queued_ );
+  pthread_mutex_destroy ( &queue_mutex_ );
+
+  if ( owns_fd_ )
+    close ( fd_ );
+}
+
+void bluetooth_transport::write ( const telegram &buf )
+{
+  pthread_mutex_lock ( &queue_mutex_ );
+
+  // Only the last queued telegram for the motor can be replaced: an earlier one would jump
+  //   ahead of what was queued after it (e.g. a position reset, or a command to all motors)
+  if ( is_motor_command ( buf ) )
+    for ( int i = num_queued_ - 1; i >= 0; i-- )
+      {
+        telegram &queued = queue_[ ( first_queued_ + i ) % kMaxQueued ];
+
+        if ( ! addresses_motor ( queued, buf[2] ) )
+          continue;
+
+        if ( is_motor_command ( queued ) && queued[2] == buf[2] )
+          {
+            queued = buf;
+            superseded_++;
+            pthread_mutex_unlock ( &queue_mutex_ );
+            return;
+          }
+
+        break;
+      }
+
+  while ( num_queued_ == kMaxQueued && ! stopping_ && ! failed_ )
+    pthread_cond_wait ( &dequeued_, &queue_mutex_ );
+
+  if ( failed_ || stopping_ )
+    {
+      pthread_mutex_unlock ( &queue_mutex_ );
+
+      pthread_mutex_lock ( &reply_mutex_ );
+      const string error = error_.empty() ? string ( "bluetooth_transport: closed" ) : error_;
+      pthread_mutex_unlock ( &reply_mutex_ );
+
+      throw nxt_error ( error );
+    }
+
+  queue_[ ( first_queued_ + num_queued_ ) % kMaxQueued ] = buf;
+  num_queued_++;
+
+  pthread_cond_signal ( &queued_ );
+  pthread_mutex_unlock ( &queue_mutex_ );
+}
+
+void bluetooth_transport::post ( const telegram &buf, bool )
+{
+  write ( buf );
+}
+
+void bluetooth_transport::read ( telegram &reply )
+{
+  pthread_mutex_lock ( &reply_mutex_ );
+
+  while ( num_replies_ == 0 && error_.empty() )
+    pthread_cond_wait ( &replied_, &reply_mutex_ );
+
+  if ( num_replies_ == 0 )
+    {
+      const string error = error_;
+      pthread_mutex_unlock ( &reply_mutex_ );
+      throw nxt_error ( error );
+    }
+
+  reply        = replies_[first_reply_];
+  first_reply_ = ( first_reply_ + 1 ) % kMaxReplies;
+  num_replies_--;
+
+  pthread_mutex_unlock ( &reply_mutex_ );
+}
+
+void bluetooth_transport::set_listener ( transport_listener *listener )
+{
+  pthread_mutex_lock ( &reply_mutex_ );
+  listener_ = listener;
+  pthread_mutex_unlock ( &reply_mutex_ );
+}
+
+uint64_t bluetooth_transport::superseded ( void )
+{
+  pthread_mutex_lock ( &queue_mutex_ );
+  const uint64_t superseded = superseded_;
+  pthread_mutex_unlock ( &queue_mutex_ );
+
+  return superseded;
+}
+
+// Reported once: replies pending in the brick are failed through the listener
+void bluetooth_transport::fail ( const string &error )
+{
+  pthread_mutex_lock ( &reply_mutex_ );
+
+  if ( error_.empty() )
+    {
+      stats_.errors.add();
+
+      error_ = "bluetooth_transport: " + error;
+
+      if ( listener_ != NULL )
+        listener_->on_error ( error_ );
+
+      pthread_cond_broadcast ( &replied_ );
+    }
+
+  pthread_mutex_unlock ( &reply_mutex_ );
+
+  pthread_mutex_lock ( &queue_mutex_ );
+  failed_ = true;
+  pthread_cond_broadcast ( &dequeued_ );
+  pthread_mutex_unlock ( &queue_mutex_ );
+}
+
+bool bluetooth_transport::read_fully ( uint8_t *data, size_t size )
+{
+  size_t done = 0;
+
+  while ( done < size && ! stopping_ )
+    {
+      struct pollfd pfd = { fd_, POLLIN, 0 };
+
+      const int ready = poll ( &pfd, 1, kPollTimeout );
+      if ( ready < 0 && errno != EINTR )
+        {
+          fail ( strerror ( errno ) );
+          return false;
+        }
+      else if ( ready <= 0 )
+        continue;
+
+      const ssize_t got = ::read ( fd_, data + done, size - done );
+      if ( got == 0 )
+        {
+          fail ( "link closed" );
+          return false;
+        }
+      else if ( got < 0 )
+        {
+          if ( errno == EINTR || errno == EAGAIN )
+            continue;
+
+          fail ( strerror ( errno ) );
+          return false;
+        }
+
+      done += got;
+    }
+
+  return done == size;
+}
+
+bool bluetooth_transport::write_fully ( const uint8_t *data, size_t size )
+{
+  size_t done = 0;
+
+  while ( done < size )
+    {
+      const ssize_t put = ::write ( fd_, data + done, size - done );
+      if ( put < 0 )
+        {
+          if ( errno == EINTR || errno == EAGAIN )
+            continue;
+
+          fail ( strerror ( errno ) );
+          return false;
+        }
+
+      done += put;
+    }
+
+  return true;
+}
+
+void *bluetooth_transport::write_loop ( void *self )
+{
+  bluetooth_transport &bt = *static_cast<bluetooth_transport*> ( self );
+
+  uint8_t out[kMaxQueued * ( kMaxTelegramSize + 2 )];
+
+  while ( true )
+    {
+      size_t size = 0;
+      int    sent = 0;
+
+      pthread_mutex_lock ( &bt.queue_mutex_ );
+
+      while ( bt.num_queued_ == 0 && ! bt.stopping_ )
+        pthread_cond_wait ( &bt.queued_, &bt.queue_mutex_ );
+
+      if ( bt.stopping_ )
+        {
+          pthread_mutex_unlock ( &bt.queue_mutex_ );
+          break;
+        }
+
+      // Everything queued goes in one write; what is posted meanwhile waits for the next one
+      for ( ; bt.num_queued_ > 0; bt.num_queued_-- )
+        {
+          const telegram &buf = bt.queue_[bt.first_queued_];
+
+          out[size++] = buf.size();
+          out[size++] = 0;
+          memcpy ( out + size, buf.data(), buf.size() );
+          size += buf.size();
+
+          bt.first_queued_ = ( bt.first_queued_ + 1 ) % kMaxQueued;
+          sent++;
+        }
+
+      pthread_cond_broadcast ( &bt.dequeued_ );
+      pthread_mutex_unlock ( &bt.queue_mutex_ );
+
+      if ( ! bt.write_fully ( out, size ) )
+        break;
+
+      bt.stats_.telegrams_out.add ( sent );
+      bt.stats_.bytes_out.add ( size );
+    }
+
+  return NULL;
+}
+
+void *bluetooth_transport::read_loop ( void *self )
+{
+  bluetooth_transport &bt = *static_cast<bluetooth_transport*> ( self );
+
+  uint8_t  prefix[2];
+  telegram reply;
+
+  while ( bt.read_fully ( prefix, sizeof ( prefix ) ) )
+    {
+      const int size = prefix[0] | ( prefix[1] << 8 );
+      if ( size < 3 || size > kMaxTelegramSize )
+        {
+          bt.fail ( "bad frame length" );
+          break;
+        }
+
+      reply.resize ( size );
+      if ( ! bt.read_fully ( reply.data(), size ) )
+        break;
+
+      bt.stats_.telegrams_in.add();
+      bt.stats_.bytes_in.add ( sizeof ( prefix ) + size );
+
+      pthread_mutex_lock ( &bt.reply_mutex_ );
+
+      if ( bt.listener_ != NULL )
+        bt.listener_->on_read ( reply );
+      else
+        {
+          if ( bt.num_replies_ == kMaxReplies ) // Nobody reads them: oldest go first
+            {
+              bt.first_reply_ = ( bt.first_reply_ + 1 ) % kMaxReplies;
+              bt.num_replies_--;
+            }
+
+          bt.replies_[ ( bt.first_reply_ + bt.num_replies_ ) % kMaxReplies ] = reply;
+          bt.num_replies_++;
+          pthread_cond_signal ( &bt.replied_ );
+        }
+
+      pthread_mutex_unlock ( &bt.reply_mutex_ );
+    }
+
+  return NULL;
+}
@@ -0,0 +1,77 @@
+#ifndef _nxt_bluetooth_
+#define _nxt_bluetooth_
+
+#include "nxtdc.hh"
+
+namespace NXT
+  {
+
+  // Brick over a bluetooth serial link (RFCOMM), where each telegram goes prefixed by
+  //   its length, 2 bytes little-endian.
+  // Works on any file descriptor carrying that framing, so a pty or a socketpair can stand in for the brick.
+  // Round trips over bluetooth take ~30ms, so:
+  //   - queries are pipelined: a reader thread delivers replies as they arrive;
+  //   - whatever is queued when the link is free goes out in a single write;
+  //   - a motor command still queued is replaced in place by a newer one for the same motor,
+  //     unless something else for that motor was queued after it.
+  class bluetooth_transport : public transport
+    {
+    public:
+      // Opens a serial device bound to the brick, e.g. /dev/rfcomm0 (see rfcomm(1))
+      explicit bluetooth_transport ( const string &device );
+
+      // Uses an already connected fd, which is closed on destruction only if owned
+      explicit bluetooth_transport ( int fd, bool owns_fd = false );
+
+      ~bluetooth_transport ( void );
+
+      // Writes are queued; replies are told apart by the framing, so expect_reply is irrelevant
+      virtual void write ( const telegram &buf );
+      virtual void post ( const telegram &buf, bool expect_reply );
+
+      // Replies arriving while there is no listener
+      virtual void read ( telegram &reply );
+
+      virtual void set_listener ( transport_listener *listener );
+
+      uint64_t superseded ( void ); // Motor commands dropped before being sent
+
+    private:
+      static const int kMaxQueued  = 32;
+      static const int kMaxReplies = 32;
+
+      int           fd_;
+      bool          owns_fd_;
+      volatile bool stopping_;
+      volatile bool failed_;   // Nothing else will be sent
+      string        error_;    // Of the link, once it failed
+
+      pthread_t       writer_;
+      pthread_t       reader_;
+
+      pthread_mutex_t queue_mutex_;
+      pthread_cond_t  queued_;
+      pthread_cond_t  dequeued_;
+      telegram        queue_[kMaxQueued]; // Ring of telegrams not yet sent
+      int             first_queued_;
+      int             num_queued_;
+      uint64_t        superseded_;
+
+      pthread_mutex_t reply_mutex_;       // Held while delivering to the listener
+      pthread_cond_t  replied_;
+      telegram        replies_[kMaxReplies];
+      int             first_reply_;
+      int             num_replies_;
+
+      void start ( void );
+      void fail ( const string &error );
+      bool read_fully ( uint8_t *data, size_t size );
+      bool write_fully ( const uint8_t *data, size_t size );
+
+      static void *write_loop ( void *self );
+      static void *read_loop ( void *self );
+    };
+
+}
+
+#endif
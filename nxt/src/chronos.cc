@@ -1,14 +1,15 @@
 #include <cerrno>
 #include "chronos.hh"
 #include <cstring>
+#include "nxtdc.hh"
 #include <stdexcept>
-#include <sys/time.h>
+#include <time.h>
 
 using namespace nxt_driver;
 
-Chronos::Chronos ( double seconds_since_epoch )
+Chronos::Chronos ( double start )
 {
-  clock_ = seconds_since_epoch;
+  clock_ = start;
 }
 
 double Chronos::elapsed ( void ) const
@@ -23,12 +24,80 @@ void Chronos::reset ( void )
 
 double Chronos::now ( void )
   {
-    struct timeval clock;
+    return static_cast<double> ( NXT::monotonic_ns() ) * 1e-9;
+  }
+
+PeriodicTimer::PeriodicTimer ( double period ) :
+    period_ns_ ( static_cast<int64_t> ( period * 1e9 ) ),
+    next_ns_ ( now_ns() ),
+    last_late_ns_ ( 0 )
+{
+  if ( period_ns_ <= 0 )
+    throw std::runtime_error ( "PeriodicTimer: period must be positive" );
+
+  reset_stats();
+}
+
+void PeriodicTimer::restart ( void )
+{
+  next_ns_ = now_ns();
+  reset_stats();
+}
+
+bool PeriodicTimer::due ( void ) const
+  {
+    return now_ns() >= next_ns_;
+  }
+
+double PeriodicTimer::remaining ( void ) const
+  {
+    const int64_t left = next_ns_ - now_ns();
+    return left > 0 ? left * 1e-9 : 0.0;
+  }
+
+void PeriodicTimer::sleep ( void ) const
+  {
+    struct timespec deadline;
+    deadline.tv_sec  = next_ns_ / 1000000000LL;
+    deadline.tv_nsec = next_ns_ % 1000000000LL;
 
-    if ( gettimeofday ( &clock, NULL ) != 0 )
-      throw std::runtime_error ( strerror ( errno ) );
+    // Returns the error rather than setting errno; signals just resume the sleep
+    int error;
+    while ( ( error = clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL ) ) == EINTR )
+      ;
 
-    return
-      static_cast<double> ( clock.tv_sec ) +
-      static_cast<double> ( clock.tv_usec ) * 1e-6;
-  }
\ No newline at end of file
+    if ( error != 0 )
+      throw std::runtime_error ( strerror ( error ) );
+  }
+
+bool PeriodicTimer::start_cycle ( void )
+{
+  const int64_t now = now_ns();
+  if ( now < next_ns_ )
+    return false;
+
+  last_late_ns_ = now - next_ns_;
+
+  const int64_t skipped = last_late_ns_ / period_ns_;
+
+  next_ns_ += ( skipped + 1 ) * period_ns_;
+
+  stats_.cycles++;
+  stats_.missed      += skipped;
+  stats_.late_sum_ns += last_late_ns_;
+  if ( last_late_ns_ > stats_.late_max_ns )
+    stats_.late_max_ns = last_late_ns_;
+
+  return true;
+}
+
+void PeriodicTimer::reset_stats ( void )
+{
+  memset ( &stats_, 0, sizeof ( stats_ ) );
+}
+
+// The same clock as the brick stamps its round trips with
+int64_t PeriodicTimer::now_ns ( void )
+{
+  return NXT::monotonic_ns();
+}
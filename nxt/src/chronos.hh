@@ -1,13 +1,16 @@
 #ifndef _chronos_
 #define _chronos_
 
+#include <stdint.h>
+
 namespace nxt_driver
   {
 
+  // Seconds on the monotonic clock, so NTP or date changes don't disturb it
   class Chronos
     {
     public:
-      Chronos ( double seconds_since_epoch = now() );
+      Chronos ( double start = now() );
       double elapsed ( void ) const;
       void reset ( void );
 
@@ -17,6 +20,50 @@ namespace nxt_driver
       static double now ( void ) ;
     };
 
+  // Absolute deadlines every period on the monotonic clock, in integer nanoseconds
+  // A cycle starting late makes the next one shorter, so the loop doesn't drift;
+  //   deadlines already passed when a cycle starts are skipped, and counted as missed.
+  // Meant for a loop that also waits for messages: it waits for them until the deadline
+  //   is near (see remaining), then sleeps the rest on the monotonic clock (see sleep).
+  class PeriodicTimer
+    {
+    public:
+      typedef struct
+        {
+          uint64_t cycles;
+          uint64_t missed;      // Deadlines skipped
+          int64_t  late_max_ns; // Of cycle starts after their deadline, i.e. jitter
+          int64_t  late_sum_ns;
+        } timer_stats;
+
+      explicit PeriodicTimer ( double period );
+
+      int64_t period_ns ( void ) const { return period_ns_; };
+      int64_t deadline_ns ( void ) const { return next_ns_; };
+
+      void    restart ( void );         // Deadlines from now on, with stats cleared
+
+      bool    due ( void ) const;
+      double  remaining ( void ) const; // [s] Till the deadline, 0 if due
+      void    sleep ( void ) const;     // Till the deadline, uninterrupted
+
+      // Starts the cycle of the current deadline, if due, and moves on to the next one
+      // Returns whether it was due
+      bool    start_cycle ( void );
+      int64_t last_late_ns ( void ) const { return last_late_ns_; };
+
+      const timer_stats & stats ( void ) const { return stats_; };
+      void                reset_stats ( void );
+
+      static int64_t now_ns ( void ); // NXT::monotonic_ns
+
+    private:
+      int64_t     period_ns_;
+      int64_t     next_ns_;
+      int64_t     last_late_ns_;
+      timer_stats stats_;
+    };
+
 }
 
 #endif
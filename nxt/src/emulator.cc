@@ -0,0 +1,650 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include "emulator.hh"
+
+using namespace NXT;
+using namespace std;
+
+const uint8_t kUltrasonicAddress  = 0x02;
+const uint8_t kUltrasonicDistance = 0x42; // First of eight echoes
+
+// Identification registers of LEGO I2C sensors: version, product and type, 8 bytes each
+const char kUltrasonicIds[] = "V1.0\0\0\0\0LEGO\0\0\0\0Sonar\0\0\0";
+
+// Statuses used in replies
+const uint8_t kStatusSuccess       = 0x00;
+const uint8_t kStatusBusError      = 0xDD;
+const uint8_t kStatusNotConfigured = 0xE0;
+const uint8_t kStatusUnknownOpcode = 0xBE;
+const uint8_t kStatusOutOfRange    = 0xC0;
+
+emulated_ultrasonic::emulated_ultrasonic ( uint8_t distance_cm, int busy_polls )
+    : distance_cm_ ( distance_cm ),
+    busy_polls_ ( busy_polls )
+{
+  ;
+}
+
+void emulated_ultrasonic::set_distance ( uint8_t distance_cm )
+{
+  distance_cm_ = distance_cm;
+}
+
+void emulated_ultrasonic::set_busy_polls ( int busy_polls )
+{
+  busy_polls_ = busy_polls;
+}
+
+int emulated_ultrasonic::busy_polls ( void ) const
+  {
+    return busy_polls_;
+  }
+
+void emulated_ultrasonic::transact ( const uint8_t *tx, uint8_t tx_len, uint8_t *rx, uint8_t rx_len )
+{
+  memset ( rx, 0, rx_len );
+
+  if ( tx_len < 2 || tx[0] != kUltrasonicAddress )
+    return;
+
+  for ( int i = 0; i < rx_len; i++ )
+    {
+      const int reg = tx[1] + i;
+
+      if ( reg < static_cast<int> ( sizeof ( kUltrasonicIds ) - 1 ) )
+        rx[i] = kUltrasonicIds[reg];
+      else if ( reg == kUltrasonicDistance )
+        rx[i] = distance_cm_;
+      else if ( reg > kUltrasonicDistance && reg < kUltrasonicDistance + 8 )
+        rx[i] = 255; // No further echoes
+    }
+}
+
+// Motor model: speed follows a first order response to power, whose time constant depends
+//   on whether the motor is driven, braking (shorted) or coasting
+const double kSpeedPerPower = 9.0;  // [deg/s per %] ~150 rpm at full power with fresh batteries
+const double kTauDriven     = 0.10; // [s]
+const double kTauBraking    = 0.02;
+const double kTauCoasting   = 0.40;
+const double kMaxStep       = 0.001; // [s] Of physics integration, so limits and ramps are honoured
+
+const uint32_t kSleepTimeLimit = 600000; // [ms] Reported by keep alive
+
+const char    kBrickName[]        = "Emulated";
+const uint8_t kBluetoothAddress[] = { 0x00, 0x16, 0x53, 0x00, 0x00, 0x01 };
+
+emulated_transport::emulated_transport ( const link_model &model )
+    : stopping_ ( false ),
+    model_ ( model ),
+    seed_ ( 1 ),
+    battery_mV_ ( 8000 ),
+    now_ns_ ( monotonic_ns() ),
+    first_ ( 0 ),
+    num_in_flight_ ( 0 ),
+    num_processed_ ( 0 )
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init ( &attr );
+  pthread_condattr_setclock ( &attr, CLOCK_MONOTONIC );
+
+  pthread_mutex_init ( &mutex_, NULL );
+  pthread_mutex_init ( &listener_mutex_, NULL );
+  pthread_cond_init ( &changed_, &attr );
+  pthread_condattr_destroy ( &attr );
+
+  for ( int i = 0; i < kNumSensors; i++ )
+    {
+      ports_[i].device     = NULL;
+      ports_[i].type       = sensor_type_none;
+      ports_[i].mode       = sensor_mode_raw;
+      ports_[i].raw        = 0;
+      ports_[i].scaled     = 0;
+      ports_[i].answered   = false;
+      ports_[i].polls_left = 0;
+      ports_[i].rx_len     = 0;
+    }
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    {
+      motor &m = motors_[i];
+      memset ( &m.out, 0, sizeof ( m.out ) );
+      m.out.motor      = i;
+      m.out.mode       = static_cast<motor_modes> ( 0 );
+      m.out.regulation = regulation_motor_idle;
+      m.out.state      = motor_run_state_idle;
+      m.start_power    = 0;
+      m.speed          = 0.0;
+      m.position       = 0.0;
+      m.block_zero     = 0.0;
+      m.rotation_zero  = 0.0;
+    }
+
+  if ( pthread_create ( &delivery_thread_, NULL, delivery_loop, this ) != 0 )
+    throw runtime_error ( "emulated_transport: cannot start delivery thread." );
+}
+
+emulated_transport::~emulated_transport ( void )
+{
+  pthread_mutex_lock ( &mutex_ );
+  stopping_ = true;
+  pthread_cond_broadcast ( &changed_ );
+  pthread_mutex_unlock ( &mutex_ );
+
+  pthread_join ( delivery_thread_, NULL );
+
+  pthread_cond_destroy ( &changed_ );
+  pthread_mutex_destroy ( &listener_mutex_ );
+  pthread_mutex_destroy ( &mutex_ );
+}
+
+void emulated_transport::set_model ( const link_model &model )
+{
+  pthread_mutex_lock ( &mutex_ );
+  model_ = model;
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void emulated_transport::attach ( sensors port, i2c_device *device )
+{
+  pthread_mutex_lock ( &mutex_ );
+  ports_[port].device = device;
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void emulated_transport::set_input_values ( sensors port, uint16_t raw, int16_t scaled )
+{
+  pthread_mutex_lock ( &mutex_ );
+  ports_[port].raw    = raw;
+  ports_[port].scaled = scaled;
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void emulated_transport::set_battery_level ( uint16_t millivolts )
+{
+  pthread_mutex_lock ( &mutex_ );
+  battery_mV_ = millivolts;
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+output_state emulated_transport::motor_state ( motors motor )
+{
+  pthread_mutex_lock ( &mutex_ );
+  advance ( monotonic_ns() );
+  const output_state state = motors_[motor].out;
+  pthread_mutex_unlock ( &mutex_ );
+
+  return state;
+}
+
+void emulated_transport::write ( const telegram &buf )
+{
+  if ( buf.size() < 2 )
+    throw nxt_error ( "emulated_transport: telegram too short" );
+
+  pthread_mutex_lock ( &mutex_ );
+
+  while ( num_in_flight_ == kMaxInFlight && ! stopping_ )
+    pthread_cond_wait ( &changed_, &mutex_ );
+
+  const int64_t now    = monotonic_ns();
+  const int64_t jitter = model_.jitter_ns > 0 ? rand_r ( &seed_ ) % model_.jitter_ns : 0;
+  const int64_t trip   = model_.latency_ns + jitter;
+
+  in_flight &f = flight ( num_in_flight_ );
+
+  f.data        = buf;
+  f.processed   = false;
+  f.wants_reply = ! ( buf[0] & 0x80 );
+  f.lost        = f.wants_reply && rand_r ( &seed_ ) < model_.error_rate * RAND_MAX;
+  f.arrival_ns  = now + trip / 2;
+  f.due_ns      = now + trip;
+
+  // Links don't reorder
+  if ( num_in_flight_ > 0 )
+    {
+      const in_flight &prev = flight ( num_in_flight_ - 1 );
+      f.arrival_ns = std::max ( f.arrival_ns, prev.arrival_ns );
+      f.due_ns     = std::max ( f.due_ns, prev.due_ns );
+    }
+
+  num_in_flight_++;
+
+  stats_.telegrams_out.add();
+  stats_.bytes_out.add ( buf.size() );
+
+  pthread_cond_broadcast ( &changed_ );
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void emulated_transport::post ( const telegram &buf, bool )
+{
+  write ( buf );
+}
+
+void emulated_transport::read ( telegram &reply )
+{
+  pthread_mutex_lock ( &mutex_ );
+
+  // The delivery thread leaves replies in the ring, due or not, only while there is no listener
+  while ( ! stopping_ &&
+          ( num_processed_ == 0 || ! flight ( 0 ).wants_reply || flight ( 0 ).due_ns > monotonic_ns() ) )
+    {
+      if ( num_processed_ == 0 || ! flight ( 0 ).wants_reply )
+        pthread_cond_wait ( &changed_, &mutex_ );
+      else
+        {
+          struct timespec due;
+          due.tv_sec  = flight ( 0 ).due_ns / 1000000000LL;
+          due.tv_nsec = flight ( 0 ).due_ns % 1000000000LL;
+          pthread_cond_timedwait ( &changed_, &mutex_, &due );
+        }
+    }
+
+  if ( stopping_ )
+    {
+      pthread_mutex_unlock ( &mutex_ );
+      throw nxt_error ( "emulated_transport: closed" );
+    }
+
+  const bool lost = flight ( 0 ).lost;
+  reply = flight ( 0 ).data;
+  pop();
+
+  if ( lost )
+    stats_.errors.add();
+  else
+    {
+      stats_.telegrams_in.add();
+      stats_.bytes_in.add ( reply.size() );
+    }
+
+  pthread_mutex_unlock ( &mutex_ );
+
+  if ( lost )
+    throw nxt_error ( "emulated_transport: injected link error" );
+}
+
+void emulated_transport::set_listener ( transport_listener *listener )
+{
+  pthread_mutex_lock ( &listener_mutex_ );
+  listener_ = listener;
+  pthread_mutex_unlock ( &listener_mutex_ );
+
+  pthread_mutex_lock ( &mutex_ );
+  pthread_cond_broadcast ( &changed_ );
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void emulated_transport::pop ( void )
+{
+  first_ = ( first_ + 1 ) % kMaxInFlight;
+  num_in_flight_--;
+  num_processed_--;
+  pthread_cond_broadcast ( &changed_ );
+}
+
+void *emulated_transport::delivery_loop ( void *self )
+{
+  emulated_transport &emu = *static_cast<emulated_transport*> ( self );
+
+  pthread_mutex_lock ( &emu.mutex_ );
+
+  while ( ! emu.stopping_ )
+    {
+      const int64_t now = monotonic_ns();
+
+      // Telegrams without reply leave the ring as soon as they take effect
+      if ( emu.num_processed_ > 0 && ! emu.flight ( 0 ).wants_reply )
+        {
+          emu.pop();
+          continue;
+        }
+
+      // Earliest of the next arrival and the next reply due
+      int64_t next = -1;
+
+      if ( emu.num_processed_ < emu.num_in_flight_ )
+        {
+          in_flight &f = emu.flight ( emu.num_processed_ );
+
+          if ( f.arrival_ns <= now )
+            {
+              telegram reply;
+              reply.append_byte ( brick::reply ).append_byte ( f.data[1] ).append_byte ( kStatusSuccess );
+
+              emu.advance ( f.arrival_ns );
+              emu.process ( f.data, reply );
+
+              f.data      = reply;
+              f.processed = true;
+              emu.num_processed_++;
+              pthread_cond_broadcast ( &emu.changed_ );
+              continue;
+            }
+
+          next = f.arrival_ns;
+        }
+
+      if ( emu.num_processed_ > 0 && emu.listener_ != NULL )
+        {
+          const in_flight &f = emu.flight ( 0 );
+
+          if ( f.due_ns <= now )
+            {
+              const in_flight done = f;
+              emu.pop();
+
+              if ( done.lost )
+                emu.stats_.errors.add();
+              else
+                {
+                  emu.stats_.telegrams_in.add();
+                  emu.stats_.bytes_in.add ( done.data.size() );
+                }
+
+              pthread_mutex_unlock ( &emu.mutex_ );
+              pthread_mutex_lock ( &emu.listener_mutex_ );
+
+              if ( emu.listener_ == NULL )
+                ;
+              else if ( done.lost )
+                emu.listener_->on_error ( "emulated_transport: injected link error" );
+              else
+                emu.listener_->on_read ( done.data );
+
+              pthread_mutex_unlock ( &emu.listener_mutex_ );
+              pthread_mutex_lock ( &emu.mutex_ );
+              continue;
+            }
+
+          next = next < 0 ? f.due_ns : std::min ( next, f.due_ns );
+        }
+
+      if ( next < 0 )
+        pthread_cond_wait ( &emu.changed_, &emu.mutex_ );
+      else
+        {
+          struct timespec until;
+          until.tv_sec  = next / 1000000000LL;
+          until.tv_nsec = next % 1000000000LL;
+          pthread_cond_timedwait ( &emu.changed_, &emu.mutex_, &until );
+        }
+    }
+
+  pthread_mutex_unlock ( &emu.mutex_ );
+
+  return NULL;
+}
+
+void emulated_transport::advance ( int64_t now_ns )
+{
+  if ( now_ns <= now_ns_ )
+    return;
+
+  double dt = ( now_ns - now_ns_ ) * 1e-9;
+  now_ns_ = now_ns;
+
+  while ( dt > 0.0 )
+    {
+      const double step = std::min ( dt, kMaxStep );
+
+      for ( int i = 0; i < kNumMotors; i++ )
+        advance ( motors_[i], step );
+
+      dt -= step;
+    }
+}
+
+void emulated_transport::advance ( motor &m, double dt )
+{
+  output_state &out = m.out;
+
+  const double moved = fabs ( m.position - m.block_zero );
+  const bool   limit = out.tacho_limit > 0 && out.state != motor_run_state_idle;
+
+  // Ramps go linearly from the power at their start to the commanded one along the limit,
+  //   never under 1% on the way, or those from or to rest would never leave it or reach their end
+  double power = out.power_pct;
+  if ( limit && ( out.state == motor_run_state_ramp_up || out.state == motor_run_state_rampdown ) )
+    {
+      power = m.start_power + ( out.power_pct - m.start_power ) * std::min ( 1.0, moved / out.tacho_limit );
+
+      const int direction = out.power_pct != 0 ? out.power_pct : m.start_power;
+      if ( fabs ( power ) < 1.0 && direction != 0 )
+        power = direction > 0 ? 1.0 : -1.0;
+    }
+
+  if ( out.regulation == regulation_motor_sync )
+    power *= sync_factor ( m );
+
+  // motor_on isn't demanded in mode, as brick::set_motor commands motors with motor_brake alone
+  const bool driven = out.state != motor_run_state_idle && power != 0.0;
+
+  double target = 0.0;
+  double tau    = kTauCoasting;
+
+  if ( driven )
+    {
+      target = power * kSpeedPerPower;
+      tau    = kTauDriven;
+    }
+  else if ( out.mode & motor_brake )
+    tau = kTauBraking;
+
+  // Exact for constant target
+  const double decay = exp ( -dt / tau );
+  m.position += target * dt + ( m.speed - target ) * tau * ( 1.0 - decay );
+  m.speed     = target + ( m.speed - target ) * decay;
+
+  if ( limit && fabs ( m.position - m.block_zero ) >= out.tacho_limit )
+    {
+      if ( out.state == motor_run_state_ramp_up )
+        out.state = motor_run_state_running; // Ramped up: keeps going at the commanded power
+      else
+        {
+          out.state     = motor_run_state_idle;
+          out.power_pct = 0;
+
+          if ( out.mode & motor_brake ) // Stops dead on the limit
+            {
+              m.position = m.block_zero + ( m.position > m.block_zero ? 1 : -1 ) * out.tacho_limit;
+              m.speed    = 0.0;
+            }
+        }
+
+      out.tacho_limit = 0;
+    }
+
+  out.tacho_count       = static_cast<int32_t> ( floor ( m.position ) );
+  out.block_tacho_count = static_cast<int32_t> ( floor ( m.position - m.block_zero ) );
+  out.rotation_count    = static_cast<int32_t> ( floor ( m.position - m.rotation_zero ) );
+}
+
+// The last synced motor is the one slowed down by positive turn ratios, all others by negative ones
+double emulated_transport::sync_factor ( const motor &m ) const
+  {
+    int last = -1;
+    for ( int i = 0; i < kNumMotors; i++ )
+      if ( motors_[i].out.regulation == regulation_motor_sync )
+        last = i;
+
+    const int  turn    = m.out.turn_ratio;
+    const bool is_last = &m == &motors_[last];
+
+    if ( turn == 0 || ( turn > 0 ) != is_last )
+      return 1.0;
+    else
+      return 1.0 - std::min ( abs ( turn ), 100 ) / 50.0;
+  }
+
+void emulated_transport::set_output_state ( motor &m, const telegram &command )
+{
+  output_state &out = m.out;
+
+  m.start_power   = out.power_pct;
+  out.power_pct   = static_cast<int8_t> ( command[3] );
+  out.mode        = static_cast<motor_modes> ( command[4] );
+  out.regulation  = static_cast<regulation_modes> ( command[5] );
+  out.turn_ratio  = static_cast<int8_t> ( command[6] );
+  out.state       = static_cast<motor_run_states> ( command[7] );
+  out.tacho_limit = static_cast<int32_t> ( command.long_at ( 8 ) );
+
+  if ( out.tacho_limit > 0 ) // A new movement
+    {
+      m.block_zero          = m.position;
+      out.block_tacho_count = 0;
+    }
+}
+
+void emulated_transport::get_output_state ( const motor &m, telegram &reply ) const
+  {
+    const output_state &out = m.out;
+
+    reply.append_byte ( out.motor ).
+    append_byte ( out.power_pct ).
+    append_byte ( out.mode ).
+    append_byte ( out.regulation ).
+    append_byte ( out.turn_ratio ).
+    append_byte ( out.state ).
+    append_long ( out.tacho_limit ).
+    append_long ( out.tacho_count ).
+    append_long ( out.block_tacho_count ).
+    append_long ( out.rotation_count );
+  }
+
+void emulated_transport::process ( const telegram &command, telegram &reply )
+{
+  const uint8_t opcode = command[1];
+  port         &p      = ports_[ command.size() > 2 ? command[2] % kNumSensors : 0 ];
+  const uint8_t target = command.size() > 2 ? command[2] : 0; // Motor, where it applies
+
+  switch ( opcode )
+    {
+    case command_play_tone:
+    case command_stop_sound_playback:
+      break;
+
+    case command_set_output_state:
+      if ( target == All )
+        for ( int i = 0; i < kNumMotors; i++ )
+          set_output_state ( motors_[i], command );
+      else if ( target < kNumMotors )
+        set_output_state ( motors_[target], command );
+      else
+        reply[2] = kStatusOutOfRange;
+      break;
+
+    case command_get_output_state:
+      if ( target < kNumMotors )
+        get_output_state ( motors_[target], reply );
+      else
+        reply[2] = kStatusOutOfRange;
+      break;
+
+    case command_reset_motor_position:
+      for ( int i = 0; i < kNumMotors; i++ )
+        if ( target == All || target == i )
+          {
+            motor &m = motors_[i];
+
+            if ( command[3] ) // Relative to the last movement
+              m.block_zero = m.position;
+            else
+              {
+                m.block_zero    -= m.position;
+                m.rotation_zero  = 0.0;
+                m.position       = 0.0;
+              }
+
+            advance ( m, 0.0 ); // Refresh counts
+          }
+      break;
+
+    case command_set_input_mode:
+      p.type     = static_cast<sensor_types> ( command[3] );
+      p.mode     = static_cast<sensor_modes> ( command[4] );
+      p.answered = false;
+      break;
+
+    case command_get_input_values:
+      reply.append_byte ( command[2] ).
+      append_byte ( 1 ).                 // Valid
+      append_byte ( 0 ).                 // Not calibrated
+      append_byte ( p.type ).
+      append_byte ( p.mode ).
+      append_word ( p.raw ).
+      append_word ( p.raw ).             // Normalized
+      append_word ( p.scaled ).
+      append_word ( p.raw );             // Calibrated
+      break;
+
+    case command_reset_input_scaled:
+      p.scaled = 0;
+      break;
+
+    case command_get_battery_level:
+      reply.append_word ( battery_mV_ );
+      break;
+
+    case command_keep_alive:
+      reply.append_long ( kSleepTimeLimit );
+      break;
+
+    case command_ls_write:
+      if ( p.type != sensor_type_lowspeed && p.type != sensor_type_lowspeed_9v )
+        reply[2] = kStatusNotConfigured;
+      else if ( p.device == NULL )
+        reply[2] = kStatusBusError;
+      else
+        {
+          const uint8_t tx_len = std::min ( command[3], kMaxLsData );
+          p.rx_len     = std::min ( command[4], kMaxLsData );
+          p.polls_left = p.device->busy_polls();
+          p.answered   = true;
+          p.device->transact ( command.data() + 5, tx_len, p.rx, p.rx_len );
+        }
+      break;
+
+    case command_ls_get_status:
+      if ( p.answered && p.polls_left > 0 )
+        {
+          p.polls_left--;
+          reply[2] = kStatusPendingTransaction;
+          reply.append_byte ( 0 );
+        }
+      else
+        reply.append_byte ( p.answered ? p.rx_len : 0 );
+      break;
+
+    case command_ls_read:
+      if ( ! p.answered || p.polls_left > 0 )
+        reply[2] = kStatusPendingTransaction;
+
+      reply.append_byte ( p.answered ? p.rx_len : 0 );
+      for ( int i = 0; i < kMaxLsData; i++ )
+        reply.append_byte ( p.answered && i < p.rx_len ? p.rx[i] : 0 );
+
+      p.answered = false;
+      break;
+
+    case system_get_firmware_version:
+      reply.append_byte ( 124 ).append_byte ( 1 ). // Protocol 1.124
+      append_byte ( 29 ).append_byte ( 1 );         // Firmware 1.29
+      break;
+
+    case system_get_device_info:
+      for ( int i = 0; i < 15; i++ )
+        reply.append_byte ( i < static_cast<int> ( sizeof ( kBrickName ) ) ? kBrickName[i] : 0 );
+      for ( int i = 0; i < 7; i++ )
+        reply.append_byte ( i < static_cast<int> ( sizeof ( kBluetoothAddress ) ) ? kBluetoothAddress[i] : 0 );
+      reply.append_long ( 0 ).   // Bluetooth signal strength
+      append_long ( 65536 );     // Free user flash
+      break;
+
+    default:
+      reply[2] = kStatusUnknownOpcode;
+      break;
+    }
+}
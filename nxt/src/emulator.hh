@@ -0,0 +1,154 @@
+#ifndef _nxt_emulator_
+#define _nxt_emulator_
+
+#include "nxtdc.hh"
+
+namespace NXT
+  {
+
+  // Stand-in for a digital (I2C) sensor, attached to a port of an emulated brick
+  class i2c_device
+    {
+    public:
+      virtual ~i2c_device ( void ) {};
+
+      // A write of tx (address and register first), answered with rx_len bytes into rx
+      virtual void transact ( const uint8_t *tx, uint8_t tx_len, uint8_t *rx, uint8_t rx_len ) = 0;
+
+      // LSGETSTATUS polls answered as pending before the answer is ready (i.e. conversion time)
+      virtual int busy_polls ( void ) const { return 0; };
+    };
+
+  // LEGO ultrasonic sensor, at I2C address 0x02
+  // Answers the identification registers and the distance ones (0x42, first echo only)
+  class emulated_ultrasonic : public i2c_device
+    {
+    public:
+      emulated_ultrasonic ( uint8_t distance_cm = 255, int busy_polls = 2 );
+
+      void set_distance ( uint8_t distance_cm ); // 255 means no echo
+      void set_busy_polls ( int busy_polls );
+
+      virtual void transact ( const uint8_t *tx, uint8_t tx_len, uint8_t *rx, uint8_t rx_len );
+      virtual int  busy_polls ( void ) const;
+
+    private:
+      volatile uint8_t distance_cm_;
+      volatile int     busy_polls_;
+    };
+
+  // Timing and reliability of the emulated link
+  typedef struct
+    {
+      int64_t latency_ns;  // Round trip, from sending a telegram to having its reply
+      int64_t jitter_ns;   // Uniformly distributed on top of latency, [0, jitter)
+      double  error_rate;  // Probability of a reply being lost to a link error, reported to the listener
+    } link_model;
+
+  const link_model kLinkInstant   = {        0,        0, 0.0 }; // Full speed, e.g. for testing the host side
+  const link_model kLinkUSB       = {  2000000,   500000, 0.0 }; // Round trips as measured with a real brick
+  const link_model kLinkBluetooth = { 30000000, 10000000, 0.0 };
+
+  // In-process brick, for testing and benchmarking without hardware
+  // Understands every command sent by brick. Motors follow a first order model of speed
+  //   (driven, braking or coasting) integrated in real time, with tacho counts, limits and ramps.
+  // An absolute reset of motor position zeroes its tacho and rotation counts; a relative one, its block count.
+  // Motors in regulation_motor_sync share power as turn ratio says (see sync_drive), without their
+  //   position coupling.
+  // Replies are delivered to the listener by an internal thread once the link model says so,
+  //   in order, so several telegrams can be in flight as over USB.
+  class emulated_transport : public transport
+    {
+    public:
+      explicit emulated_transport ( const link_model &model = kLinkInstant );
+      ~emulated_transport ( void );
+
+      void set_model ( const link_model &model );
+
+      void attach ( sensors port, i2c_device *device ); // Not owned; NULL detaches
+
+      // Readings of analog sensors; normalized and calibrated values follow raw
+      void set_input_values ( sensors port, uint16_t raw, int16_t scaled );
+      void set_battery_level ( uint16_t millivolts );
+
+      output_state motor_state ( motors motor ); // As the brick would reply now
+
+      virtual void write ( const telegram &buf );
+      virtual void read ( telegram &reply ); // Replies arriving while there is no listener
+
+      virtual void post ( const telegram &buf, bool expect_reply );
+      virtual void set_listener ( transport_listener *listener );
+
+    private:
+      typedef struct
+        {
+          i2c_device   *device;
+          sensor_types  type;
+          sensor_modes  mode;
+          uint16_t      raw;
+          int16_t       scaled;
+          bool          answered;    // Data available for LSREAD
+          int           polls_left;  // Before the answer is ready
+          uint8_t       rx[kMaxLsData];
+          uint8_t       rx_len;
+        } port;
+
+      typedef struct
+        {
+          output_state  out;
+          int8_t        start_power; // Of a ramp
+          double        speed;       // [deg/s]
+          double        position;    // [deg] Since the last reset of tacho_count
+          double        block_zero;  // Position at the start of the movement
+          double        rotation_zero;
+        } motor;
+
+      // A telegram on its way: it takes effect on arrival, and its reply is due half a trip later
+      typedef struct
+        {
+          telegram data;       // The command, replaced by its reply once processed
+          bool     processed;
+          bool     wants_reply;
+          bool     lost;       // To a link error
+          int64_t  arrival_ns;
+          int64_t  due_ns;
+        } in_flight;
+
+      static const int kMaxInFlight = 64;
+
+      pthread_mutex_t mutex_;
+      pthread_cond_t  changed_;        // Something to process, deliver or read, or room to post
+      pthread_mutex_t listener_mutex_; // Held while delivering to the listener
+      pthread_t       delivery_thread_;
+      volatile bool   stopping_;
+
+      link_model      model_;
+      unsigned int    seed_;           // Of jitter and errors, for repeatable runs
+      uint16_t        battery_mV_;
+      int64_t         now_ns_;         // Of the last physics update
+
+      port            ports_[kNumSensors];
+      motor           motors_[kNumMotors];
+      in_flight       flight_[kMaxInFlight]; // Ring, in order of sending
+      int             first_;
+      int             num_in_flight_;
+      int             num_processed_;        // The first ones in the ring
+
+      // Builds the reply to command, whether it was requested or not
+      void process ( const telegram &command, telegram &reply );
+      void set_output_state ( motor &m, const telegram &command );
+      void get_output_state ( const motor &m, telegram &reply ) const;
+
+      void advance ( int64_t now_ns ); // Integrates motor physics up to now
+      void advance ( motor &m, double dt );
+      double sync_factor ( const motor &m ) const; // Power share of a motor in regulation_motor_sync
+
+      in_flight & flight ( int i ) { return flight_[ ( first_ + i ) % kMaxInFlight ]; };
+      void        pop ( void );
+
+      static void *delivery_loop ( void *self );
+    };
+
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _handoff_
+#define _handoff_
+
+namespace nxt_driver
+  {
+
+  // Lock-free queue from one producer thread to one consumer thread; N must be a power of two
+  template<class T, unsigned N>
+  class CommandQueue
+    {
+    public:
+      CommandQueue ( void ) : head_ ( 0 ), tail_ ( 0 ) {};
+
+      // Producer: false if full
+      bool push ( const T &item )
+      {
+        const unsigned tail = tail_;
+
+        if ( tail - head_ == N )
+          return false;
+
+        items_[tail % N] = item;
+        __sync_synchronize();
+        tail_ = tail + 1;
+
+        return true;
+      }
+
+      // Consumer: false if empty
+      bool pop ( T &item )
+      {
+        const unsigned head = head_;
+
+        if ( head == tail_ )
+          return false;
+
+        __sync_synchronize();
+        item = items_[head % N];
+        __sync_synchronize();
+        head_ = head + 1;
+
+        return true;
+      }
+
+      bool empty ( void ) const { return head_ == tail_; };
+
+    private:
+      T                 items_[N];
+      volatile unsigned head_;   // Next to pop, written by the consumer only
+      volatile unsigned tail_;   // Next to push, written by the producer only
+    };
+
+  // Latest state from a writer thread to a reader thread, double buffered with a spare copy
+  //   so that neither of them ever waits for the other: the writer publishes whole states, and
+  //   the reader picks up the newest one whenever it wants, skipping any it missed.
+  template<class T>
+  class StateBuffer
+    {
+    public:
+      StateBuffer ( void ) : back_ ( 0 ), spare_ ( 1 ), front_ ( 2 ) {};
+
+      // Writer
+      void publish ( const T &state )
+      {
+        slots_[back_] = state;
+        __sync_synchronize();
+        back_ = __sync_lock_test_and_set ( &spare_, back_ | kFresh ) & kIndex;
+      }
+
+      // Reader: true if a state newer than front() was published, which front() now is
+      bool update ( void )
+      {
+        if ( ! ( spare_ & kFresh ) )
+          return false;
+
+        front_ = __sync_lock_test_and_set ( &spare_, front_ ) & kIndex;
+        __sync_synchronize();
+
+        return true;
+      }
+
+      const T & front ( void ) const { return slots_[front_]; };
+
+    private:
+      static const unsigned kIndex = 3;
+      static const unsigned kFresh = 4;
+
+      T                 slots_[3];
+      unsigned          back_;    // Writer's
+      volatile unsigned spare_;   // Exchanged by both, with kFresh while not yet taken by the reader
+      unsigned          front_;   // Reader's
+    };
+
+}
+
+#endif
@@ -25,8 +25,9 @@
  * @brief Lego Mindstorms NXT
 
 This driver implements partial interaction with a USB-connected Lego Mindstorms NXT brick.\n
+Several bricks can be used at once, with one instance of the driver for each.\n
 Motors are implemented.\n
-Sensors are unimplemented.
+Touch, light, sound and color sensors are implemented.
 
 @par Compile-time dependencies
 
@@ -37,12 +38,85 @@ Sensors are unimplemented.
 - @ref interface_position1d
     - One per each of the A, B, C motors
     - These can be aggregated in a position2d using, e.g., @ref driver_differential
-    - Velocity commands are accepted. Position commands are not.
+    - Velocity and position commands are accepted.
+    - A position command is handed to the brick as a run limited to the tachometer count left to the target,
+      at the power of the requested speed (max_power if null), braking there. Its end shows in the
+      status as trajectory complete. The same target sent again doesn't restart the move.
+      A target given while the motor turns is counted from a tacho read right then, but the brick counts
+      from the arrival of the move, which still misses by what the motor turns in between (about a round trip,
+      plus the wait for the next command write if one was written within the last period).
+- @ref interface_position2d
+    - A differential drive on two motors (see differential), with odometry from their tacho counts.
+    - Velocity commands drive both wheels as a pair synchronized by the brick, so they start together
+      and stay in lockstep, one telegram per wheel (or a single one, see fused_command).
 - @ref interface_power
     - Battery level of the brick.
+- @ref interface_dio
+    - One per touch sensor, keyed by its port S1-S4. A single bit, set while pressed.
+- @ref interface_aio
+    - One per light, sound or color sensor, keyed by its port S1-S4. A single value:
+      percent of full scale for light and sound, color number (1-6) for color sensors.
+- @ref interface_ranger
+    - One per ultrasonic sensor, keyed by its port S1-S4. A single range; 2.55m means no echo.
+    - Read through I2C exchanges that are advanced between motor reads, so they never delay odometry.
 
 @par Configuration file options
 
+- brick (string default: "")
+  - Brick to use: its USB serial number (i.e. its bluetooth address, as in "0016530ABCDE"),
+    its USB bus path (as in "1-2.4") or its name. The first brick found if empty.
+  - All bricks share a single libusb event thread, so each one adds no threads nor latency.
+
+- fast_attach (integer default 0)
+  - Take the brick as it is instead of resetting it: the USB device is not reset (nor reconfigured
+    if already right), and motor tacho counts are kept as the odometry baseline instead of being
+    zeroed. Position1d positions go on from where the last run left them; the position2d pose too,
+    with a pose_file. Startup takes a few milliseconds instead of a device re-enumeration.
+  - The time from setup to ready is logged either way.
+
+- pose_file (string default: "")
+  - File where the position2d pose is kept, memory-mapped, at every odometry update; empty for none.
+    On startup the pose in it is taken back. With fast_attach, motion of the wheels since it was
+    stored is added, unless they moved so much (or were reset, e.g. by a brick reboot) that it can't
+    be trusted, in which case odometry starts at the origin.
+
+- record (string default: "")
+  - File where every telegram to and from the brick is logged, with its time, as a flight recorder;
+    empty for none. Logging costs a copy into a memory mapping per telegram, so it can stay on.
+- record_size (float [MB] default 64)
+  - Room for the log, at about 40 bytes per telegram; once full, later telegrams are only counted.
+- replay (string default: "")
+  - Instead of a brick, answer from a log written by record: each query gets the reply it got then,
+    after the round trip it took then, so the driver (and e.g. differential odometry downstream)
+    runs again on the same readings. Queries past what was recorded go unanswered.
+- replay_speed (float default 1.0)
+  - Recorded round trips are divided by this; 0 answers at once. The driver period is not scaled.
+
+- odometry_ring (string default: "")
+  - File (e.g. "/dev/shm/nxt_odometry") where every motor and sensor sample is also exported, as read,
+    to processes on the same host; empty for none. Readers use nxt_driver::OdometryReader
+    (odometry_ring.hh, which builds on its own): each one gets every sample microseconds after it was
+    read, without the Player server nor a copy per subscriber. Samples are those of each poll, at
+    the rate set by period; stale repeats are flagged.
+- odometry_ring_size (integer default 1024)
+  - Samples kept in the ring, rounded up to a power of two: how far a reader can fall behind without
+    losing any.
+
+- emulator (string default: "")
+  - Use an in-process emulated brick instead of a real one, with the timing of the given link:
+    "instant" (no latency, for running at full speed), "usb" (~2ms round trips) or "bluetooth" (~30ms).
+  - Emulated ultrasonic sensors always see an obstacle at 1m.
+
+- timeout (float [s] default 0.1)
+  - Deadline of each reply from the brick; 0 waits forever.
+- retries (integer default 1)
+  - Times a query past its deadline is sent again, so a cycle never waits longer than
+    about ( retries + 1 ) * timeout for a brick that stopped answering.
+  - While the brick doesn't answer (or is unplugged) the driver keeps running and handling messages:
+    the last readings are published every period with the enabled status bit cleared, as stale.
+    A brick unplugged from USB is taken back as soon as it is enumerated again; on recovery, sensor
+    modes and the last velocity commands are written again.
+
 - max_power (tuple of float [%] default: [100 100 100])
   - Power applied when maximum vel is requested for each motor.
 
@@ -53,9 +127,98 @@ Sensors are unimplemented.
   - Multiplier for the tachometer in the lego motor. tacho_count x odom_rate = real_distance (must be calibrated also).
   - Default is somewhat close to the standard small wheels with direct motor drive.
 
+- differential (tuple of string default: [ "B" "C" ])
+  - Left and right wheel motors of the position2d interface, if provided. Their max_power,
+    max_speed and odom_rate apply as for position1d.
+
+- axis_length (float [length] default 0.25)
+  - Distance between the wheels of the position2d interface.
+
+- fused_command (integer default 0)
+  - Command the position2d wheels with one telegram addressed to all motors, instead of one per wheel.
+  - Only used for wheels on B and C with motor A not provided, as it runs along: port A must have no motor
+    attached, nor be driven by anything else (e.g. another instance of this driver). The driver can't check it,
+    so this is off unless asked for.
+
+- velocity_filter (tuple of float [s] default [0.1 0.1 0.1])
+  - Smoothing of the velocity of each motor, estimated from its odometry by an alpha-beta tracker
+    (no lag at constant speed): larger values smooth more but follow accelerations later; 0 gives
+    plain differences between readings.
+  - Each reading is stamped at the midpoint of its round trip, and velocities use the real time
+    between readings; data is published with those timestamps.
+
 - period (float [s] default 0.05)
   - Seconds between reads of motor encoders. Since this requires polling and affects CPU use, each app can set an adequate timing.
-  - Note that a polling roundtrip via USB takes (empirically measured) around 2ms per motor.
+  - Cycles follow absolute deadlines on the monotonic clock, so they don't drift with message traffic.
+  - All brick traffic happens in a thread of its own, which takes commands from the Player thread through
+    a lock-free queue as soon as they arrive, so writing them never waits for a poll period nor behind
+    sensor reads (at most behind one pipelined round trip in progress). Readings go back through a
+    double-buffered state, which the Player thread publishes as soon as it is told there is a new one.
+  - Note that a polling roundtrip via USB takes (empirically measured) around 2ms; all motors are read in a single pipelined batch.
+
+- idle_period (float [s] default: period)
+  - Longest time between reads of motor encoders while motors are idle, for an adaptive rate: after each
+    read finding every motor still, not commanded to move, the time to the next one doubles up to this;
+    any command, or a motor found moving, brings it back to period. The room left goes to sensors.
+  - The achieved rate is logged with the rest of statistics, and each change at message level 3.
+
+- sensors (tuple of string default: [ "none" "none" "none" "none" ])
+  - Sensor attached to each of the S1-S4 ports, one of:
+    "none", "touch", "light", "light_ambient" (led off), "sound", "sound_dba", "color", "ultrasonic".
+
+- sensor_period (tuple of float [s] default: [period period period period])
+  - Seconds between reads of each sensor. Reads are done along the motor ones, so in practice
+    this is rounded to a multiple of period.
+
+- io_budget (float default 0.5)
+  - Fraction of period that the batch of motor and sensor reads may take. Sensors that don't fit
+    are deferred to the next cycle, so they never stretch the motor period.
+  - Traffic goes by class: motor commands before anything, then motor reads every cycle, then sensors,
+    then background queries (battery level, keep-alives) in whatever room is left. Within a class the
+    earliest deadline goes first; background queries that miss theirs are dropped till their next period.
+  - At startup, and with the rest of statistics, the rates asked for are checked against this budget
+    at the measured cost of a round trip, with a warning if they don't fit.
+  - Achieved rates per source are logged with the rest of statistics (see stats_period).
+
+- command_refresh (float [s] default 1.0)
+  - Velocity commands are written to the brick at most once per period for each motor, the newest one
+    replacing any other still waiting; one that would not change the motor is dropped, unless the last
+    write is older than this. Counts of both are logged with the rest of statistics.
+
+- acceleration (tuple of float [length/s^2] default [0 0 0])
+  - Limit of the acceleration of each motor for velocity commands; 0 for none. Also set by
+    PLAYER_POSITION1D_REQ_SPEED_PROF. Applies to the position2d wheels too; position commands are not ramped.
+
+- ramps (string default "brick")
+  - Where acceleration limits are enforced:
+    - "brick": where they fit, by the firmware, along a tacho limit, in a single telegram (speeding up
+      in the same direction, or slowing down to a stop); from here otherwise. The firmware ramps power
+      along distance rather than time, so these keep within the limit but take longer, mostly from rest;
+    - "host": always from here, stepping speed each cycle and writing only the steps that change motor power.
+  - Ramps done either way, and commands spent on those from here, are logged with the rest of statistics.
+
+- speed_control (tuple of integer default [0 0 0])
+  - Closed loop speed for each motor (1 enables it): a thread of its own reads the motors and corrects their
+    power at speed_control_rate, so speed holds under load and battery drain. Velocity commands become its setpoints.
+  - Readings published are then those of the controller, so the motors aren't read twice.
+  - Power is max_power / max_speed times ( setpoint + speed_kp * error + speed_ki * integral of error ).
+
+- speed_control_rate (float [Hz] default 200)
+  - Rate of the speed controller, independent of period. Each tick costs about a round trip (~2.5ms over USB).
+
+- speed_kp (tuple of float default [1.0 1.0 1.0])
+- speed_ki (tuple of float [1/s] default [5.0 5.0 5.0])
+  - Gains of the speed controller, relative to the feedforward.
+
+- stats_period (float [s] default 10.0)
+  - Seconds between dumps of statistics, at message level 1; 0 disables them. These are:
+    - per opcode: telegrams sent, errors, and round trip percentiles;
+    - link traffic: telegrams, bytes, errors and timeouts;
+    - cycle time and jitter (lateness of cycle starts) percentiles, and deadlines missed;
+    - peak telegrams in flight and peak depth of the incoming message queue;
+    - reply timeouts and retries per opcode, reconnections, and cycles spent stale;
+    - speed controller ticks, writes, errors, tick time and jitter, if enabled;
+    - ramps by the brick and from here, and commands spent on the latter.
 
 @par Example
 
@@ -70,12 +233,15 @@ unit_angle  "radians"
 driver
 (
   name "nxt"
-  provides [ "B:::position1d:0" "C:::position1d:1" "power:0" ]
+  provides [ "B:::position1d:0" "C:::position1d:1" "power:0" "S1:::dio:0" "S3:::aio:0" ]
 
   max_power [100 100 100] # 100% power is to be used
   max_speed [0.5 0.5 0.5] # in order to achieve 0.5 m/s linearly
   odom_rate [0.1 0.1 0.1] # multiplier for odometry
 
+  sensors [ "touch" "none" "light" "none" ]
+  sensor_period [ 0.05 0.0 0.2 0.0 ]
+
   period 0.05
 )
 
@@ -89,21 +255,101 @@ driver
   axis_length 0.25
 )
 
+# Or, with half the command traffic, the same position2d straight from a brick
+driver
+(
+  name "nxt"
+  provides [ "position2d:1" ]
+
+  differential [ "B" "C" ]
+  axis_length 0.25
+  max_speed [0.5 0.5 0.5]
+  odom_rate [0.1 0.1 0.1]
+
+  brick "rover"
+)
+
+# A second brick, e.g. for an arm, is selected by name
+driver
+(
+  name "nxt"
+  provides [ "A:::position1d:10" ]
+
+  brick "arm"
+)
+
 @endverbatim
 
 @author Alejandro R. Mosteo
 */
 /** @} */
 
+#include <algorithm>
 #include "chronos.hh"
+#include <cmath>
+#include <cstring>
 #include "libplayercore/device.h"
 #include "libplayercore/driver.h"
 #include "libplayercore/playercore.h"
+#include "emulator.hh"
+#include "handoff.hh"
 #include "nxtdc.hh"
+#include "odometry_ring.hh"
+#include "poll_scheduler.hh"
+#include "pose_snapshot.hh"
+#include "recorder.hh"
+#include "speed_controller.hh"
+#include "stats.hh"
+#include <unistd.h>
+#include "velocity_filter.hh"
 
 using namespace nxt_driver;
 
-const int kNumMotors = 3;
+const int kNumMotors  = 3;
+const int kNumSensors = NXT::kNumSensors;
+
+// Motor commands wait in a slot each: one per motor, and one for all of them (fused wheel commands)
+const int kNumCmdSlots = kNumMotors + 1;
+const int kSyncSlot    = kNumMotors;
+
+// Wheels of the position2d interface
+const int kL = 0;
+const int kR = 1;
+
+// What the Player thread asks of the I/O thread
+enum io_command_kinds
+{
+  io_set_vel,     // position2d: value = vx, vy, va
+  io_set_speed,   // position1d: value = vel
+  io_move_to,     // position1d: value = pos, vel
+  io_reset_odom,  // position1d
+  io_set_odom,    // position2d: value = px, py, pa
+  io_speed_prof   // position1d: value = speed, acc
+};
+
+typedef struct
+  {
+    io_command_kinds kind;
+    NXT::motors      motor;
+    double           value[3];
+  } io_command;
+
+const unsigned kCommandQueueSize = 64;
+
+// Readings handed by the I/O thread to the Player thread; each kind is published again once its count changes
+typedef struct
+  {
+    uint64_t                 motors;                    // Readings, or stale repeats of them
+    player_position1d_data_t motor[kNumMotors];
+    int64_t                  motor_ns[kNumMotors];      // Of each sample; 0 if stale, stamped when published
+    uint64_t                 odometry;
+    player_position2d_data_t p2d;
+    int64_t                  p2d_ns;
+    uint64_t                 power;
+    player_power_data_t      juice;
+    uint64_t                 sensor[kNumSensors];
+    double                   sensor_value[kNumSensors]; // Bit for dio, scaled for aio, range for ranger
+  } published_state;
 
 class Nxt : public ThreadedDriver
   {
@@ -119,29 +365,178 @@ class Nxt : public ThreadedDriver
   private:
     player_devaddr_t motor_addr_[kNumMotors];
     player_devaddr_t power_addr_;
+    player_devaddr_t sensor_addr_[kNumSensors];
 
     player_position1d_data_t data_state_     [kNumMotors]; // Just read status.
-    player_position1d_data_t data_state_prev_[kNumMotors]; // Previous status to integrate speed.
+    nxt_driver::VelocityFilter vel_filter_   [kNumMotors];
+    int32_t          tacho_       [kNumMotors]; // Last read
+    bool             moving_      [kNumMotors]; // Towards a position target, under a tacho limit
+    int64_t          rebased_ns_;                // Last reset of a tacho, before which readings are outdated
+    double           move_target_ [kNumMotors];
 
     double           max_power_[kNumMotors];
     double           max_speed_[kNumMotors];
     double           odom_rate_[kNumMotors];
 
+    // Acceleration limits, by ramps on the brick or stepped from here
+    double           accel_       [kNumMotors]; // 0 for none
+    bool             brick_ramps_;               // Where they fit
+    double           speed_       [kNumMotors]; // Last commanded
+    bool             ramping_     [kNumMotors]; // From here, towards ramp_target_
+    double           ramp_target_ [kNumMotors];
+    double           ramp_speed_  [kNumMotors]; // Reached so far, commanded once it changes power
+    int64_t          ramp_ns_     [kNumMotors]; // Of the last step
+    bool             ramp_pair_;                 // The wheels ramp together, commanded as a pair
+
     bool             publish_motor_[kNumMotors];
+    uint8_t          motor_mask_;   // Same, as NXT::motor_masks
     bool             publish_power_;
+    bool             publish_sensor_[kNumSensors];
+
+    NXT::sensor_types sensor_type_[kNumSensors];
+    NXT::sensor_modes sensor_mode_[kNumSensors];
+    float             sensor_value_[kNumSensors]; // Last reading, for aio sensors
+
+    NXT::get_input_values_telegram sensor_query_[kNumSensors];
+
+    // Digital (I2C) sensors are read by stepping an exchange in between other traffic
+    NXT::ls_transaction ls_[kNumSensors];
+    int64_t             ls_period_ns_[kNumSensors];
+    int64_t             ls_next_ns_[kNumSensors];
 
     player_power_data_t juice_;
 
     double           period_;
-    Chronos          timer_battery_;
-    Chronos          timer_period_;
-
+    PeriodicTimer    cycle_timer_;
+
+    PollScheduler    scheduler_;
+    double           idle_period_;
+    double           motor_period_;                // Adaptive, between period_ and idle_period_
+    int              motor_source_;                // Scheduler ids
+    int              sensor_source_[kNumSensors];
+    int              battery_source_;
+    int              keep_alive_source_;
+    Chronos          timer_stats_;
+    double           stats_period_;
+
+    NXT::latency_histogram cycle_time_;    // Of motor and sensor polls
+    NXT::latency_histogram cycle_late_;    // Jitter of cycle starts
+    volatile int           queue_peak_;    // Since last stats dump; raised by the Player thread, taken by the I/O one
+
+    std::string       brick_id_; // Serial number, bus path or name, or empty for any
     NXT::brick       *brick_;
-
-    void             CheckBattery ( void );
+    bool              fast_attach_;
+    int64_t           timeout_ns_;
+    int               retries_;
+    bool              stale_;        // The brick failed, and hasn't answered since
+    uint64_t          stale_cycles_;
+
+    std::string                emulator_link_;  // Empty for a real brick
+    NXT::emulated_transport   *emulator_;       // The link, if emulated
+    NXT::emulated_ultrasonic   emulated_echo_;
+
+    NXT::transport            *link_;           // To the brick, emulator or recording
+    std::string                record_file_;    // Empty for none
+    size_t                     record_size_;
+    NXT::recording_transport  *recorder_;
+    std::string                replay_file_;    // Empty for none
+    double                     replay_speed_;
+    NXT::replay_transport     *replay_;         // The link, if replaying
+
+    NXT::set_output_state_telegram motor_cmd_[kNumCmdSlots]; // Prebuilt, patched for each command
+
+    // The newest velocity command of each slot waits in motor_cmd_ until it can be written
+    bool             motor_cmd_pending_[kNumCmdSlots];
+    NXT::telegram    motor_cmd_sent_[kNumCmdSlots];    // Last written
+    int64_t          motor_cmd_sent_ns_[kNumCmdSlots];
+    int64_t          command_refresh_ns_;
+    uint64_t         motor_writes_[kNumCmdSlots];
+    uint64_t         motor_coalesced_[kNumCmdSlots];   // Replaced by a newer one before being written
+    uint64_t         motor_suppressed_[kNumCmdSlots];  // Not written, as equal to the last one
+    uint64_t         ramps_brick_[kNumCmdSlots];
+    uint64_t         ramps_host_[kNumCmdSlots];
+    uint64_t         ramp_commands_[kNumCmdSlots];     // Queued by ramps from here
+
+    // Differential drive on two motors, commanded as a synchronized pair
+    bool                     publish_p2d_;
+    player_devaddr_t         p2d_addr_;
+    player_position2d_data_t p2d_state_;
+    NXT::motors              wheel_[2];            // Left, right
+    double                   wheel_pos_prev_[2];
+    double                   axis_length_;
+    bool                     fused_;               // Both wheels commanded through kSyncSlot
+    std::string              pose_file_;           // Empty for none
+    nxt_driver::PoseSnapshot pose_snapshot_;
+
+    // Samples exported to local processes
+    std::string                  ring_file_;       // Empty for none
+    int                          ring_size_;
+    nxt_driver::OdometryRing     ring_;
+    nxt_driver::odometry_sample  ring_motors_;     // Last motor sample, repeated as stale
+
+    // Brick traffic, and all motor state, belong to the I/O thread; messages and publishing, to the Player one
+    pthread_t                io_thread_;
+    bool                     io_running_;
+    volatile bool            io_stopping_;
+    pthread_mutex_t          io_mutex_;       // Just to sleep on io_wake_
+    pthread_cond_t           io_wake_;
+    nxt_driver::CommandQueue<io_command, kCommandQueueSize> commands_;
+    NXT::counter             commands_waited_; // Pushes that found the queue full
+    published_state          io_state_;       // Being updated by the I/O thread
+    bool                     io_changed_;     // Since last handed over
+    nxt_driver::StateBuffer<published_state> state_;
+    published_state          published_;      // Counts of what the Player thread published last
+
+    // Closed loop speed, for the motors in speed_controlled_
+    nxt_driver::SpeedController *speed_control_;
+    bool                     speed_controlled_[kNumMotors];
+    double                   speed_rate_;
+    double                   speed_kp_[kNumMotors];
+    double                   speed_ki_[kNumMotors];
+
+    void             CloseBrick ( void );
+    bool             StartIo ( void );
+    void             StopIo ( void );
+    void             IoLoop ( void );
+    void             WaitForWork ( void );
+    void             QueueCommand ( const io_command &cmd );
+    void             RaiseQueuePeak ( int length );
+    void             ApplyCommand ( const io_command &cmd );
+    void             PublishState ( void );
+    void             UpdateBattery ( const NXT::telegram &reply );
+    void             AdaptMotorPeriod ( bool idle );
     void             CheckMotors ( void );
+    void             SetStale ( const char *why );
+    void             Recover ( void );
+    void             SendMotorCommands ( void );
+    void             QueueMotorCommand ( int slot, int8_t power, NXT::regulation_modes regulation, int8_t turn_ratio,
+                                         uint32_t tacho_limit = 0,
+                                         NXT::motor_run_states state = NXT::motor_run_state_running );
+    void             MoveTo ( NXT::motors motor, double pos, double vel );
+    bool             SpeedControlled ( NXT::motors motor ) const;
+    void             SetSpeed ( NXT::motors motor, double vel );
+    void             Drive ( NXT::motors motor, double vel );
+    bool             BrickRamp ( NXT::motors motor, double from, double to );
+    void             StepRamps ( void );
+    void             SetVel ( const player_pose2d_t &vel );
+    void             DrivePair ( double left, double right );
+    void             UpdateOdometry ( const NXT::motor_states &states );
+    void             RebaseTacho ( NXT::motors motor );
+    bool             ReadAfterRebase ( const NXT::motor_states &states ) const;
+    void             RestorePose ( bool tachos_kept );
+    void             ExportMotors ( const NXT::motor_states &states );
+    void             ExportSensor ( int port, int32_t raw, int32_t scaled, double value );
+    double           Timestamp ( int64_t sample_ns ) const;
+    void             CheckDigitalSensors ( void );
+    bool             IsDigital ( int port ) const;
+    bool             DigitalBusy ( void ) const;
+    void             LogStats ( void );
+    void             PublishSensor ( int port, const NXT::input_values &values );
     NXT::motors      GetMotor ( const player_devaddr_t &addr ) const;
+    NXT::motors      GetMotor ( const char *name ) const;
     int8_t           GetPower ( float vel, NXT::motors motor ) const;
+
+    static void     *IoMain ( void *self );
   };
 
 Driver* nxt_Init ( ConfigFile* cf, int section )
@@ -154,20 +549,126 @@ void nxt_Register ( DriverTable* table )
   table->AddDriver ( "nxt", nxt_Init );
 }
 
-const char *motor_names[kNumMotors] = { "A", "B", "C" };
+const char *motor_names[kNumMotors]   = { "A", "B", "C" };
+const char *slot_names[kNumCmdSlots]  = { "A", "B", "C", "A+B+C" };
+const char *sensor_names[kNumSensors] = { "S1", "S2", "S3", "S4" };
+
+typedef struct
+  {
+    const char        *name;      // As in the config file
+    NXT::sensor_types  type;
+    NXT::sensor_modes  mode;
+    int                interf;    // Player interface providing it
+  } sensor_kind;
+
+const sensor_kind sensor_kinds[] =
+{
+  { "touch",         NXT::sensor_type_switch,         NXT::sensor_mode_boolean,        PLAYER_DIO_CODE },
+  { "light",         NXT::sensor_type_light_active,   NXT::sensor_mode_pct_full_scale, PLAYER_AIO_CODE },
+  { "light_ambient", NXT::sensor_type_light_inactive, NXT::sensor_mode_pct_full_scale, PLAYER_AIO_CODE },
+  { "sound",         NXT::sensor_type_sound_db,       NXT::sensor_mode_pct_full_scale, PLAYER_AIO_CODE },
+  { "sound_dba",     NXT::sensor_type_sound_dba,      NXT::sensor_mode_pct_full_scale, PLAYER_AIO_CODE },
+  { "color",         NXT::sensor_type_color_full,     NXT::sensor_mode_raw,            PLAYER_AIO_CODE },
+  { "ultrasonic",    NXT::sensor_type_lowspeed_9v,    NXT::sensor_mode_raw,            PLAYER_RANGER_CODE },
+};
+
+// Ultrasonic distance read: I2C address and register of the first echo
+const uint8_t kUltrasonicQuery[] = { 0x02, 0x42 };
+
+const double kLsStepTime      = 0.005; // [s] Loop wake up while an I2C exchange is in progress
+const int    kQueueFullSleep  = 1000;  // [us] Of the Player thread, while the I/O thread makes room for commands
+const double kBatteryPeriod   = 10.0;  // [s] We don't want to poll battery level innecesarily often
+const double kBatteryDeadline = 1.0;   // [s] Past which a battery read waits for the next period
+const double kKeepAlivePeriod = 60.0;  // [s] Well within the shortest sleep time of the brick
+const double kMinTurn         = 1e-9;  // [rad] Below this an odometry step is taken as straight
+
+const int32_t kMaxAttachDrift = 3600; // [deg] Of a wheel since its pose was stored, beyond which that is not trusted
+
+const int kNumSensorKinds = sizeof ( sensor_kinds ) / sizeof ( sensor_kinds[0] );
 
 Nxt::Nxt ( ConfigFile *cf, int section )
     : ThreadedDriver ( cf, section ),
+    motor_mask_ ( 0 ),
     period_ ( cf->ReadFloat ( section, "period", 0.05 ) ),
-    timer_battery_ ( -666.0 )   // Ensure first update to be sent immediately
+    cycle_timer_ ( period_ ),
+    scheduler_ ( period_, cf->ReadFloat ( section, "io_budget", 0.5 ) ),
+    idle_period_ ( std::max ( period_, cf->ReadFloat ( section, "idle_period", period_ ) ) ),
+    motor_period_ ( period_ ),
+    motor_source_ ( -1 ),
+    battery_source_ ( -1 )
 {
+  stats_period_  = cf->ReadFloat ( section, "stats_period", 10.0 );
+  command_refresh_ns_ = static_cast<int64_t> ( cf->ReadFloat ( section, "command_refresh", 1.0 ) * 1e9 );
+  queue_peak_    = 0;
+  rebased_ns_    = 0;
+
+  brick_id_      = cf->ReadString ( section, "brick", "" );
+  fast_attach_   = cf->ReadInt ( section, "fast_attach", 0 ) != 0;
+  pose_file_     = cf->ReadString ( section, "pose_file", "" );
+  ring_file_     = cf->ReadString ( section, "odometry_ring", "" );
+  ring_size_     = cf->ReadInt ( section, "odometry_ring_size", 1024 );
+  timeout_ns_    = static_cast<int64_t> ( cf->ReadFloat ( section, "timeout", 0.1 ) * 1e9 );
+  retries_       = cf->ReadInt ( section, "retries", 1 );
+  stale_         = false;
+  stale_cycles_  = 0;
+  emulator_link_ = cf->ReadString ( section, "emulator", "" );
+  emulator_      = NULL;
+  brick_         = NULL;
+  io_running_    = false;
+  link_          = NULL;
+  record_file_   = cf->ReadString ( section, "record", "" );
+  record_size_   = static_cast<size_t> ( cf->ReadFloat ( section, "record_size", 64.0 ) * ( 1 << 20 ) );
+  recorder_      = NULL;
+  replay_file_   = cf->ReadString ( section, "replay", "" );
+  replay_speed_  = cf->ReadFloat ( section, "replay_speed", 1.0 );
+  replay_        = NULL;
+  speed_control_ = NULL;
+  speed_rate_    = cf->ReadFloat ( section, "speed_control_rate", 200.0 );
+  ramp_pair_     = false;
+
+  const std::string ramps = cf->ReadString ( section, "ramps", "brick" );
+  if ( ramps != "brick" && ramps != "host" )
+    throw std::runtime_error ( "nxt: ramps must be \"brick\" or \"host\": " + ramps );
+  brick_ramps_ = ramps == "brick";
+  emulated_echo_.set_distance ( 100 );
+
+  for ( int i = 0; i < kNumCmdSlots; i++ )
+    {
+      motor_cmd_[i].set_motor ( i == kSyncSlot ? NXT::All : static_cast<NXT::motors> ( i ) );
+
+      motor_cmd_pending_[i] = false;
+      motor_cmd_sent_ns_[i] = 0;
+      motor_writes_[i]      = 0;
+      motor_coalesced_[i]   = 0;
+      motor_suppressed_[i]  = 0;
+      ramps_brick_[i]       = 0;
+      ramps_host_[i]        = 0;
+      ramp_commands_[i]     = 0;
+    }
+
   for ( int i = 0; i < kNumMotors; i++ )
     {
+      publish_motor_[i] = false;
+
       // Read them regardless of motor usage to placate player unused warnings
       max_power_[i] = cf->ReadTupleFloat ( section, "max_power", i, 100.0 );
       max_speed_[i] = cf->ReadTupleFloat ( section, "max_speed", i, 0.5 );
       odom_rate_[i] = cf->ReadTupleFloat ( section, "odom_rate", i, 0.0005 );
 
+      accel_[i] = cf->ReadTupleFloat ( section, "acceleration", i, 0.0 );
+      speed_[i] = 0.0;
+      ramping_[i] = false;
+
+      vel_filter_[i].set_tau ( cf->ReadTupleFloat ( section, "velocity_filter", i, 0.1 ) );
+
+      tacho_[i]       = 0;
+      moving_[i]      = false;
+      move_target_[i] = 0.0;
+
+      speed_controlled_[i] = cf->ReadTupleInt ( section, "speed_control", i, 0 ) != 0;
+      speed_kp_[i]         = cf->ReadTupleFloat ( section, "speed_kp", i, 1.0 );
+      speed_ki_[i]         = cf->ReadTupleFloat ( section, "speed_ki", i, 5.0 );
+
       if ( cf->ReadDeviceAddr ( &motor_addr_[i], section, "provides", PLAYER_POSITION1D_CODE, -1, motor_names[i] ) == 0 )
         {
           PLAYER_MSG1 ( 3, "nxt: Providing motor %s", motor_names[i] );
@@ -177,6 +678,7 @@ Nxt::Nxt ( ConfigFile *cf, int section )
           else
             {
               publish_motor_[i] = true;
+              motor_mask_      |= 1 << i;
 
               data_state_[i].pos    = 0.0f;
               data_state_[i].vel    = 0.0f;
@@ -186,6 +688,95 @@ Nxt::Nxt ( ConfigFile *cf, int section )
         }
     }
 
+  memset ( &p2d_addr_, 0, sizeof ( p2d_addr_ ) );
+  memset ( &p2d_state_, 0, sizeof ( p2d_state_ ) );
+  publish_p2d_ = false;
+  fused_       = false;
+  axis_length_ = cf->ReadFloat ( section, "axis_length", 0.25 );
+
+  wheel_[kL] = GetMotor ( cf->ReadTupleString ( section, "differential", kL, "B" ) );
+  wheel_[kR] = GetMotor ( cf->ReadTupleString ( section, "differential", kR, "C" ) );
+
+  const bool fused_command = cf->ReadInt ( section, "fused_command", 0 ) != 0;
+
+  if ( cf->ReadDeviceAddr ( &p2d_addr_, section, "provides", PLAYER_POSITION2D_CODE, -1, NULL ) == 0 )
+    {
+      if ( wheel_[kL] == wheel_[kR] )
+        throw std::runtime_error ( "nxt: differential wheels must be different motors" );
+
+      if ( AddInterface ( p2d_addr_ ) != 0 )
+        throw std::runtime_error ( "Cannot add position2d interface" );
+
+      publish_p2d_ = true;
+      motor_mask_ |= ( 1 << wheel_[kL] ) | ( 1 << wheel_[kR] );
+
+      // Addressed to all motors, the command drives the third one too: only done with A unused,
+      //   so B and C are the synced pair
+      fused_ = fused_command && motor_mask_ == ( NXT::mask_B | NXT::mask_C );
+
+      PLAYER_MSG3 ( 3, "nxt: Providing differential drive on motors %s and %s%s",
+                    motor_names[wheel_[kL]], motor_names[wheel_[kR]], fused_ ? ", fused commands" : "" );
+    }
+
+  if ( motor_mask_ != 0 )
+    {
+      int num_motors = 0;
+      for ( int i = 0; i < kNumMotors; i++ )
+        num_motors += ( motor_mask_ >> i ) & 1;
+
+      // Under speed control the readings come from the controller, at no cost to the cycle
+      bool controlled = false;
+      for ( int i = 0; i < kNumMotors; i++ )
+        controlled = controlled || ( speed_controlled_[i] && ( motor_mask_ & ( 1 << i ) ) );
+
+      motor_source_ = scheduler_.add_source ( "motors", period_, controlled ? 0 : num_motors,
+                                              PollScheduler::control_traffic );
+    }
+
+  for ( int i = 0; i < kNumSensors; i++ )
+    {
+      const char *kind = cf->ReadTupleString ( section, "sensors", i, "none" );
+      const float poll = cf->ReadTupleFloat ( section, "sensor_period", i, period_ );
+
+      publish_sensor_[i] = false;
+      sensor_source_[i]  = -1;
+      sensor_value_[i]   = 0.0f;
+      sensor_query_[i].set_port ( static_cast<NXT::sensors> ( i ) );
+
+      if ( strcmp ( kind, "none" ) == 0 )
+        continue;
+
+      int k = 0;
+      while ( k < kNumSensorKinds && strcmp ( kind, sensor_kinds[k].name ) != 0 )
+        k++;
+
+      if ( k == kNumSensorKinds )
+        throw std::runtime_error ( std::string ( "nxt: unknown sensor kind: " ) + kind );
+
+      if ( cf->ReadDeviceAddr ( &sensor_addr_[i], section, "provides", sensor_kinds[k].interf, -1, sensor_names[i] ) != 0 )
+        {
+          PLAYER_WARN2 ( "nxt: sensor %s at %s is not provided; ignoring it", kind, sensor_names[i] );
+          continue;
+        }
+
+      if ( AddInterface ( sensor_addr_[i] ) != 0 )
+        throw std::runtime_error ( "Cannot add sensor interface" );
+
+      PLAYER_MSG2 ( 3, "nxt: Providing %s sensor at %s", kind, sensor_names[i] );
+
+      publish_sensor_[i] = true;
+      sensor_type_[i]    = sensor_kinds[k].type;
+      sensor_mode_[i]    = sensor_kinds[k].mode;
+
+      if ( IsDigital ( i ) )
+        {
+          ls_period_ns_[i] = static_cast<int64_t> ( poll * 1e9 );
+          ls_next_ns_[i]   = 0;
+        }
+      else
+        sensor_source_[i] = scheduler_.add_source ( sensor_names[i], poll, 1 );
+    }
+
   if ( cf->ReadDeviceAddr ( &power_addr_, section, "provides", PLAYER_POWER_CODE, -1, NULL ) == 0 )
     {
       if ( AddInterface ( power_addr_ ) != 0 )
@@ -198,201 +789,1555 @@ Nxt::Nxt ( ConfigFile *cf, int section )
       publish_power_ = false;
     }
 
+  if ( publish_power_ )
+    battery_source_ = scheduler_.add_source ( "battery", kBatteryPeriod, 1, PollScheduler::background_traffic,
+                                              kBatteryDeadline );
+
+  keep_alive_source_ = scheduler_.add_source ( "keep_alive", kKeepAlivePeriod, 1, PollScheduler::background_traffic );
+
+  // Admission check, at the cost of a USB round trip till there are measures
+  if ( scheduler_.utilization() > 1.0 )
+    PLAYER_WARN1 ( "nxt: polls at the configured rates need %.0f%% of io_budget; "
+                   "sensors will be deferred and background queries dropped", scheduler_.utilization() * 100.0 );
 }
 
 int Nxt::MainSetup ( void )
 {
-  brick_ = new NXT::brick();
+  const int64_t setup_ns = NXT::monotonic_ns();
+
+  try
+    {
+      if ( ! replay_file_.empty() )
+        {
+          PLAYER_MSG2 ( 1, "nxt: Replaying %s at %.1fx", replay_file_.c_str(), replay_speed_ );
+
+          link_ = replay_ = new NXT::replay_transport ( replay_file_, replay_speed_ );
+        }
+      else if ( emulator_link_.empty() )
+        {
+          PLAYER_MSG2 ( 1, "nxt: Connecting to brick %s%s", brick_id_.empty() ? "(first found)" : brick_id_.c_str(),
+                        fast_attach_ ? " (fast attach)" : "" );
+          link_ = new NXT::USB_transport ( brick_id_, fast_attach_ );
+        }
+      else
+        {
+          PLAYER_MSG1 ( 1, "nxt: Using an emulated brick over %s", emulator_link_.c_str() );
+
+          if ( emulator_link_ == "instant" )
+            emulator_ = new NXT::emulated_transport ( NXT::kLinkInstant );
+          else if ( emulator_link_ == "usb" )
+            emulator_ = new NXT::emulated_transport ( NXT::kLinkUSB );
+          else if ( emulator_link_ == "bluetooth" )
+            emulator_ = new NXT::emulated_transport ( NXT::kLinkBluetooth );
+          else
+            throw std::runtime_error ( "unknown emulator link: " + emulator_link_ );
+
+          for ( int i = 0; i < kNumSensors; i++ )
+            if ( publish_sensor_[i] && IsDigital ( i ) )
+              emulator_->attach ( static_cast<NXT::sensors> ( i ), &emulated_echo_ );
+
+          link_ = emulator_;
+        }
+
+      if ( ! record_file_.empty() )
+        {
+          PLAYER_MSG1 ( 1, "nxt: Recording telegrams to %s", record_file_.c_str() );
+          recorder_ = new NXT::recording_transport ( *link_, record_file_, record_size_ );
+        }
+
+      brick_ = new NXT::brick ( recorder_ != NULL ? *recorder_ : *link_ );
+    }
+  catch ( std::exception &e )
+    {
+      PLAYER_ERROR1 ( "nxt: %s", e.what() );
+      CloseBrick();
+      return -1;
+    }
+
+  brick_->set_timeout ( timeout_ns_, retries_ );
+  stale_ = false;
+
+  cycle_timer_.restart();
+
+  // Nothing written yet to this brick, so nothing to suppress
+  for ( int i = 0; i < kNumCmdSlots; i++ )
+    {
+      motor_cmd_pending_[i] = false;
+      motor_cmd_sent_[i].clear();
+    }
+
+  // Reset odometries to origin, or take them as they are, and set up sensors
+  NXT::motor_states kept;
+  memset ( &kept, 0, sizeof ( kept ) );
+
+  try
+    {
+      if ( fast_attach_ )
+        kept = brick_->get_motor_states ( motor_mask_ );
+      else
+        for ( int i = 0; i < kNumMotors; i++ )
+          if ( motor_mask_ & ( 1 << i ) )
+            brick_->execute ( NXT::reset_motor_position_telegram ( static_cast<NXT::motors> ( i ), false ) );
+
+      for ( int i = 0; i < kNumSensors; i++ )
+        if ( publish_sensor_[i] )
+          brick_->set_input_mode ( static_cast<NXT::sensors> ( i ), sensor_type_[i], sensor_mode_[i] );
+    }
+  catch ( NXT::nxt_error &e )
+    {
+      PLAYER_ERROR1 ( "nxt: %s", e.what() );
+      CloseBrick();
+      return -1;
+    }
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    {
+      vel_filter_[i].reset();
+      tacho_[i]   = kept.state[i].tacho_count;
+      moving_[i]  = false;
+      speed_[i]   = 0.0;
+      ramping_[i] = false;
+    }
+
+  memset ( &p2d_state_, 0, sizeof ( p2d_state_ ) );
+  wheel_pos_prev_[kL] = tacho_[wheel_[kL]] * odom_rate_[wheel_[kL]];
+  wheel_pos_prev_[kR] = tacho_[wheel_[kR]] * odom_rate_[wheel_[kR]];
+
+  if ( publish_p2d_ && ! pose_file_.empty() )
+    {
+      if ( pose_snapshot_.open ( pose_file_ ) )
+        RestorePose ( fast_attach_ );
+      else
+        PLAYER_WARN1 ( "nxt: Cannot map pose file %s, pose won't be kept", pose_file_.c_str() );
+    }
 
-  // Reset odometries to origin
   for ( int i = 0; i < kNumMotors; i++ )
-    if ( publish_motor_[i] )
-      brick_->execute ( brick_->prepare_reset_motor_position ( static_cast<NXT::motors> ( i ), false ) );
+    {
+      if ( ! speed_controlled_[i] || ! ( motor_mask_ & ( 1 << i ) ) )
+        continue;
+
+      if ( speed_control_ == NULL )
+        speed_control_ = new nxt_driver::SpeedController ( *brick_, speed_rate_, motor_mask_ );
+
+      // From m/s and power per m/s to degrees per second
+      nxt_driver::SpeedController::gains g;
+      g.feedforward = max_power_[i] / max_speed_[i] * odom_rate_[i];
+      g.kp          = speed_kp_[i];
+      g.ki          = speed_ki_[i];
+      g.max_power   = fabs ( max_power_[i] );
+      g.filter_tau  = vel_filter_[i].tau();
+
+      speed_control_->configure ( static_cast<NXT::motors> ( i ), g );
+    }
+
+  if ( speed_control_ != NULL )
+    {
+      PLAYER_MSG1 ( 1, "nxt: Speed control at %.0f Hz", speed_rate_ );
+      speed_control_->start();
+    }
+
+  memset ( &ring_motors_, 0, sizeof ( ring_motors_ ) );
+
+  if ( ! ring_file_.empty() && ! ring_.open ( ring_file_, std::max ( 1, ring_size_ ) ) )
+    PLAYER_WARN1 ( "nxt: Cannot map odometry ring %s, samples won't be exported", ring_file_.c_str() );
+
+  if ( ! StartIo() )
+    {
+      PLAYER_ERROR ( "nxt: cannot start I/O thread" );
+      delete speed_control_;
+      speed_control_ = NULL;
+      CloseBrick();
+      return -1;
+    }
+
+  PLAYER_MSG1 ( 1, "nxt: Ready in %.1f ms", ( NXT::monotonic_ns() - setup_ns ) * 1e-6 );
 
   return 0;
 }
 
 void Nxt::MainQuit ( void )
 {
+  // Before anything else writes to the motors
+  StopIo();
+
+  delete speed_control_;
+  speed_control_ = NULL;
+
   // Stop motors just in case they're running.
   // The brick has no watchdog, so they will keep its last commanded speed forever
-  for ( int i = 0; i < kNumMotors; i++ )
-    if ( publish_motor_[i] )
-      brick_->set_motor ( static_cast<NXT::motors> ( i ), 0 );
+  // One by one even if fused: no other port is ours to stop
+  // A brick gone or silent by now can't be stopped, but what was opened for it still has to be closed
+  try
+    {
+      for ( int i = 0; i < kNumMotors; i++ )
+        if ( motor_mask_ & ( 1 << i ) )
+          brick_->set_motor ( static_cast<NXT::motors> ( i ), 0 );
+    }
+  catch ( NXT::nxt_error &e )
+    {
+      PLAYER_WARN1 ( "nxt: cannot stop motors: %s", e.what() );
+    }
+
+  CloseBrick();
+
+  pose_snapshot_.close();
+  ring_.close();
+}
 
+// Each link after whatever uses it
+void Nxt::CloseBrick ( void )
+{
   delete brick_;
+  delete recorder_;
+  delete link_;
+
+  brick_    = NULL;
+  recorder_ = NULL;
+  link_     = NULL;
+  emulator_ = NULL;
+  replay_   = NULL;
 }
 
+// Messages become commands for the I/O thread, which wakes this one up once it has new readings
 void Nxt::Main ( void )
 {
   while ( true )
     {
-      // Wait till we get new data or we need to measure something
       Wait ( period_ );
 
       pthread_testcancel();
 
-      ProcessMessages ( 0 );
+      RaiseQueuePeak ( static_cast<int> ( InQueue->GetLength() ) );
 
-      CheckBattery();
-      CheckMotors();
+      ProcessMessages ( 0 );
+      PublishState();
     }
 }
 
-void Nxt::CheckBattery ( void )
+void Nxt::RaiseQueuePeak ( int length )
 {
-  if ( ! publish_power_ )
-    return;
+  int peak = queue_peak_;
 
-  // We don't want to poll battery level innecesarily often (how much is this, really?)
-  if ( timer_battery_.elapsed() > 10.0 )
-    {
-      timer_battery_.reset();
+  while ( length > peak && ! __sync_bool_compare_and_swap ( &queue_peak_, peak, length ) )
+    peak = queue_peak_;
+}
+
+bool Nxt::StartIo ( void )
+{
+  memset ( &io_state_, 0, sizeof ( io_state_ ) );
+  memset ( &published_, 0, sizeof ( published_ ) );
+  io_changed_  = false;
+  io_stopping_ = false;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init ( &attr );
+  pthread_condattr_setclock ( &attr, CLOCK_MONOTONIC );
 
-      juice_.valid = PLAYER_POWER_MASK_VOLTS;
-      juice_.volts = static_cast<float> ( brick_->get_battery_level() ) / 1000.0f;
-      // Omitted 4 unknown values here
-    };
+  pthread_mutex_init ( &io_mutex_, NULL );
+  pthread_cond_init ( &io_wake_, &attr );
+  pthread_condattr_destroy ( &attr );
 
-  // Publish value
-  if ( HasSubscriptions() )
-    Publish ( power_addr_,
-              PLAYER_MSGTYPE_DATA,
-              PLAYER_POWER_DATA_STATE,
-              static_cast<void*> ( &juice_ ) );
+  io_running_ = pthread_create ( &io_thread_, NULL, IoMain, this ) == 0;
+
+  if ( ! io_running_ )
+    {
+      pthread_cond_destroy ( &io_wake_ );
+      pthread_mutex_destroy ( &io_mutex_ );
+    }
 
-  PLAYER_MSG1 ( 3, "Publishing power: %8.2f\n", juice_.volts );
+  return io_running_;
 }
 
-void Nxt::CheckMotors ( void )
+void Nxt::StopIo ( void )
 {
-  if ( timer_period_.elapsed() < period_ )
+  if ( ! io_running_ )
     return;
 
-  timer_period_.reset();
+  pthread_mutex_lock ( &io_mutex_ );
+  io_stopping_ = true;
+  pthread_cond_signal ( &io_wake_ );
+  pthread_mutex_unlock ( &io_mutex_ );
 
-  // First we get odometry updates from brick
-  for ( int i = 0; i < kNumMotors; i++ )
+  pthread_join ( io_thread_, NULL );
+  io_running_ = false;
+
+  pthread_cond_destroy ( &io_wake_ );
+  pthread_mutex_destroy ( &io_mutex_ );
+}
+
+void *Nxt::IoMain ( void *self )
+{
+  static_cast<Nxt*> ( self )->IoLoop();
+  return NULL;
+}
+
+void Nxt::IoLoop ( void )
+{
+  while ( ! io_stopping_ )
     {
-      if ( ! publish_motor_[i] )
-        continue;
+      WaitForWork();
+
+      // Whatever fails with the brick, this goes on at its pace, with data marked as stale
+      try
+        {
+          io_command cmd;
+          while ( commands_.pop ( cmd ) )
+            ApplyCommand ( cmd );
 
-      const NXT::output_state state = brick_->get_motor_state ( static_cast<NXT::motors> ( i ) );
+          StepRamps();
+          SendMotorCommands();
 
-      data_state_[i].pos = state.tacho_count * odom_rate_[i];
-      data_state_[i].vel = ( data_state_[i].pos - data_state_prev_[i].pos ) / period_;
+          CheckMotors();
+          CheckDigitalSensors();
+        }
+      catch ( NXT::nxt_error &e )
+        {
+          SetStale ( e.what() );
 
-      PLAYER_MSG3 ( 5, "nxt: odom read is [raw/adjusted/vel] = [ %8d / %8.2f / %8.2f ]",
-                    state.tacho_count, data_state_[i].pos, data_state_[i].vel );
+          if ( cycle_timer_.remaining() <= 0.0 ) // Else this would spin till the brick is back
+            cycle_timer_.start_cycle();
+        }
 
-      data_state_prev_[i] = data_state_[i];
+      if ( io_changed_ )
+        {
+          io_changed_ = false;
+          state_.publish ( io_state_ );
+          InQueue->DataAvailable(); // Wakes the Player thread
+        }
     }
+}
 
-  // Then we publish them together, to minimize unsyncing in a consuming driver (e.g. differential driver)
-  for ( int i = 0; i < kNumMotors; i++ )
-    if ( publish_motor_[i] && HasSubscriptions() )
-      Publish ( motor_addr_[i],
-                PLAYER_MSGTYPE_DATA,
-                PLAYER_POSITION1D_DATA_STATE,
-                static_cast<void*> ( &data_state_[i] ) );
+// Till a command arrives, the next cycle is due, or an I2C exchange in progress is to be stepped
+void Nxt::WaitForWork ( void )
+{
+  int64_t deadline = cycle_timer_.deadline_ns();
+
+  if ( DigitalBusy() )
+    deadline = std::min ( deadline, NXT::monotonic_ns() + static_cast<int64_t> ( kLsStepTime * 1e9 ) );
+
+  struct timespec until;
+  until.tv_sec  = deadline / 1000000000LL;
+  until.tv_nsec = deadline % 1000000000LL;
+
+  pthread_mutex_lock ( &io_mutex_ );
 
+  while ( ! io_stopping_ && commands_.empty() && NXT::monotonic_ns() < deadline )
+    pthread_cond_timedwait ( &io_wake_, &io_mutex_, &until );
+
+  pthread_mutex_unlock ( &io_mutex_ );
 }
 
-int Nxt::ProcessMessage ( QueuePointer  & resp_queue,
-                          player_msghdr * hdr,
-                          void          * data )
+// From the Player thread. Commands are never dropped: if the I/O thread is so far behind
+//   (i.e. stuck on a brick that doesn't answer) that the queue is full, this waits for room.
+void Nxt::QueueCommand ( const io_command &cmd )
 {
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POWER_REQ_SET_CHARGING_POLICY, power_addr_ ) )
+  while ( ! commands_.push ( cmd ) )
     {
-      PLAYER_WARN ( "nxt: there are no charging policies." );
-      return 0;
+      commands_waited_.add();
+      usleep ( kQueueFullSleep );
     }
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION1D_CMD_POS ) ||
-       Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_POSITION_PID ) )
-    {
-      PLAYER_WARN ( "nxt: position commands not supported" );
-      return 0;
-    }
+  // The queue was checked by the I/O thread under the mutex, so it is either awake or waiting
+  pthread_mutex_lock ( &io_mutex_ );
+  pthread_cond_signal ( &io_wake_ );
+  pthread_mutex_unlock ( &io_mutex_ );
+}
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION1D_CMD_VEL ) )
-    {
-      player_position1d_cmd_vel_t &vel = *static_cast<player_position1d_cmd_vel_t*> ( data );
+void Nxt::ApplyCommand ( const io_command &cmd )
+{
+  AdaptMotorPeriod ( false ); // Whatever it is, its effect is to be seen at full rate
 
-      const NXT::motors motor = GetMotor ( hdr->addr );
-      brick_->set_motor ( motor, GetPower ( vel.vel, motor ) );
+  switch ( cmd.kind )
+    {
+    case io_set_vel:
+      {
+        player_pose2d_t vel;
+        vel.px = cmd.value[0];
+        vel.py = cmd.value[1];
+        vel.pa = cmd.value[2];
 
-      return 0;
+        SetVel ( vel );
+        break;
+      }
+    case io_set_speed:
+      SetSpeed ( cmd.motor, cmd.value[0] );
+      break;
+    case io_move_to:
+      MoveTo ( cmd.motor, cmd.value[0], cmd.value[1] );
+      break;
+    case io_reset_odom:
+      brick_->execute ( NXT::reset_motor_position_telegram ( cmd.motor ) );
+      RebaseTacho ( cmd.motor );
+      vel_filter_[cmd.motor].reset(); // Else it takes the jump for a burst of speed
+      break;
+    case io_set_odom:
+      p2d_state_.pos.px = cmd.value[0];
+      p2d_state_.pos.py = cmd.value[1];
+      p2d_state_.pos.pa = cmd.value[2];
+      break;
+    case io_speed_prof:
+      max_power_[cmd.motor] *= ( cmd.value[0] / max_speed_[cmd.motor] ); // Adjust power proportionally
+      max_speed_[cmd.motor]  = cmd.value[0];
+      accel_[cmd.motor]      = std::max ( 0.0, cmd.value[1] );
+
+      if ( abs ( max_power_[cmd.motor] ) > 100 )
+        PLAYER_WARN2 ( "nxt: requested speed would require excess power: [speed/power] = [ %8.2f / %8.2f ]",
+                       max_speed_[cmd.motor], max_power_[cmd.motor] );
+      break;
     }
+}
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_GET_GEOM ) )
-    {
-      PLAYER_WARN ( "nxt: geometry not supported" );
-      return 0;
-    }
+// Whatever the I/O thread updated since last time, motors first and then the pose, to minimize
+//   unsyncing in a consuming driver (e.g. differential driver)
+void Nxt::PublishState ( void )
+{
+  if ( ! state_.update() )
+    return;
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_POSITION_MODE ) )
-    {
-      PLAYER_WARN ( "nxt: mode is always speed" );
-      return 0;
-    }
+  const published_state &state = state_.front();
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_MOTOR_POWER ) )
+  if ( state.motors != published_.motors )
     {
-      PLAYER_WARN ( "nxt: motors are always on" );
-      return 0;
+      published_.motors = state.motors;
+
+      for ( int i = 0; i < kNumMotors; i++ )
+        if ( publish_motor_[i] && HasSubscriptions() )
+          {
+            player_position1d_data_t data  = state.motor[i];
+            double                   stamp = state.motor_ns[i] != 0 ? Timestamp ( state.motor_ns[i] ) : 0.0;
+
+            Publish ( motor_addr_[i],
+                      PLAYER_MSGTYPE_DATA,
+                      PLAYER_POSITION1D_DATA_STATE,
+                      static_cast<void*> ( &data ),
+                      0,
+                      state.motor_ns[i] != 0 ? &stamp : NULL );
+          }
     }
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_RESET_ODOM ) )
+  if ( state.odometry != published_.odometry && publish_p2d_ )
     {
-      brick_->execute ( brick_->prepare_reset_motor_position ( GetMotor ( hdr->addr ) ) );
-      return 0;
-    }
+      published_.odometry = state.odometry;
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_SET_ODOM ) )
-    {
-      PLAYER_WARN ( "nxt: odometry setting to arbitrary values not supported" );
-      return 0;
+      if ( HasSubscriptions() )
+        {
+          player_position2d_data_t data  = state.p2d;
+          double                   stamp = Timestamp ( state.p2d_ns );
+
+          Publish ( p2d_addr_,
+                    PLAYER_MSGTYPE_DATA,
+                    PLAYER_POSITION2D_DATA_STATE,
+                    static_cast<void*> ( &data ),
+                    0,
+                    &stamp );
+        }
     }
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_SPEED_PID ) )
+  if ( state.power != published_.power )
     {
-      PLAYER_WARN ( "nxt: speed profiles not supported" );
-      return 0;
-    }
+      published_.power = state.power;
 
-  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_SPEED_PROF ) )
-    {
-      PLAYER_WARN ( "nxt: acceleration ignored, adjusting max speed only" );
-      const NXT::motors motor = GetMotor ( hdr->addr );
-      const player_position1d_speed_prof_req_t &prof = *static_cast<player_position1d_speed_prof_req_t*> ( data );
+      player_power_data_t juice = state.juice;
 
-      max_power_[motor] *= ( prof.speed / max_speed_[motor] ); // Adjust power proportionally
-      max_speed_[motor]  = prof.speed;
+      if ( HasSubscriptions() )
+        Publish ( power_addr_,
+                  PLAYER_MSGTYPE_DATA,
+                  PLAYER_POWER_DATA_STATE,
+                  static_cast<void*> ( &juice ) );
 
-      if ( abs ( max_power_[motor] ) > 100 )
-        PLAYER_WARN2 ( "nxt: requested speed would require excess power: [speed/power] = [ %8.2f / %8.2f ]",
-                       max_speed_[motor], max_power_[motor] );
-      return 0;
+      PLAYER_MSG1 ( 3, "Publishing power: %8.2f\n", juice.volts );
     }
 
-  PLAYER_WARN4 ( "nxt: Message not processed idx:%d type:%d sub:%d seq:%d\n", hdr->addr.index, hdr->type, hdr->subtype, hdr->seq );
-  return -1;
-}
+  for ( int i = 0; i < kNumSensors; i++ )
+    {
+      if ( state.sensor[i] == published_.sensor[i] )
+        continue;
 
+      published_.sensor[i] = state.sensor[i];
 
-NXT::motors Nxt::GetMotor ( const player_devaddr_t &addr ) const
-  {
-    for ( int i = 0; i < kNumMotors; i++ )
-      if ( ( addr.host   == motor_addr_[i].host ) &&
-           ( addr.robot  == motor_addr_[i].robot ) &&
-           ( addr.index  == motor_addr_[i].index ) &&
-           ( addr.interf == motor_addr_[i].interf ) )
-        return static_cast<NXT::motors> ( i );
+      if ( sensor_addr_[i].interf == PLAYER_DIO_CODE )
+        {
+          player_dio_data_t dio;
+          dio.count = 1;
+          dio.bits  = state.sensor_value[i] != 0.0 ? 1 : 0;
+
+          Publish ( sensor_addr_[i],
+                    PLAYER_MSGTYPE_DATA,
+                    PLAYER_DIO_DATA_VALUES,
+                    static_cast<void*> ( &dio ) );
+        }
+      else if ( sensor_addr_[i].interf == PLAYER_AIO_CODE )
+        {
+          float voltage = state.sensor_value[i];
+
+          player_aio_data_t aio;
+          aio.voltages_count = 1;
+          aio.voltages       = &voltage;
+
+          Publish ( sensor_addr_[i],
+                    PLAYER_MSGTYPE_DATA,
+                    PLAYER_AIO_DATA_STATE,
+                    static_cast<void*> ( &aio ) );
+        }
+      else
+        {
+          double range = state.sensor_value[i];
+
+          player_ranger_data_range_t ranger;
+          ranger.ranges_count = 1;
+          ranger.ranges       = &range;
+
+          Publish ( sensor_addr_[i],
+                    PLAYER_MSGTYPE_DATA,
+                    PLAYER_RANGER_DATA_RANGE,
+                    static_cast<void*> ( &ranger ) );
+        }
+    }
+}
+
+// The last readings stay, with the enabled bit cleared; velocity commands keep waiting to be written
+void Nxt::SetStale ( const char *why )
+{
+  if ( ! stale_ )
+    PLAYER_WARN1 ( "nxt: brick failing, publishing stale data: %s", why );
+
+  stale_ = true;
+  stale_cycles_++;
+
+  if ( ring_.is_open() && ring_motors_.kind == nxt_driver::odometry_motors )
+    {
+      ring_motors_.stamp_ns = NXT::monotonic_ns();
+      ring_motors_.stale    = 1;
+      ring_.push ( ring_motors_ );
+    }
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    {
+      data_state_[i].status &= ~ ( 1 << PLAYER_POSITION1D_STATUS_ENABLED );
+
+      io_state_.motor[i]    = data_state_[i];
+      io_state_.motor_ns[i] = 0;
+    }
+
+  io_state_.motors++;
+  io_changed_ = true;
+}
+
+// The brick may have been reset meanwhile, losing its settings
+void Nxt::Recover ( void )
+{
+  PLAYER_MSG0 ( 1, "nxt: brick answering again" );
+
+  stale_ = false;
+
+  for ( int i = 0; i < kNumSensors; i++ )
+    if ( publish_sensor_[i] )
+      brick_->set_input_mode ( static_cast<NXT::sensors> ( i ), sensor_type_[i], sensor_mode_[i] );
+
+  // Velocities are written again, not moves, which would start over
+  for ( int i = 0; i < kNumCmdSlots; i++ )
+    {
+      if ( motor_cmd_sent_[i].size() > 0 && motor_cmd_[i] == motor_cmd_sent_[i] && motor_cmd_[i].long_at ( 8 ) == 0 )
+        motor_cmd_pending_[i] = true;
+
+      motor_cmd_sent_[i].clear();
+    }
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    vel_filter_[i].reset();
+}
+
+void Nxt::UpdateBattery ( const NXT::telegram &reply )
+{
+  juice_.valid = PLAYER_POWER_MASK_VOLTS;
+  juice_.volts = static_cast<float> ( NXT::decode_battery_level ( reply ) ) / 1000.0f;
+  // Omitted 4 unknown values here
+
+  io_state_.juice = juice_;
+  io_state_.power++;
+  io_changed_ = true;
+}
+
+void Nxt::CheckMotors ( void )
+{
+  if ( ! cycle_timer_.start_cycle() )
+    return;
+
+  cycle_late_.add ( cycle_timer_.last_late_ns() );
+
+  const int64_t start = NXT::monotonic_ns();
+
+  int       due[kNumSensors + 1];
+  const int num_due = scheduler_.plan ( start, due, kNumSensors + 1 );
+
+  // Other queries are sent first, so they travel pipelined with the motor ones
+  bool              poll_motors = false;
+  bool              answered    = false;  // Some reply came back from the brick this cycle
+  NXT::reply_future sensor_replies[kNumSensors];
+  NXT::reply_future battery_reply;
+
+  for ( int d = 0; d < num_due; d++ )
+    if ( due[d] == motor_source_ )
+      poll_motors = true;
+    else if ( due[d] == battery_source_ )
+      battery_reply = brick_->execute_async ( NXT::get_battery_level_telegram() );
+    else if ( due[d] == keep_alive_source_ )
+      brick_->execute ( NXT::keep_alive_telegram() );
+    else
+      for ( int i = 0; i < kNumSensors; i++ )
+        if ( due[d] == sensor_source_[i] )
+          sensor_replies[i] = brick_->execute_async ( sensor_query_[i] );
+
+  // First we get odometry updates from brick, all motors in a single snapshot
+  if ( poll_motors )
+    {
+      NXT::motor_states states;
+      if ( speed_control_ == NULL || ! speed_control_->latest ( states ) || ! ReadAfterRebase ( states ) )
+        {
+          states   = brick_->get_motor_states ( motor_mask_ );
+          answered = true;
+        }
+
+      bool idle = true;
+      for ( int i = 0; i < kNumCmdSlots; i++ )
+        idle = idle && ! motor_cmd_pending_[i];
+
+      // Velocities go by the time between the readings, as stamped by their round trips, not by period
+      for ( int i = 0; i < kNumMotors; i++ )
+        {
+          if ( ! ( motor_mask_ & ( 1 << i ) ) )
+            continue;
+
+          const NXT::output_state &state = states.state[i];
+
+          idle = idle && tacho_[i] == state.tacho_count && speed_[i] == 0.0 && ! ramping_[i];
+
+          tacho_[i]          = state.tacho_count;
+          data_state_[i].pos = state.tacho_count * odom_rate_[i];
+          data_state_[i].vel = vel_filter_[i].update ( data_state_[i].pos, states.sample_ns[i] );
+
+          // The brick idles the motor once the limit is reached; a move not yet written can't be over
+          if ( moving_[i] && ! motor_cmd_pending_[i] && state.state == NXT::motor_run_state_idle )
+            moving_[i] = false;
+
+          data_state_[i].status = ( 1 << PLAYER_POSITION1D_STATUS_ENABLED ) |
+                                  ( moving_[i] ? 0 : 1 << PLAYER_POSITION1D_STATUS_TRAJ_COMPLETE );
+
+          PLAYER_MSG3 ( 5, "nxt: odom read is [raw/adjusted/vel] = [ %8d / %8.2f / %8.2f ]",
+                        state.tacho_count, data_state_[i].pos, data_state_[i].vel );
+        }
+
+      for ( int i = 0; i < kNumMotors; i++ )
+        idle = idle && ! moving_[i];
+
+      AdaptMotorPeriod ( idle );
+
+      if ( publish_p2d_ )
+        UpdateOdometry ( states );
+
+      if ( ring_.is_open() )
+        ExportMotors ( states );
+
+      // Then they are handed over together, to be published together
+      for ( int i = 0; i < kNumMotors; i++ )
+        {
+          io_state_.motor[i]    = data_state_[i];
+          io_state_.motor_ns[i] = states.sample_ns[i];
+        }
+
+      io_state_.motors++;
+
+      if ( publish_p2d_ )
+        {
+          io_state_.p2d    = p2d_state_;
+          io_state_.p2d_ns = ( states.sample_ns[wheel_[kL]] + states.sample_ns[wheel_[kR]] ) / 2;
+          io_state_.odometry++;
+        }
+
+      io_changed_ = true;
+    }
+
+  for ( int i = 0; i < kNumSensors; i++ )
+    if ( sensor_replies[i].valid() )
+      {
+        PublishSensor ( i, NXT::decode_input_values ( sensor_replies[i].get() ) );
+        answered = true;
+      }
+
+  if ( battery_reply.valid() )
+    {
+      UpdateBattery ( battery_reply.get() );
+      answered = true;
+    }
+
+  const int64_t elapsed = NXT::monotonic_ns() - start;
+
+  scheduler_.completed ( elapsed );
+  cycle_time_.add ( elapsed );
+
+  // Only a reply tells the brick is back: commands without one (e.g. keep-alives) may go nowhere
+  if ( stale_ && answered )
+    Recover();
+
+  if ( stats_period_ > 0.0 && timer_stats_.elapsed() > stats_period_ )
+    {
+      timer_stats_.reset();
+      LogStats();
+    }
+}
+
+// Motors are read every period while they move or may move, and ever less often while they don't
+void Nxt::AdaptMotorPeriod ( bool idle )
+{
+  const double next = idle ? std::min ( motor_period_ * 2.0, idle_period_ ) : period_;
+
+  if ( next == motor_period_ || motor_source_ < 0 )
+    return;
+
+  motor_period_ = next;
+  scheduler_.set_period ( motor_source_, motor_period_ );
+
+  PLAYER_MSG1 ( 3, "nxt: reading motors every %.0f ms", motor_period_ * 1000.0 );
+}
+
+void Nxt::SendMotorCommands ( void )
+{
+  const int64_t now    = NXT::monotonic_ns();
+  const int64_t period = static_cast<int64_t> ( period_ * 1e9 );
+
+  for ( int i = 0; i < kNumCmdSlots; i++ )
+    {
+      // Once per period at most: streaming clients can't build a backlog in the link
+      if ( ! motor_cmd_pending_[i] || now - motor_cmd_sent_ns_[i] < period )
+        continue;
+
+      // Moves are never taken as repeated: the same telegram is a new move from where the last one ended
+      if ( motor_cmd_[i] == motor_cmd_sent_[i] && motor_cmd_[i].long_at ( 8 ) == 0 &&
+           now - motor_cmd_sent_ns_[i] < command_refresh_ns_ )
+        {
+          motor_cmd_pending_[i] = false;
+          motor_suppressed_[i]++;
+          continue;
+        }
+
+      brick_->execute ( motor_cmd_[i] ); // Still pending if this fails
+
+      motor_cmd_pending_[i] = false;
+
+      motor_cmd_sent_[i]    = motor_cmd_[i];
+      motor_cmd_sent_ns_[i] = now;
+      motor_writes_[i]++;
+
+      // Slots overlapping this one no longer know what their motors are doing
+      for ( int j = 0; j < kNumCmdSlots; j++ )
+        if ( j != i && ( i == kSyncSlot || j == kSyncSlot ) )
+          motor_cmd_sent_[j].clear();
+    }
+}
+
+// Same as brick::set_motor, without encoding anything anew
+// Written by SendMotorCommands, so a command not yet written is just replaced
+void Nxt::QueueMotorCommand ( int slot, int8_t power, NXT::regulation_modes regulation, int8_t turn_ratio,
+                              uint32_t tacho_limit, NXT::motor_run_states state )
+{
+  motor_cmd_[slot].
+  set_power ( power ).
+  set_regulation ( regulation ).
+  set_turn_ratio ( turn_ratio ).
+  set_run_state ( power == 0 && state == NXT::motor_run_state_running ? NXT::motor_run_state_idle : state ).
+  set_tacho_limit ( tacho_limit );
+
+  if ( motor_cmd_pending_[slot] )
+    motor_coalesced_[slot]++;
+  motor_cmd_pending_[slot] = true;
+}
+
+// The whole move goes in one telegram; CheckMotors sees it end in the readings it does anyway
+void Nxt::MoveTo ( NXT::motors motor, double pos, double vel )
+{
+  if ( moving_[motor] && pos == move_target_[motor] )
+    return;
+
+  if ( SpeedControlled ( motor ) )
+    speed_control_->release ( motor ); // Till the next velocity command
+
+  // The last poll may be a period old; while turning, the motor has gone on since
+  if ( moving_[motor] || speed_[motor] != 0.0 || ramping_[motor] )
+    tacho_[motor] = brick_->get_motor_state ( motor ).tacho_count;
+
+  // Moves end at rest, where the next velocity command ramps from
+  ramping_[motor] = false;
+  speed_[motor]   = 0.0;
+
+  const int32_t target = static_cast<int32_t> ( floor ( pos / odom_rate_[motor] + 0.5 ) );
+  const int32_t left   = target - tacho_[motor];
+
+  move_target_[motor] = pos;
+  moving_[motor]      = left != 0;
+
+  if ( left == 0 )
+    {
+      QueueMotorCommand ( motor, 0, NXT::regulation_motor_speed, 0 );
+      return;
+    }
+
+  int power = vel != 0.0 ? abs ( GetPower ( fabs ( vel ), motor ) ) : static_cast<int> ( fabs ( max_power_[motor] ) );
+  power     = std::max ( power, 1 );
+
+  PLAYER_MSG4 ( 4, "nxt: motor %s moving to %8.2f: %d degrees at %d%% power", motor_names[motor], pos, left, power );
+
+  QueueMotorCommand ( motor, left > 0 ? power : -power, NXT::regulation_motor_speed, 0, abs ( left ) );
+}
+
+// Velocity of a position1d motor, within its acceleration limit
+void Nxt::SetSpeed ( NXT::motors motor, double vel )
+{
+  moving_[motor] = false; // Any move is overridden
+
+  if ( ramp_pair_ && ( motor == wheel_[kL] || motor == wheel_[kR] ) )
+    ramp_pair_ = false; // The other wheel goes on alone
+
+  if ( accel_[motor] <= 0.0 || vel == speed_[motor] )
+    {
+      ramping_[motor] = false;
+      Drive ( motor, vel );
+    }
+  else if ( brick_ramps_ && BrickRamp ( motor, speed_[motor], vel ) )
+    ramping_[motor] = false;
+  else
+    {
+      if ( ! ramping_[motor] )
+        {
+          ramp_speed_[motor] = speed_[motor];
+          ramp_ns_[motor]    = NXT::monotonic_ns();
+          ramps_host_[motor]++;
+        }
+
+      ramping_[motor]     = true;
+      ramp_target_[motor] = vel;
+    }
+}
+
+void Nxt::Drive ( NXT::motors motor, double vel )
+{
+  speed_[motor] = vel;
+
+  if ( SpeedControlled ( motor ) )
+    speed_control_->set_speed ( motor, vel / odom_rate_[motor] );
+  else
+    QueueMotorCommand ( motor, GetPower ( vel, motor ), NXT::regulation_motor_speed, 0 );
+}
+
+// The firmware ramps alone speeding up in one direction, after which the motor keeps running, or slowing
+//   to a stop. It ramps power linearly along the tacho limit, so acceleration is speed times the slope of
+//   speed along distance: the limit keeps it within bounds at the fastest end of the ramp.
+bool Nxt::BrickRamp ( NXT::motors motor, double from, double to )
+{
+  const bool up = fabs ( to ) > fabs ( from );
+
+  if ( SpeedControlled ( motor ) || from * to < 0.0 || ( ! up && to != 0.0 ) )
+    return false;
+
+  const double length = std::max ( fabs ( from ), fabs ( to ) ) * fabs ( to - from ) / accel_[motor];
+
+  const uint32_t limit = std::max ( 1, static_cast<int> ( floor ( length / fabs ( odom_rate_[motor] ) + 0.5 ) ) );
+
+  PLAYER_MSG5 ( 4, "nxt: motor %s ramping on the brick from %8.2f to %8.2f along %u degrees (%s)",
+                motor_names[motor], from, to, limit, up ? "up" : "down" );
+
+  QueueMotorCommand ( motor, GetPower ( to, motor ), NXT::regulation_motor_speed, 0, limit,
+                      up ? NXT::motor_run_state_ramp_up : NXT::motor_run_state_rampdown );
+
+  speed_[motor] = to;
+  ramps_brick_[motor]++;
+
+  return true;
+}
+
+// Ramps from here step their speed by the time elapsed, but only changes of power are commanded
+void Nxt::StepRamps ( void )
+{
+  const int64_t now  = NXT::monotonic_ns();
+  bool          pair = false; // The pair has to be commanded
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    {
+      if ( ! ramping_[i] )
+        continue;
+
+      const NXT::motors motor = static_cast<NXT::motors> ( i );
+
+      const double left = ramp_target_[i] - ramp_speed_[i];
+      const double step = accel_[i] > 0.0 ? accel_[i] * ( now - ramp_ns_[i] ) * 1e-9 : fabs ( left );
+
+      ramp_ns_[i]     = now;
+      ramp_speed_[i] += std::max ( -step, std::min ( step, left ) );
+      ramping_[i]     = ramp_speed_[i] != ramp_target_[i];
+
+      const bool changed = SpeedControlled ( motor ) ?
+                           ramp_speed_[i] != speed_[i] :
+                           GetPower ( ramp_speed_[i], motor ) != GetPower ( speed_[i], motor );
+
+      if ( ! changed )
+        {
+          if ( ! ramping_[i] )
+            speed_[i] = ramp_speed_[i]; // Reached without a change of power
+          continue;
+        }
+
+      if ( ramp_pair_ && ( motor == wheel_[kL] || motor == wheel_[kR] ) )
+        pair = true;
+      else
+        {
+          Drive ( motor, ramp_speed_[i] );
+          ramp_commands_[i]++;
+        }
+    }
+
+  if ( pair )
+    {
+      DrivePair ( ramp_speed_[wheel_[kL]], ramp_speed_[wheel_[kR]] );
+
+      if ( fused_ )
+        ramp_commands_[kSyncSlot]++;
+      else
+        {
+          ramp_commands_[wheel_[kL]]++;
+          ramp_commands_[wheel_[kR]]++;
+        }
+    }
+
+  if ( ramp_pair_ && ! ramping_[wheel_[kL]] && ! ramping_[wheel_[kR]] )
+    ramp_pair_ = false;
+}
+
+// Synchronized drives can't be ramped by the brick, so the pair always ramps from here
+void Nxt::SetVel ( const player_pose2d_t &vel )
+{
+  const double speed[2] = { vel.px - vel.pa * axis_length_ / 2.0,
+                            vel.px + vel.pa * axis_length_ / 2.0
+                          };
+
+  PLAYER_MSG4 ( 4, "nxt: speed CMD: [vx, va --> vl, vr] = [ %8.2f, %8.2f --> %8.2f, %8.2f ]",
+                vel.px, vel.pa, speed[kL], speed[kR] );
+
+  moving_[wheel_[kL]] = false;
+  moving_[wheel_[kR]] = false;
+
+  if ( accel_[wheel_[kL]] <= 0.0 && accel_[wheel_[kR]] <= 0.0 )
+    {
+      ramping_[wheel_[kL]] = false;
+      ramping_[wheel_[kR]] = false;
+      DrivePair ( speed[kL], speed[kR] );
+    }
+  else
+    {
+      const int64_t now = NXT::monotonic_ns();
+
+      if ( ! ramp_pair_ || ! ( ramping_[wheel_[kL]] || ramping_[wheel_[kR]] ) )
+        {
+          if ( fused_ )
+            ramps_host_[kSyncSlot]++;
+          else
+            {
+              ramps_host_[wheel_[kL]]++;
+              ramps_host_[wheel_[kR]]++;
+            }
+        }
+
+      for ( int k = kL; k <= kR; k++ )
+        {
+          const NXT::motors motor = wheel_[k];
+
+          if ( ! ramping_[motor] )
+            {
+              ramp_speed_[motor] = speed_[motor];
+              ramp_ns_[motor]    = now;
+            }
+
+          ramping_[motor]     = true;
+          ramp_target_[motor] = speed[k];
+        }
+
+      ramp_pair_ = true;
+    }
+
+  if ( vel.py != 0 )
+    PLAYER_WARN1 ( "nxt: Y speed requested is not null; impossible with skid-steering: %8.2f (ignored)", vel.py );
+}
+
+void Nxt::DrivePair ( double left, double right )
+{
+  const double speed[2] = { left, right };
+
+  speed_[wheel_[kL]] = left;
+  speed_[wheel_[kR]] = right;
+
+  // Under speed control each wheel keeps its own speed, which makes synchronization moot
+  if ( SpeedControlled ( wheel_[kL] ) && SpeedControlled ( wheel_[kR] ) )
+    {
+      for ( int k = kL; k <= kR; k++ )
+        speed_control_->set_speed ( wheel_[k], speed[k] / odom_rate_[wheel_[k]] );
+      return;
+    }
+
+  // A wheel under control alone goes synchronized with the other one, so its loop must not write it
+  for ( int k = kL; k <= kR; k++ )
+    if ( SpeedControlled ( wheel_[k] ) )
+      speed_control_->release ( wheel_[k] );
+
+  const int8_t power[2] = { GetPower ( speed[kL], wheel_[kL] ), GetPower ( speed[kR], wheel_[kR] ) };
+
+  // The pair is told in port order
+  const int             first = wheel_[kL] < wheel_[kR] ? kL : kR;
+  const NXT::sync_drive drive = NXT::sync_drive_for ( power[first], power[1 - first] );
+
+  PLAYER_MSG2 ( 5, "nxt: pair drive: [power, turn] = [ %d, %d ]", drive.power_pct, drive.turn_ratio );
+
+  if ( fused_ )
+    QueueMotorCommand ( kSyncSlot, drive.power_pct, NXT::regulation_motor_sync, drive.turn_ratio );
+  else
+    for ( int k = kL; k <= kR; k++ )
+      QueueMotorCommand ( wheel_[k], drive.power_pct, NXT::regulation_motor_sync, drive.turn_ratio );
+}
+
+// As the differential driver does, from the wheels in the snapshot, once their velocities are filtered
+void Nxt::UpdateOdometry ( const NXT::motor_states &states )
+{
+  double moved[2];
+
+  for ( int k = kL; k <= kR; k++ )
+    {
+      const double pos = states.state[wheel_[k]].tacho_count * odom_rate_[wheel_[k]];
+
+      moved[k]           = pos - wheel_pos_prev_[k];
+      wheel_pos_prev_[k] = pos;
+    }
+
+  const double vel[2] = { vel_filter_[wheel_[kL]].velocity(), vel_filter_[wheel_[kR]].velocity() };
+
+  p2d_state_.vel.px = ( vel[kL] + vel[kR] ) / 2.0;
+  p2d_state_.vel.py = 0.0;
+  p2d_state_.vel.pa = ( vel[kR] - vel[kL] ) / axis_length_;
+
+  const double dist  = ( moved[kL] + moved[kR] ) / 2.0;
+  const double turn  = ( moved[kR] - moved[kL] ) / axis_length_;
+  const double theta = p2d_state_.pos.pa;
+
+  // Along the arc of constant curvature between readings, straight if there is no turn
+  if ( fabs ( turn ) < kMinTurn )
+    {
+      p2d_state_.pos.px += dist * cos ( theta );
+      p2d_state_.pos.py += dist * sin ( theta );
+    }
+  else
+    {
+      const double radius = dist / turn;
+      p2d_state_.pos.px += radius * ( sin ( theta + turn ) - sin ( theta ) );
+      p2d_state_.pos.py -= radius * ( cos ( theta + turn ) - cos ( theta ) );
+    }
+
+  p2d_state_.pos.pa = atan2 ( sin ( theta + turn ), cos ( theta + turn ) );
+
+  if ( pose_snapshot_.is_open() )
+    {
+      const nxt_driver::PoseSnapshot::pose pose =
+      {
+        p2d_state_.pos.px, p2d_state_.pos.py, p2d_state_.pos.pa,
+        { states.state[wheel_[kL]].tacho_count, states.state[wheel_[kR]].tacho_count }
+      };
+
+      pose_snapshot_.store ( pose );
+    }
+
+  PLAYER_MSG5 ( 5, "nxt: odom update is ( px, py, pa )( vx, 0.0, va) = ( %7.2f, %7.2f, %7.2f )( %7.2f, 0.0, %7.2f)",
+                p2d_state_.pos.px, p2d_state_.pos.py, p2d_state_.pos.pa, p2d_state_.vel.px, p2d_state_.vel.pa );
+}
+
+// After the tacho of motor was zeroed on the brick, so that odometry takes it as no motion
+void Nxt::RebaseTacho ( NXT::motors motor )
+{
+  tacho_[motor] = 0;
+  rebased_ns_   = NXT::monotonic_ns();
+
+  for ( int k = kL; k <= kR; k++ )
+    if ( wheel_[k] == motor )
+      wheel_pos_prev_[k] = 0.0;
+
+  if ( publish_p2d_ && pose_snapshot_.is_open() && ( wheel_[kL] == motor || wheel_[kR] == motor ) )
+    {
+      const nxt_driver::PoseSnapshot::pose pose =
+      {
+        p2d_state_.pos.px, p2d_state_.pos.py, p2d_state_.pos.pa,
+        { tacho_[wheel_[kL]], tacho_[wheel_[kR]] }
+      };
+
+      pose_snapshot_.store ( pose );
+    }
+}
+
+bool Nxt::ReadAfterRebase ( const NXT::motor_states &states ) const
+  {
+    for ( int i = 0; i < kNumMotors; i++ )
+      if ( ( motor_mask_ & ( 1 << i ) ) && states.sample_ns[i] < rebased_ns_ )
+        return false;
+
+    return true;
+  }
+
+// From the pose file, once wheel_pos_prev_ holds the current tachos.
+// If these were kept, the first update integrates the motion since the pose was stored.
+void Nxt::RestorePose ( bool tachos_kept )
+{
+  nxt_driver::PoseSnapshot::pose pose;
+
+  if ( ! pose_snapshot_.load ( pose ) )
+    return;
+
+  if ( tachos_kept )
+    {
+      for ( int k = kL; k <= kR; k++ )
+        if ( abs ( tacho_[wheel_[k]] - pose.tacho[k] ) > kMaxAttachDrift )
+          {
+            PLAYER_WARN2 ( "nxt: Wheel %s moved %d deg since the stored pose; starting at the origin instead",
+                           motor_names[wheel_[k]], tacho_[wheel_[k]] - pose.tacho[k] );
+            return;
+          }
+
+      wheel_pos_prev_[kL] = pose.tacho[kL] * odom_rate_[wheel_[kL]];
+      wheel_pos_prev_[kR] = pose.tacho[kR] * odom_rate_[wheel_[kR]];
+    }
+
+  p2d_state_.pos.px = pose.px;
+  p2d_state_.pos.py = pose.py;
+  p2d_state_.pos.pa = pose.pa;
+
+  PLAYER_MSG3 ( 1, "nxt: Restored pose ( %.3f, %.3f, %.3f )", pose.px, pose.py, pose.pa );
+}
+
+bool Nxt::IsDigital ( int port ) const
+  {
+    return publish_sensor_[port] &&
+           ( sensor_type_[port] == NXT::sensor_type_lowspeed ||
+             sensor_type_[port] == NXT::sensor_type_lowspeed_9v );
+  }
+
+bool Nxt::DigitalBusy ( void ) const
+  {
+    for ( int i = 0; i < kNumSensors; i++ )
+      if ( ls_[i].busy() )
+        return true;
+
+    return false;
+  }
+
+void Nxt::CheckDigitalSensors ( void )
+{
+  const int64_t now = NXT::monotonic_ns();
+
+  for ( int i = 0; i < kNumSensors; i++ )
+    {
+      if ( ! IsDigital ( i ) )
+        continue;
+
+      if ( ! ls_[i].busy() && now >= ls_next_ns_[i] )
+        {
+          ls_[i].start ( static_cast<NXT::sensors> ( i ), kUltrasonicQuery, sizeof ( kUltrasonicQuery ), 1 );
+          ls_next_ns_[i] = std::max ( ls_next_ns_[i] + ls_period_ns_[i], now );
+        }
+
+      // Never waits: at most sends the next telegram of the exchange
+      if ( ! ls_[i].step ( *brick_ ) )
+        continue;
+
+      if ( ls_[i].state() == NXT::ls_transaction::failed )
+        PLAYER_WARN2 ( "nxt: reading %s failed: %s", sensor_names[i], ls_[i].error().c_str() );
+      else if ( ls_[i].state() == NXT::ls_transaction::done && ls_[i].size() == 1 )
+        {
+          const double range = ls_[i].data() [0] / 100.0; // cm, 255 if no echo
+
+          io_state_.sensor_value[i] = range;
+          io_state_.sensor[i]++;
+          io_changed_ = true;
+
+          if ( ring_.is_open() )
+            ExportSensor ( i, ls_[i].data() [0], ls_[i].data() [0], range );
+
+          PLAYER_MSG2 ( 5, "nxt: sensor %s range is %6.2f", sensor_names[i], range );
+        }
+
+      ls_[i] = NXT::ls_transaction(); // Back to idle, until due again
+    }
+}
+
+void Nxt::PublishSensor ( int port, const NXT::input_values &values )
+{
+  if ( ! values.valid ) // Not yet settled since the mode was set
+    return;
+
+  if ( sensor_addr_[port].interf == PLAYER_DIO_CODE )
+    io_state_.sensor_value[port] = values.scaled != 0 ? 1.0 : 0.0;
+  else
+    {
+      sensor_value_[port]          = values.scaled;
+      io_state_.sensor_value[port] = sensor_value_[port];
+    }
+
+  io_state_.sensor[port]++;
+  io_changed_ = true;
+
+  if ( ring_.is_open() )
+    ExportSensor ( port, values.raw, values.scaled,
+                   sensor_addr_[port].interf == PLAYER_DIO_CODE ? ( values.scaled != 0 ? 1.0 : 0.0 ) : values.scaled );
+
+  PLAYER_MSG3 ( 5, "nxt: sensor %s read is [raw/scaled] = [ %6d / %6d ]",
+                sensor_names[port], values.raw, values.scaled );
+}
+
+// As just published, once odometry is updated
+void Nxt::ExportMotors ( const NXT::motor_states &states )
+{
+  nxt_driver::odometry_sample &s = ring_motors_;
+
+  s.kind     = nxt_driver::odometry_motors;
+  s.mask     = motor_mask_;
+  s.stale    = 0;
+
+  int64_t sum_ns = 0;
+  int     read   = 0;
+
+  for ( int i = 0; i < kNumMotors; i++ )
+    {
+      if ( ! ( motor_mask_ & ( 1 << i ) ) )
+        continue;
+
+      s.motor_ns[i]  = states.sample_ns[i];
+      s.tacho[i]     = states.state[i].tacho_count;
+      s.power[i]     = states.state[i].power_pct;
+      s.run_state[i] = states.state[i].state;
+      s.position[i]  = data_state_[i].pos;
+      s.velocity[i]  = data_state_[i].vel;
+
+      sum_ns += states.sample_ns[i];
+      read++;
+    }
+
+  s.stamp_ns = read > 0 ? sum_ns / read : NXT::monotonic_ns();
+
+  if ( publish_p2d_ )
+    {
+      s.pose[0]     = p2d_state_.pos.px;
+      s.pose[1]     = p2d_state_.pos.py;
+      s.pose[2]     = p2d_state_.pos.pa;
+      s.pose_vel[0] = p2d_state_.vel.px;
+      s.pose_vel[1] = p2d_state_.vel.pa;
+    }
+
+  ring_.push ( s );
+}
+
+void Nxt::ExportSensor ( int port, int32_t raw, int32_t scaled, double value )
+{
+  nxt_driver::odometry_sample s;
+  memset ( &s, 0, sizeof ( s ) );
+
+  s.kind     = nxt_driver::odometry_sensor;
+  s.mask     = port;
+  s.stamp_ns = NXT::monotonic_ns();
+  s.raw      = raw;
+  s.scaled   = scaled;
+  s.value    = value;
+
+  ring_.push ( s );
+}
+
+void Nxt::LogStats ( void )
+{
+  for ( int i = 0; i < scheduler_.num_sources(); i++ )
+    {
+      const PollScheduler::source_stats &st = scheduler_.get_stats ( i );
+      PLAYER_MSG5 ( 1, "nxt: polling %s at %6.2f Hz (%llu polls, %llu deferred, %llu expired)",
+                    scheduler_.name ( i ).c_str(), st.rate,
+                    static_cast<unsigned long long> ( st.polls ),
+                    static_cast<unsigned long long> ( st.deferred ),
+                    static_cast<unsigned long long> ( st.expired ) );
+    }
+
+  if ( idle_period_ > period_ )
+    PLAYER_MSG2 ( 1, "nxt: reading motors every %.0f ms now (%s)", motor_period_ * 1000.0,
+                  motor_period_ > period_ ? "idle" : "active" );
+
+  PLAYER_MSG2 ( 1, "nxt: estimated cost per query: %5.2f ms, polls need %.0f%% of io_budget",
+                scheduler_.query_cost() * 1000.0, scheduler_.utilization() * 100.0 );
+
+  if ( scheduler_.utilization() > 1.0 )
+    PLAYER_WARN ( "nxt: the configured rates exceed io_budget at the measured cost per query" );
+
+  for ( int op = 0; op < NXT::brick::kNumOpcodeStats; op++ )
+    {
+      const NXT::brick::opcode_stats &st = brick_->stats ( op );
+
+      if ( st.timeouts.get() > 0 )
+        PLAYER_MSG3 ( 1, "nxt: opcode 0x%02x: %llu timeouts, %llu retries",
+                      op,
+                      static_cast<unsigned long long> ( st.timeouts.get() ),
+                      static_cast<unsigned long long> ( st.retries.get() ) );
+
+      if ( st.sent.get() > 0 )
+        PLAYER_MSG6 ( 1, "nxt: opcode 0x%02x: %8llu sent, %llu errors, round trip p50/p99/max %6.2f/%6.2f/%6.2f ms",
+                      op,
+                      static_cast<unsigned long long> ( st.sent.get() ),
+                      static_cast<unsigned long long> ( st.errors.get() ),
+                      st.round_trip.percentile_ns ( 0.50 ) * 1e-6,
+                      st.round_trip.percentile_ns ( 0.99 ) * 1e-6,
+                      st.round_trip.max_ns() * 1e-6 );
+    }
+
+  for ( int i = 0; i < kNumCmdSlots; i++ )
+    if ( i == kSyncSlot ? fused_ : ( motor_mask_ & ( 1 << i ) ) != 0 )
+      PLAYER_MSG4 ( 1, "nxt: motor %s: %llu commands written, %llu coalesced, %llu suppressed",
+                    slot_names[i],
+                    static_cast<unsigned long long> ( motor_writes_[i] ),
+                    static_cast<unsigned long long> ( motor_coalesced_[i] ),
+                    static_cast<unsigned long long> ( motor_suppressed_[i] ) );
+
+  for ( int i = 0; i < kNumCmdSlots; i++ )
+    if ( ramps_brick_[i] + ramps_host_[i] > 0 )
+      PLAYER_MSG4 ( 1, "nxt: motor %s: %llu ramps on the brick, %llu from here in %llu commands",
+                    slot_names[i],
+                    static_cast<unsigned long long> ( ramps_brick_[i] ),
+                    static_cast<unsigned long long> ( ramps_host_[i] ),
+                    static_cast<unsigned long long> ( ramp_commands_[i] ) );
+
+  if ( speed_control_ != NULL )
+    {
+      const nxt_driver::SpeedController::loop_stats &sc = speed_control_->stats();
+
+      PLAYER_MSG6 ( 1, "nxt: speed control: %llu ticks, %llu writes, %llu missed, %llu errors, tick p50/p99 %6.2f/%6.2f ms",
+                    static_cast<unsigned long long> ( sc.ticks.get() ),
+                    static_cast<unsigned long long> ( sc.writes.get() ),
+                    static_cast<unsigned long long> ( sc.missed.get() ),
+                    static_cast<unsigned long long> ( sc.errors.get() ),
+                    sc.tick_time.percentile_ns ( 0.50 ) * 1e-6,
+                    sc.tick_time.percentile_ns ( 0.99 ) * 1e-6 );
+
+      PLAYER_MSG2 ( 1, "nxt: speed control jitter p99/max %6.3f/%6.3f ms",
+                    sc.jitter.percentile_ns ( 0.99 ) * 1e-6,
+                    sc.jitter.max_ns() * 1e-6 );
+    }
+
+  const NXT::transport_stats &link = brick_->link_stats();
+
+  PLAYER_MSG6 ( 1, "nxt: link: %llu/%llu telegrams out/in, %llu/%llu bytes out/in, %llu errors, %llu timeouts",
+                static_cast<unsigned long long> ( link.telegrams_out.get() ),
+                static_cast<unsigned long long> ( link.telegrams_in.get() ),
+                static_cast<unsigned long long> ( link.bytes_out.get() ),
+                static_cast<unsigned long long> ( link.bytes_in.get() ),
+                static_cast<unsigned long long> ( link.errors.get() ),
+                static_cast<unsigned long long> ( link.timeouts.get() ) );
+
+  PLAYER_MSG3 ( 1, "nxt: link: %llu reconnects, %llu cycles stale%s",
+                static_cast<unsigned long long> ( link.reconnects.get() ),
+                static_cast<unsigned long long> ( stale_cycles_ ),
+                stale_ ? " (stale now)" : "" );
+
+  if ( recorder_ != NULL )
+    PLAYER_MSG2 ( 1, "nxt: recorded %llu telegrams, %llu dropped for lack of room",
+                  static_cast<unsigned long long> ( recorder_->recorded() ),
+                  static_cast<unsigned long long> ( recorder_->dropped() ) );
+
+  if ( replay_ != NULL )
+    PLAYER_MSG2 ( 1, "nxt: replay: %llu queries recorded, %llu past the recording",
+                  static_cast<unsigned long long> ( replay_->recorded_queries() ),
+                  static_cast<unsigned long long> ( replay_->diverged() ) );
+
+  PLAYER_MSG5 ( 1, "nxt: cycle p50/p99/max %6.2f/%6.2f/%6.2f ms, peak in flight %d, peak queue %d",
+                cycle_time_.percentile_ns ( 0.50 ) * 1e-6,
+                cycle_time_.percentile_ns ( 0.99 ) * 1e-6,
+                cycle_time_.max_ns() * 1e-6,
+                brick_->peak_in_flight(),
+                __sync_lock_test_and_set ( &queue_peak_, 0 ) );
+
+  if ( commands_waited_.get() > 0 )
+    PLAYER_MSG1 ( 1, "nxt: %llu commands waited for room in the I/O queue",
+                  static_cast<unsigned long long> ( commands_waited_.get() ) );
+
+  const PeriodicTimer::timer_stats &timing = cycle_timer_.stats();
+
+  PLAYER_MSG5 ( 1, "nxt: jitter p50/p99/max %6.3f/%6.3f/%6.3f ms, %llu deadlines missed in %llu cycles",
+                cycle_late_.percentile_ns ( 0.50 ) * 1e-6,
+                cycle_late_.percentile_ns ( 0.99 ) * 1e-6,
+                cycle_late_.max_ns() * 1e-6,
+                static_cast<unsigned long long> ( timing.missed ),
+                static_cast<unsigned long long> ( timing.cycles ) );
+}
+
+int Nxt::ProcessMessage ( QueuePointer  & resp_queue,
+                          player_msghdr * hdr,
+                          void          * data )
+{
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POWER_REQ_SET_CHARGING_POLICY, power_addr_ ) )
+    {
+      PLAYER_WARN ( "nxt: there are no charging policies." );
+      return 0;
+    }
+
+  // Position2d first, as its subtypes overlap with those of position1d
+  if ( publish_p2d_ && hdr->addr.interf == PLAYER_POSITION2D_CODE )
+    {
+      if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION2D_CMD_VEL, p2d_addr_ ) )
+        {
+          const player_pose2d_t &vel = static_cast<player_position2d_cmd_vel_t*> ( data )->vel;
+          const io_command       cmd = { io_set_vel, NXT::All, { vel.px, vel.py, vel.pa } };
+
+          QueueCommand ( cmd );
+          return 0;
+        }
+
+      if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION2D_REQ_GET_GEOM, p2d_addr_ ) )
+        {
+          player_position2d_geom_t geom;
+          memset ( &geom, 0, sizeof ( geom ) );
+          geom.size.sw = axis_length_;
+
+          Publish ( p2d_addr_, resp_queue, PLAYER_MSGTYPE_RESP_ACK, hdr->subtype, &geom );
+          return 0;
+        }
+
+      if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION2D_REQ_RESET_ODOM, p2d_addr_ ) )
+        {
+          const io_command cmd = { io_set_odom, NXT::All, { 0.0, 0.0, 0.0 } };
+
+          QueueCommand ( cmd );
+          Publish ( p2d_addr_, resp_queue, PLAYER_MSGTYPE_RESP_ACK, hdr->subtype );
+          return 0;
+        }
+
+      if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION2D_REQ_SET_ODOM, p2d_addr_ ) )
+        {
+          const player_pose2d_t &pose = static_cast<player_position2d_set_odom_req_t*> ( data )->pose;
+          const io_command       cmd  = { io_set_odom, NXT::All, { pose.px, pose.py, pose.pa } };
+
+          QueueCommand ( cmd );
+          Publish ( p2d_addr_, resp_queue, PLAYER_MSGTYPE_RESP_ACK, hdr->subtype );
+          return 0;
+        }
+
+      PLAYER_WARN1 ( "nxt: position2d message not supported, subtype:%d", hdr->subtype );
+      return -1;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION1D_CMD_POS ) )
+    {
+      const player_position1d_cmd_pos_t &pos = *static_cast<player_position1d_cmd_pos_t*> ( data );
+      const io_command                   cmd = { io_move_to, GetMotor ( hdr->addr ), { pos.pos, pos.vel, 0.0 } };
+
+      QueueCommand ( cmd );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_POSITION_PID ) )
+    {
+      PLAYER_WARN ( "nxt: position control is done by the brick firmware, without PID settings" );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_CMD, PLAYER_POSITION1D_CMD_VEL ) )
+    {
+      const player_position1d_cmd_vel_t &vel = *static_cast<player_position1d_cmd_vel_t*> ( data );
+      const io_command                   cmd = { io_set_speed, GetMotor ( hdr->addr ), { vel.vel, 0.0, 0.0 } };
+
+      QueueCommand ( cmd );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_GET_GEOM ) )
+    {
+      PLAYER_WARN ( "nxt: geometry not supported" );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_POSITION_MODE ) )
+    {
+      PLAYER_WARN ( "nxt: there are no modes; velocity and position commands are always accepted" );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_MOTOR_POWER ) )
+    {
+      PLAYER_WARN ( "nxt: motors are always on" );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_RESET_ODOM ) )
+    {
+      const io_command cmd = { io_reset_odom, GetMotor ( hdr->addr ), { 0.0, 0.0, 0.0 } };
+
+      QueueCommand ( cmd );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_SET_ODOM ) )
+    {
+      PLAYER_WARN ( "nxt: odometry setting to arbitrary values not supported" );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_SPEED_PID ) )
+    {
+      PLAYER_WARN ( "nxt: speed profiles not supported" );
+      return 0;
+    }
+
+  if ( Message::MatchMessage ( hdr, PLAYER_MSGTYPE_REQ, PLAYER_POSITION1D_REQ_SPEED_PROF ) )
+    {
+      const player_position1d_speed_prof_req_t &prof = *static_cast<player_position1d_speed_prof_req_t*> ( data );
+      const io_command cmd = { io_speed_prof, GetMotor ( hdr->addr ), { prof.speed, prof.acc, 0.0 } };
+
+      QueueCommand ( cmd );
+      return 0;
+    }
+
+  PLAYER_WARN4 ( "nxt: Message not processed idx:%d type:%d sub:%d seq:%d\n", hdr->addr.index, hdr->type, hdr->subtype, hdr->seq );
+  return -1;
+}
+
+
+NXT::motors Nxt::GetMotor ( const player_devaddr_t &addr ) const
+  {
+    for ( int i = 0; i < kNumMotors; i++ )
+      if ( ( addr.host   == motor_addr_[i].host ) &&
+           ( addr.robot  == motor_addr_[i].robot ) &&
+           ( addr.index  == motor_addr_[i].index ) &&
+           ( addr.interf == motor_addr_[i].interf ) )
+        return static_cast<NXT::motors> ( i );
 
     throw std::runtime_error ( "nxt: received request for unknown motor" );
   }
 
+NXT::motors Nxt::GetMotor ( const char *name ) const
+  {
+    for ( int i = 0; i < kNumMotors; i++ )
+      if ( strcmp ( name, motor_names[i] ) == 0 )
+        return static_cast<NXT::motors> ( i );
+
+    throw std::runtime_error ( std::string ( "nxt: unknown motor: " ) + name );
+  }
+
+bool Nxt::SpeedControlled ( NXT::motors motor ) const
+  {
+    return speed_control_ != NULL && speed_control_->controllable ( motor );
+  }
+
+// Player time of a sample stamped on the monotonic clock
+double Nxt::Timestamp ( int64_t sample_ns ) const
+  {
+    double now;
+    GlobalTime->GetTimeDouble ( &now );
+
+    return now - ( NXT::monotonic_ns() - sample_ns ) * 1e-9;
+  }
+
 template<class T>
 T sign ( T x )
 {
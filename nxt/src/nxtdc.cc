@@ -1,10 +1,15 @@
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <endian.h>
 #include "nxtdc.hh"
 #include <sstream>
 #include <sys/time.h>
+#include <time.h>
 
 using namespace NXT;
 using namespace std;
@@ -15,28 +20,9 @@ const uint16_t PRODUCT_NXT = 0x0002;
 const int kNxtConfig    = 1;
 const int kNxtInterface = 0;
 
-const uint8_t kMaxTelegramSize = 64; // Per NXT spec.
-
 const unsigned char kOutEndpoint = 0x1;
 const unsigned char kInEndpoint  = 0x82;
 
-enum direct_commands
-{
-  command_play_tone            = 0x03,
-  command_set_output_state     = 0x04,
-  command_get_output_state     = 0x06,
-  command_reset_motor_position = 0x0A,
-  command_get_battery_level    = 0x0B,
-  command_stop_sound_playback  = 0x0C,
-  command_keep_alive           = 0x0D
-};
-
-enum system_commands
-{
-  system_get_firmware_version  = 0x88,
-  system_get_device_info       = 0x9B
-};
-
 const char *usberr_to_str ( int err )
 {
   switch ( err )
@@ -74,6 +60,29 @@ const char *usberr_to_str ( int err )
     }
 }
 
+const char *usbxfer_to_str ( libusb_transfer_status status )
+{
+  switch ( status )
+    {
+    case LIBUSB_TRANSFER_COMPLETED:
+      return "LIBUSB_TRANSFER_COMPLETED";
+    case LIBUSB_TRANSFER_ERROR:
+      return "LIBUSB_TRANSFER_ERROR";
+    case LIBUSB_TRANSFER_TIMED_OUT:
+      return "LIBUSB_TRANSFER_TIMED_OUT";
+    case LIBUSB_TRANSFER_CANCELLED:
+      return "LIBUSB_TRANSFER_CANCELLED";
+    case LIBUSB_TRANSFER_STALL:
+      return "LIBUSB_TRANSFER_STALL";
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      return "LIBUSB_TRANSFER_NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW:
+      return "LIBUSB_TRANSFER_OVERFLOW";
+    default:
+      return "LIBUSB_TRANSFER_UNKNOWN";
+    }
+}
+
 string nxterr_to_str ( int err )
 {
   switch ( err )
@@ -157,317 +166,1744 @@ void buffer::dump ( const string & header ) const
       printf ( "%2d = 0x%02x\n", i, this->at ( i ) );
   }
 
-void USB_transport::usb_check ( int usb_error )
+telegram::telegram ( const buffer &buf ) : size_ ( 0 )
 {
-  if ( usb_error != LIBUSB_SUCCESS )
-    throw runtime_error ( string ( "USB error: " ) + usberr_to_str ( usb_error ) );
+  resize ( buf.size() > kMaxTelegramSize ? kMaxTelegramSize + 1 : buf.size() );
+  std::copy ( buf.begin(), buf.end(), data_ );
 }
 
-USB_transport::USB_transport ( void )
+buffer telegram::to_buffer ( void ) const
+  {
+    buffer result;
+    result.assign ( data_, data_ + size_ );
+    return result;
+  }
+
+bool telegram::operator== ( const telegram &other ) const
+  {
+    return size_ == other.size_ && std::equal ( data_, data_ + size_, other.data_ );
+  }
+
+void telegram::resize ( uint8_t size )
 {
-  usb_check ( libusb_init ( &context_ ) );
-  libusb_set_debug ( context_, 3 );
+  if ( size > kMaxTelegramSize )
+    throw nxt_error ( "Telegram too long" );
 
-  handle_ = libusb_open_device_with_vid_pid ( context_, VENDOR_LEGO, PRODUCT_NXT );
-  if ( handle_ == NULL )
-    throw runtime_error ( "USB_transport: brick not found." );
+  size_ = size;
+}
 
-  usb_check ( libusb_set_configuration ( handle_, kNxtConfig ) );
-  usb_check ( libusb_claim_interface ( handle_, kNxtInterface ) );
-  usb_check ( libusb_reset_device ( handle_ ) );
+telegram & telegram::append_byte ( uint8_t byte )
+{
+  resize ( size_ + 1 );
+  data_[size_ - 1] = byte;
+  return *this;
 }
 
-USB_transport::~USB_transport ( void )
+telegram & telegram::append_word ( uint16_t word )
 {
-  //    usb_check(libusb_release_interface(handle_, kNxtInterface));
-  // Fails, why?
+  resize ( size_ + 2 );
+  put_word ( size_ - 2, word );
+  return *this;
+}
 
-  libusb_close ( handle_ );
-  libusb_exit ( context_ );
+telegram & telegram::append_long ( uint32_t value )
+{
+  resize ( size_ + 4 );
+  put_long ( size_ - 4, value );
+  return *this;
 }
 
-void USB_transport::write ( const buffer &buf )
+void telegram::put_word ( uint8_t pos, uint16_t word )
 {
-  int transferred;
+  data_[pos]     = word & 0xFF;
+  data_[pos + 1] = word >> 8;
+}
 
-  // buf.dump ( "write" );
+void telegram::put_long ( uint8_t pos, uint32_t value )
+{
+  data_[pos]     = value & 0xFF;
+  data_[pos + 1] = ( value >> 8 ) & 0xFF;
+  data_[pos + 2] = ( value >> 16 ) & 0xFF;
+  data_[pos + 3] = value >> 24;
+}
 
-  usb_check ( libusb_bulk_transfer
-              ( handle_, kOutEndpoint,
-                ( unsigned char* ) &buf[0], buf.size(),
-                &transferred, 0 ) );
-  // printf ( "T:%d\n", transferred );
+uint16_t telegram::word_at ( uint8_t pos ) const
+  {
+    return data_[pos] | ( data_[pos + 1] << 8 );
+  }
+
+uint32_t telegram::long_at ( uint8_t pos ) const
+  {
+    return
+      static_cast<uint32_t> ( data_[pos] ) |
+      static_cast<uint32_t> ( data_[pos + 1] ) << 8 |
+      static_cast<uint32_t> ( data_[pos + 2] ) << 16 |
+      static_cast<uint32_t> ( data_[pos + 3] ) << 24;
+  }
+
+// Condition variables timed on the monotonic clock, as deadlines are (see monotonic_ns)
+void init_monotonic_cond ( pthread_cond_t *cond )
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init ( &attr );
+  pthread_condattr_setclock ( &attr, CLOCK_MONOTONIC );
+  pthread_cond_init ( cond, &attr );
+  pthread_condattr_destroy ( &attr );
 }
 
-buffer USB_transport::read ( void )
+// False once the deadline passes
+bool timed_wait ( pthread_cond_t *cond, pthread_mutex_t *mutex, int64_t deadline_ns )
 {
-  unsigned char buf[kMaxTelegramSize];
-  int           transferred;
+  const struct timespec at = { static_cast<time_t> ( deadline_ns / 1000000000LL ),
+                               static_cast<long> ( deadline_ns % 1000000000LL )
+                             };
+
+  return pthread_cond_timedwait ( cond, mutex, &at ) != ETIMEDOUT;
+}
+
+const char *kTimedOut = "Reply timed out";
+
+// Locks a mutex for the lifetime of the object
+class scoped_lock
+  {
+  public:
+    scoped_lock ( pthread_mutex_t &mutex ) : mutex_ ( mutex ) { pthread_mutex_lock ( &mutex_ ); };
+    ~scoped_lock ( void ) { pthread_mutex_unlock ( &mutex_ ); };
+  private:
+    pthread_mutex_t &mutex_;
+  };
 
-  usb_check ( libusb_bulk_transfer
-              ( handle_, kInEndpoint,
-                &buf[0], kMaxTelegramSize,
-                &transferred, 0 ) );
-  // printf ( "%2x %2x %2x (%d read)\n", buf[0], buf[1], buf[2], transferred );
+struct reply_future::shared_state
+  {
+    pthread_mutex_t  mutex;
+    pthread_cond_t   arrived;
+    int              refs;
+    bool             done;
+    uint8_t          opcode;   // Of the request, that the reply must match
+    int              port;     // Same, for replies that tell their port; -1 for others
+    reply_callback  *callback;
+    telegram         reply;
+    uint8_t          status;   // Of the reply
+    string           error;    // Empty if successful
+    bool             timed_out;
+    int64_t          deadline_ns;
+    int64_t          sent_ns;  // Of the round trip
+    int64_t          arrived_ns;
+  };
 
-  buffer result;
-  result.reserve ( transferred );
+pthread_mutex_t                      reply_future::pool_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+vector<reply_future::shared_state*>  reply_future::pool_;
 
-  for ( int i = 0; i < transferred; i++ )
-    result.push_back ( buf[i] );
+reply_future::shared_state *reply_future::acquire ( void )
+{
+  {
+    scoped_lock lock ( pool_mutex_ );
+
+    if ( ! pool_.empty() )
+      {
+        shared_state *state = pool_.back();
+        pool_.pop_back();
+        return state;
+      }
+  }
 
-  return result ;
+  shared_state *state = new shared_state;
+  pthread_mutex_init ( &state->mutex, NULL );
+  init_monotonic_cond ( &state->arrived );
+  return state;
 }
 
-brick::brick ( void )
+void reply_future::release ( shared_state *state )
 {
-  ;
+  scoped_lock lock ( pool_mutex_ );
+  pool_.push_back ( state );
 }
 
-brick::~brick ( void )
+reply_future::reply_future ( void ) : state_ ( NULL )
 {
   ;
 }
 
-buffer brick::execute ( const buffer &command, bool with_feedback )
+reply_future::reply_future ( const telegram &command, reply_callback *callback )
+    : state_ ( acquire() )
 {
-  assert ( command.size() >= 2 );
+  state_->refs     = 1;
+  state_->done     = false;
+  state_->opcode   = command[1];
+  state_->port     = command.size() > 2 && ( command[1] == command_get_output_state ||
+                                             command[1] == command_get_input_values ) ? command[2] : -1;
+  state_->callback = callback;
+  state_->status     = 0;
+  state_->timed_out   = false;
+  state_->deadline_ns = 0;
+  state_->sent_ns    = 0;
+  state_->arrived_ns = 0;
+  state_->reply.clear();
+  state_->error.clear();
+}
 
-  if ( with_feedback && ( ! ( command[0] & 0x80 ) ) )
-    link_.write ( command );
-  else if ( ( !with_feedback ) && ( command[0] & 0x80 ) )
-    link_.write ( command );
-  else
-    {
-      buffer newcomm ( command );
+reply_future::reply_future ( const reply_future &other ) : state_ ( other.state_ )
+{
+  if ( state_ != NULL )
+    __sync_add_and_fetch ( &state_->refs, 1 );
+}
 
-      // Set or reset 0x80 bit (confirmation request)
-      newcomm[0] = ( with_feedback ? command[0] & 0x7F : command[0] | 0x80 );
+reply_future & reply_future::operator= ( const reply_future &other )
+{
+  reply_future copy ( other );
+  std::swap ( state_, copy.state_ );
+  return *this;
+}
 
-      link_.write ( newcomm );
-    }
+reply_future::~reply_future ( void )
+{
+  if ( state_ != NULL && __sync_sub_and_fetch ( &state_->refs, 1 ) == 0 )
+    release ( state_ );
+}
 
-  if ( with_feedback )
-    {
-      const buffer reply = link_.read ();
-      if ( reply.size() < 3 )
-        {
-          stringstream s;
-          s << "Reply too short: " << reply.size() << " bytes";
-          throw nxt_error ( s.str () );
-        }
-      else if ( reply[0] != brick::reply )
-        {
-          char s[100];
-          snprintf ( s, 100, "Unexpected telegram: 0x%02x != 0x%02x", reply[0], brick::reply );
-          throw nxt_error ( s );
-        }
-      else if ( reply[1] != command[1] )
-        {
-          char s[100];
-          snprintf ( s, 100, "Unexpected reply type: 0x%02x != 0x%02x", reply[1], command[1] );
-          throw nxt_error ( s );
-        }
-      else if ( reply[2] != 0 )
-        throw nxt_error ( nxterr_to_str ( reply[2] ) );
-      else
-        return reply;
-    }
-  else
-    return buffer();
+bool reply_future::valid ( void ) const
+  {
+    return state_ != NULL;
+  }
+
+bool reply_future::ready ( void ) const
+  {
+    if ( state_ == NULL )
+      return false;
+
+    scoped_lock lock ( state_->mutex );
+    return state_->done;
+  }
+
+const telegram & reply_future::get ( void ) const
+  {
+    if ( state_ == NULL )
+      throw nxt_error ( "Waiting on an invalid reply" );
+
+    scoped_lock lock ( state_->mutex );
+
+    while ( ! state_->done )
+      if ( state_->deadline_ns == 0 )
+        pthread_cond_wait ( &state_->arrived, &state_->mutex );
+      else if ( ! timed_wait ( &state_->arrived, &state_->mutex, state_->deadline_ns ) && ! state_->done )
+        throw nxt_timeout ( kTimedOut );
+
+    if ( state_->timed_out )
+      throw nxt_timeout ( state_->error );
+    else if ( ! state_->error.empty() )
+      throw nxt_error ( state_->error );
+
+    return state_->reply;
+  }
+
+uint8_t reply_future::status ( void ) const
+  {
+    if ( state_ == NULL )
+      return 0;
+
+    scoped_lock lock ( state_->mutex );
+    return state_->status;
+  }
+
+int64_t reply_future::sample_ns ( void ) const
+  {
+    if ( state_ == NULL )
+      return 0;
+
+    scoped_lock lock ( state_->mutex );
+    return state_->sent_ns + ( state_->arrived_ns - state_->sent_ns ) / 2;
+  }
+
+uint8_t reply_future::opcode ( void ) const
+  {
+    return state_->opcode;
+  }
+
+// Replies of GETOUTPUTSTATE and GETINPUTVALUES echo the port (in byte 3), so a late one for another
+//   port isn't taken for this request. Failed replies are taken as they come.
+// LSGETSTATUS and LSREAD replies have no port to tell them apart.
+bool reply_future::matches ( const telegram &reply ) const
+  {
+    if ( reply[1] != state_->opcode )
+      return false;
+
+    return state_->port < 0 || reply[2] != 0 || reply.size() < 4 || reply[3] == state_->port;
+  }
+
+void reply_future::set_deadline ( int64_t deadline_ns )
+{
+  scoped_lock lock ( state_->mutex );
+  state_->deadline_ns = deadline_ns;
 }
 
-buffer brick::prepare_play_tone ( uint16_t tone_Hz, uint16_t duration_ms )
+void reply_future::stamp ( int64_t sent_ns, int64_t arrived_ns )
 {
-  return assemble ( direct_command_without_response,
-                    command_play_tone,
-                    buffer().
-                    append_word ( tone_Hz ).
-                    append_word ( duration_ms ) ) ;
+  scoped_lock lock ( state_->mutex );
+  state_->sent_ns    = sent_ns;
+  state_->arrived_ns = arrived_ns;
 }
 
-buffer brick::prepare_output_state (
-  motors           motor       ,
-  int8_t           power_pct   ,
-  motor_modes      mode        ,
-  regulation_modes regulation  ,
-  int8_t           turn_ratio  ,
-  motor_run_states state       ,
-  uint32_t         tacho_count )
+void reply_future::fulfil ( const telegram &reply )
 {
-  union
+  if ( reply[2] != 0 )
     {
-      uint8_t  bytes[4];
-      uint32_t tacho;
-    } aux;
+      {
+        scoped_lock lock ( state_->mutex );
+        state_->status = reply[2];
+      }
+      fail ( nxterr_to_str ( reply[2] ) );
+      return;
+    }
 
-  aux.tacho = htole32 ( tacho_count );
+  {
+    scoped_lock lock ( state_->mutex );
+    state_->reply = reply;
+    state_->done  = true;
+    pthread_cond_broadcast ( &state_->arrived );
+  }
 
-  return
-    assemble
-    ( direct_command_without_response,
-      command_set_output_state,
-      buffer().
-      append_byte ( motor ).
-      append_byte ( power_pct ).
-      append_byte ( mode ).
-      append_byte ( regulation ).
-      append_byte ( turn_ratio ).
-      append_byte ( state ).
-      append_byte ( aux.bytes[0] ).append_byte ( aux.bytes[1] ).
-      append_byte ( aux.bytes[2] ).append_byte ( aux.bytes[3] ) );
+  if ( state_->callback != NULL )
+    state_->callback->on_reply ( reply );
 }
 
-buffer brick::prepare_reset_motor_position ( motors motor, bool relative_to_last_position )
+void reply_future::fail ( const string &error, bool timed_out )
 {
-  return
-    assemble ( direct_command_without_response,
-               command_reset_motor_position,
-               buffer().
-               append_byte ( motor ).
-               append_byte ( relative_to_last_position ) );
+  {
+    scoped_lock lock ( state_->mutex );
+    state_->error     = error;
+    state_->timed_out = timed_out;
+    state_->done      = true;
+    pthread_cond_broadcast ( &state_->arrived );
+  }
+
+  if ( state_->callback != NULL )
+    state_->callback->on_error ( nxt_error ( error ) );
 }
 
-buffer brick::prepare_stop_sound_playback ( void )
+void transport::post ( const telegram &buf, bool expect_reply )
 {
-  return
-    assemble ( direct_command_without_response,
-               command_stop_sound_playback,
-               buffer() );
+  write ( buf );
+
+  if ( expect_reply )
+    {
+      telegram reply;
+      read ( reply );
+      if ( listener_ != NULL )
+        listener_->on_read ( reply );
+    }
 }
 
-buffer brick::prepare_keep_alive ( void )
+void USB_transport::usb_check ( int usb_error )
 {
-  return
-    assemble ( direct_command_without_response,
-               command_keep_alive,
-               buffer() );
+  if ( usb_error != LIBUSB_SUCCESS )
+    throw nxt_error ( string ( "USB error: " ) + usberr_to_str ( usb_error ) );
 }
 
-void brick::play_tone ( uint16_t tone_Hz, uint16_t duration_ms )
+pthread_mutex_t  USB_transport::context_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+libusb_context  *USB_transport::context_       = NULL;
+int              USB_transport::context_users_ = 0;
+pthread_t        USB_transport::event_thread_;
+volatile bool    USB_transport::stopping_      = false;
+
+pthread_mutex_t         USB_transport::registry_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+vector<USB_transport*>  USB_transport::registry_;
+
+const int64_t kReattachPoll = 500000000LL; // [ns] Between looks for a detached brick, without hotplug events
+const int     kDrainTimeout = 1;           // [ms] Of reads of leftover replies, on fast attach
+const int     kMaxDrained   = 32;
+
+void USB_transport::acquire_context ( void )
 {
-  execute ( prepare_play_tone ( tone_Hz, duration_ms ), false );
+  scoped_lock lock ( context_mutex_ );
+
+  if ( context_users_ == 0 )
+    {
+      usb_check ( libusb_init ( &context_ ) );
+      libusb_set_debug ( context_, 3 );
+
+      stopping_ = false;
+      if ( pthread_create ( &event_thread_, NULL, event_loop, NULL ) != 0 )
+        {
+          libusb_exit ( context_ );
+          throw runtime_error ( "USB_transport: cannot start event thread." );
+        }
+    }
+
+  context_users_++;
 }
 
-void brick::set_motor ( motors motor, int8_t power_pct )
+void USB_transport::release_context ( void )
 {
-  execute
-  ( assemble
-    ( direct_command_without_response,
-      command_set_output_state,
-      buffer().
-      append_byte ( motor ).
-      append_byte ( power_pct ).
-      append_byte ( motor_brake ).		// Brake uses a bit more power but gives finer control at low speeds
-      append_byte ( regulation_motor_speed ). // Better Idle than Running, which tries to compensate loads?
-      append_byte ( 0 ). 			// TURN_RATIO
-      append_byte ( power_pct == 0 ? motor_run_state_idle : motor_run_state_running ).
-      append_word ( 0 ).append_word ( 0 ) ),	// Tacho count (unlimited)
-    false );
+  scoped_lock lock ( context_mutex_ );
+
+  if ( --context_users_ == 0 )
+    {
+      stopping_ = true;
+      pthread_join ( event_thread_, NULL );
+
+      libusb_exit ( context_ );
+      context_ = NULL;
+    }
 }
 
-output_state brick::get_motor_state ( motors motor )
+const int kUsbTimeout = 1000; // [ms] For the queries done while enumerating
+
+// Bus number and port numbers, as in "1-2.4"
+string usb_path ( libusb_device *dev )
 {
-  const buffer reply =
-    execute
-    ( assemble
-      ( direct_command_with_response,
-        command_get_output_state,
-        buffer().append_byte ( motor ) ) , true );
+  uint8_t ports[7];
+  const int num_ports = libusb_get_port_numbers ( dev, ports, sizeof ( ports ) );
 
-  const output_state state =
-  {
-    reply[3],                                   // motor
-    reply[4],                                   // power_pct
-    static_cast<motor_modes> ( reply[5] ),      // motor_modes
-    static_cast<regulation_modes> ( reply[6] ), // regulation_modes
-    reply[7],                                   // turn_ratio
-    static_cast<motor_run_states> ( reply[8] ), // motor_run_states
-    le32toh ( *reinterpret_cast<const int32_t*> ( &reply[9] ) ),
-    le32toh ( *reinterpret_cast<const int32_t*> ( &reply[13] ) ),
-    le32toh ( *reinterpret_cast<const int32_t*> ( &reply[17] ) ),
-    le32toh ( *reinterpret_cast<const int32_t*> ( &reply[21] ) ),
-  };
-  return state;
+  ostringstream path;
+  path << static_cast<int> ( libusb_get_bus_number ( dev ) );
+  for ( int i = 0; i < num_ports; i++ )
+    path << ( i == 0 ? '-' : '.' ) << static_cast<int> ( ports[i] );
 
+  return path.str();
 }
 
-versions brick::get_version ( void )
+// Empty if it cannot be read
+string usb_serial ( libusb_device_handle *handle, const libusb_device_descriptor &desc )
 {
-  const buffer reply =
-    execute
-    ( assemble
-      ( system_command_with_response,
-        system_get_firmware_version,
-        buffer() ) , true );
+  unsigned char serial[64];
 
-  const versions v = { reply.at ( 3 ), reply.at ( 4 ), reply.at ( 5 ), reply.at ( 6 ) };
-  return v;
+  if ( desc.iSerialNumber == 0 ||
+       libusb_get_string_descriptor_ascii ( handle, desc.iSerialNumber, serial, sizeof ( serial ) ) < 0 )
+    return "";
+  else
+    return string ( reinterpret_cast<const char*> ( serial ) );
 }
 
-device_info brick::get_device_info ( void )
+// Asks a brick for its name, with synchronous transfers since the brick isn't ours (yet)
+// Empty if its interface is already claimed by someone
+string usb_brick_name ( libusb_device_handle *handle )
 {
-  const buffer reply =
-    execute
-    ( assemble
-      ( system_command_with_response,
-        system_get_device_info,
-        buffer() ) , true );
+  if ( libusb_claim_interface ( handle, kNxtInterface ) != LIBUSB_SUCCESS )
+    return "";
 
-  device_info info;
-  strncpy ( info.brick_name, reinterpret_cast<const char*> ( &reply[3] ), 14 );
-  info.brick_name[14] = '\0';
-  strncpy ( info.bluetooth_address, reinterpret_cast<const char*> ( &reply[18] ), 6 );
-  info.bluetooth_address[6] = '\0';
+  unsigned char query[] = { brick::system_command_with_response, system_get_device_info };
+  unsigned char reply[kMaxTelegramSize];
+  int           transferred;
+  string        name;
 
-  return info;
+  if ( libusb_bulk_transfer ( handle, kOutEndpoint, query, sizeof ( query ), &transferred, kUsbTimeout ) == LIBUSB_SUCCESS &&
+       libusb_bulk_transfer ( handle, kInEndpoint, reply, sizeof ( reply ), &transferred, kUsbTimeout ) == LIBUSB_SUCCESS &&
+       transferred >= 18 && reply[2] == 0 )
+    name = string ( reinterpret_cast<const char*> ( &reply[3] ), strnlen ( reinterpret_cast<const char*> ( &reply[3] ), 15 ) );
+
+  libusb_release_interface ( handle, kNxtInterface );
+
+  return name;
 }
 
-uint16_t brick::get_battery_level ( void )
+bool is_nxt ( libusb_device *dev, libusb_device_descriptor &desc )
 {
-  const buffer reply =
-    execute ( assemble ( direct_command_with_response,
-                         command_get_battery_level,
-                         buffer() ),
-              true );
+  return libusb_get_device_descriptor ( dev, &desc ) == LIBUSB_SUCCESS &&
+         desc.idVendor  == VENDOR_LEGO &&
+         desc.idProduct == PRODUCT_NXT;
+}
 
-  union
-    { const unsigned char * bytes;
-      const uint16_t      * level;
-    } aux;
+vector<usb_brick> USB_transport::enumerate ( void )
+{
+  acquire_context();
+
+  vector<usb_brick> bricks;
+  libusb_device   **devs;
+
+  const ssize_t num_devs = libusb_get_device_list ( context_, &devs );
+
+  for ( ssize_t i = 0; i < num_devs; i++ )
+    {
+      libusb_device_descriptor desc;
+      if ( ! is_nxt ( devs[i], desc ) )
+        continue;
+
+      usb_brick info;
+      info.path = usb_path ( devs[i] );
+
+      libusb_device_handle *handle;
+      if ( libusb_open ( devs[i], &handle ) == LIBUSB_SUCCESS )
+        {
+          info.serial = usb_serial ( handle, desc );
+          info.name   = usb_brick_name ( handle );
+          libusb_close ( handle );
+        }
 
-  aux.bytes = &reply[3];
-  return le16toh ( *aux.level );
+      bricks.push_back ( info );
+    }
+
+  if ( num_devs >= 0 )
+    libusb_free_device_list ( devs, 1 );
+
+  release_context();
+
+  return bricks;
 }
 
-void brick::msg_rate_check ( void )
+libusb_device_handle * USB_transport::open ( const string &which )
 {
-  struct timeval start, now;
-  int calls=0;
+  if ( which.empty() )
+    return libusb_open_device_with_vid_pid ( context_, VENDOR_LEGO, PRODUCT_NXT );
+
+  libusb_device       **devs;
+  libusb_device_handle *found = NULL;
+
+  const ssize_t num_devs = libusb_get_device_list ( context_, &devs );
+  if ( num_devs < 0 )
+    usb_check ( num_devs );
+
+  // Serial numbers and paths first: these need no talking to bricks that may belong to others
+  for ( int pass = 0; pass < 2 && found == NULL; pass++ )
+    for ( ssize_t i = 0; i < num_devs && found == NULL; i++ )
+      {
+        libusb_device_descriptor desc;
+        if ( ! is_nxt ( devs[i], desc ) )
+          continue;
+
+        libusb_device_handle *handle;
+        if ( libusb_open ( devs[i], &handle ) != LIBUSB_SUCCESS )
+          continue;
+
+        const bool matches =
+          pass == 0 ?
+          which == usb_serial ( handle, desc ) || which == usb_path ( devs[i] ) :
+          which == usb_brick_name ( handle );
+
+        if ( matches )
+          found = handle;
+        else
+          libusb_close ( handle );
+      }
+
+  libusb_free_device_list ( devs, 1 );
+
+  return found;
+}
 
-  assert ( gettimeofday ( &start, NULL ) == 0 );
+USB_transport::USB_transport ( const string &which, bool fast_attach )
+    : handle_ ( NULL ),
+    timeout_ms_ ( 0 ),
+    attached_ ( true ),
+    arrived_ ( false ),
+    reattach_ns_ ( 0 ),
+    hotplug_ ( false )
+{
+  acquire_context();
 
-  do
+  try
     {
-      execute ( prepare_play_tone ( 440, 0 ), true );
-      calls++;
+      handle_ = open ( which );
+      if ( handle_ == NULL )
+        throw nxt_error ( "USB_transport: brick not found: " + ( which.empty() ? string ( "any" ) : which ) );
+
+      int config;
+      if ( ! fast_attach || libusb_get_configuration ( handle_, &config ) != LIBUSB_SUCCESS || config != kNxtConfig )
+        usb_check ( libusb_set_configuration ( handle_, kNxtConfig ) );
+
+      usb_check ( libusb_claim_interface ( handle_, kNxtInterface ) );
 
-      assert ( gettimeofday ( &now, NULL ) == 0 );
+      if ( ! fast_attach )
+        usb_check ( libusb_reset_device ( handle_ ) );
+      else
+        {
+          // Replies that a previous user left unread would be taken for ours
+          unsigned char stale[kMaxTelegramSize];
+          int           transferred;
+
+          for ( int i = 0; i < kMaxDrained; i++ )
+            if ( libusb_bulk_transfer ( handle_, kInEndpoint, stale, sizeof ( stale ), &transferred, kDrainTimeout ) != LIBUSB_SUCCESS )
+              break;
+        }
+
+      libusb_device_descriptor desc;
+      libusb_device *dev = libusb_get_device ( handle_ );
+      libusb_get_device_descriptor ( dev, &desc );
+
+      identity_ = usb_serial ( handle_, desc );
+      if ( identity_.empty() )
+        identity_ = usb_path ( dev );
+    }
+  catch ( ... )
+    {
+      if ( handle_ != NULL )
+        libusb_close ( handle_ );
+      release_context();
+      throw;
     }
-  while ( ( double ) start.tv_sec + ( double ) start.tv_usec/1000000.0 -
-          ( double ) now.tv_sec - ( double ) now.tv_usec/1000000.0 > -10.0 );
 
-  printf ( "%d calls in 10s (%dms per call)\n", calls, 10000 / calls );
+  pthread_mutex_init ( &listener_mutex_, NULL );
+  pthread_mutex_init ( &inflight_mutex_, NULL );
+  pthread_cond_init ( &inflight_cond_, NULL );
+
+  inflight_.reserve ( 64 );
+  idle_.reserve ( 64 );
+
+  hotplug_ =
+    libusb_has_capability ( LIBUSB_CAP_HAS_HOTPLUG ) &&
+    libusb_hotplug_register_callback
+    ( context_,
+      static_cast<libusb_hotplug_event> ( LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT ),
+      LIBUSB_HOTPLUG_NO_FLAGS, VENDOR_LEGO, PRODUCT_NXT, LIBUSB_HOTPLUG_MATCH_ANY,
+      on_hotplug, this, &hotplug_handle_ ) == LIBUSB_SUCCESS;
+
+  scoped_lock lock ( registry_mutex_ );
+  registry_.push_back ( this );
 }
 
-buffer brick::assemble ( telegram_types teltype,
-                         uint8_t        command,
-                         const buffer & payload )
+USB_transport::~USB_transport ( void )
 {
-  return
-    buffer ().
-    append_byte ( teltype ).
-    append_byte ( command ).
-    append ( payload );
+  if ( hotplug_ )
+    libusb_hotplug_deregister_callback ( context_, hotplug_handle_ );
+
+  {
+    scoped_lock lock ( registry_mutex_ ); // Waits for a reattach in progress
+    registry_.erase ( std::find ( registry_.begin(), registry_.end(), this ) );
+  }
+
+  // Transfers still in flight (replies that will never come) must be reaped before closing
+  {
+    scoped_lock lock ( inflight_mutex_ );
+
+    attached_ = false; // Nor is any other read armed, e.g. to drain a timed out one
+
+    for ( size_t i = 0; i < inflight_.size(); i++ )
+      libusb_cancel_transfer ( inflight_[i]->transfer );
+
+    while ( ! inflight_.empty() )
+      pthread_cond_wait ( &inflight_cond_, &inflight_mutex_ );
+  }
+
+  for ( size_t i = 0; i < idle_.size(); i++ )
+    {
+      libusb_free_transfer ( idle_[i]->transfer );
+      delete idle_[i];
+    }
+
+  pthread_cond_destroy ( &inflight_cond_ );
+  pthread_mutex_destroy ( &inflight_mutex_ );
+  pthread_mutex_destroy ( &listener_mutex_ );
+
+  //    usb_check(libusb_release_interface(handle_, kNxtInterface));
+  // Fails, why?
+
+  libusb_close ( handle_ );
+
+  release_context();
 }
 
+void USB_transport::write ( const telegram &buf )
+{
+  int transferred;
+
+  if ( ! attached_ )
+    throw nxt_error ( "USB_transport: brick detached" );
+
+  // buf.to_buffer().dump ( "write" );
+
+  usb_check ( count ( libusb_bulk_transfer
+                      ( handle_, kOutEndpoint,
+                        const_cast<unsigned char*> ( buf.data() ), buf.size(),
+                        &transferred, timeout_ms_ ) ) );
+  // printf ( "T:%d\n", transferred );
+
+  stats_.telegrams_out.add();
+  stats_.bytes_out.add ( transferred );
+}
+
+void USB_transport::read ( telegram &reply )
+{
+  int transferred;
+
+  if ( ! attached_ )
+    throw nxt_error ( "USB_transport: brick detached" );
+
+  reply.resize ( kMaxTelegramSize );
+
+  usb_check ( count ( libusb_bulk_transfer
+                      ( handle_, kInEndpoint,
+                        reply.data(), kMaxTelegramSize,
+                        &transferred, timeout_ms_ ) ) );
+  // printf ( "%2x %2x %2x (%d read)\n", reply[0], reply[1], reply[2], transferred );
+
+  reply.resize ( transferred );
+
+  stats_.telegrams_in.add();
+  stats_.bytes_in.add ( transferred );
+}
+
+void USB_transport::set_listener ( transport_listener *listener )
+{
+  scoped_lock lock ( listener_mutex_ );
+  listener_ = listener;
+}
+
+void USB_transport::set_timeout ( int64_t timeout_ns )
+{
+  timeout_ms_ = timeout_ns > 0 ? static_cast<unsigned int> ( ( timeout_ns + 999999 ) / 1000000 ) : 0;
+}
+
+void USB_transport::post ( const telegram &buf, bool expect_reply )
+{
+  // The read is armed first so the reply never waits for us
+  if ( expect_reply )
+    submit ( kInEndpoint, telegram() );
+
+  submit ( kOutEndpoint, buf );
+}
+
+void USB_transport::submit ( unsigned char endpoint, const telegram &buf, bool drain )
+{
+  int err;
+
+  {
+    scoped_lock lock ( inflight_mutex_ );
+
+    if ( ! attached_ )
+      throw nxt_error ( "USB_transport: brick detached" );
+
+    transfer_slot *slot;
+
+    if ( ! idle_.empty() )
+      {
+        slot = idle_.back();
+        idle_.pop_back();
+      }
+    else
+      {
+        slot           = new transfer_slot;
+        slot->owner    = this;
+        slot->transfer = libusb_alloc_transfer ( 0 );
+        if ( slot->transfer == NULL )
+          {
+            delete slot;
+            usb_check ( LIBUSB_ERROR_NO_MEM );
+          }
+      }
+
+    if ( endpoint == kInEndpoint )
+      slot->data.resize ( kMaxTelegramSize );
+    else
+      slot->data = buf;
+
+    slot->drain = drain;
+
+    libusb_fill_bulk_transfer ( slot->transfer, handle_, endpoint,
+                                slot->data.data(), slot->data.size(),
+                                on_transfer, slot, timeout_ms_ );
+
+    err = count ( libusb_submit_transfer ( slot->transfer ) );
+    if ( err == LIBUSB_SUCCESS )
+      inflight_.push_back ( slot );
+    else
+      idle_.push_back ( slot );
+  }
+
+  if ( err == LIBUSB_ERROR_NO_DEVICE )
+    detach ( "brick detached" );
+
+  usb_check ( err );
+}
+
+int USB_transport::count ( int usb_error )
+{
+  if ( usb_error == LIBUSB_ERROR_TIMEOUT )
+    stats_.timeouts.add();
+  else if ( usb_error != LIBUSB_SUCCESS )
+    stats_.errors.add();
+
+  return usb_error;
+}
+
+void USB_transport::completed ( transfer_slot *slot )
+{
+  const libusb_transfer_status status = slot->transfer->status;
+  const bool                   in     = slot->transfer->endpoint == kInEndpoint;
+
+  // The brick still sends the reply of a timed out read: unless some read takes it, every later
+  //   reply would land in the read armed for the one before. Once is enough; past that, replies
+  //   are told apart by the brick (see reply_future::matches).
+  const bool rearm = in && status == LIBUSB_TRANSFER_TIMED_OUT && ! slot->drain;
+
+  if ( status == LIBUSB_TRANSFER_COMPLETED )
+    {
+      ( in ? stats_.telegrams_in : stats_.telegrams_out ).add();
+      ( in ? stats_.bytes_in : stats_.bytes_out ).add ( slot->transfer->actual_length );
+    }
+  else if ( status == LIBUSB_TRANSFER_TIMED_OUT )
+    stats_.timeouts.add();
+  else if ( status != LIBUSB_TRANSFER_CANCELLED )
+    stats_.errors.add();
+
+  if ( status == LIBUSB_TRANSFER_NO_DEVICE )
+    detach ( "brick detached" );
+  else if ( status != LIBUSB_TRANSFER_CANCELLED && status != LIBUSB_TRANSFER_TIMED_OUT ) // Else closing, or left to the brick
+    {
+      scoped_lock lock ( listener_mutex_ );
+
+      if ( listener_ == NULL )
+        ;
+      else if ( status != LIBUSB_TRANSFER_COMPLETED )
+        listener_->on_error ( string ( "USB error: " ) + usbxfer_to_str ( status ) );
+      else if ( slot->transfer->endpoint == kInEndpoint )
+        {
+          // Delivered straight from the transfer buffer
+          slot->data.resize ( slot->transfer->actual_length );
+          listener_->on_read ( slot->data );
+        }
+    }
+
+  {
+    scoped_lock lock ( inflight_mutex_ );
+
+    inflight_.erase ( std::find ( inflight_.begin(), inflight_.end(), slot ) );
+    idle_.push_back ( slot );
+
+    pthread_cond_broadcast ( &inflight_cond_ );
+  }
+
+  if ( rearm )
+    try
+      {
+        submit ( kInEndpoint, telegram(), true );
+      }
+    catch ( nxt_error & )
+      {
+        ; // Detached meanwhile: there is no reply to drain
+      }
+}
+
+void USB_transport::detach ( const string &why )
+{
+  {
+    scoped_lock lock ( inflight_mutex_ );
+
+    if ( ! attached_ )
+      return;
+
+    attached_    = false;
+    reattach_ns_ = monotonic_ns();
+
+    for ( size_t i = 0; i < inflight_.size(); i++ )
+      libusb_cancel_transfer ( inflight_[i]->transfer );
+  }
+
+  scoped_lock lock ( listener_mutex_ );
+
+  if ( listener_ != NULL )
+    listener_->on_error ( "USB_transport: " + why );
+}
+
+// Synchronous USB calls are fine here, in the event thread but out of libusb callbacks
+void USB_transport::reattach ( void )
+{
+  {
+    scoped_lock lock ( inflight_mutex_ );
+
+    // Transfers cancelled on detaching are reaped by this same thread, so they're waited for by not going on
+    if ( attached_ || ! inflight_.empty() )
+      return;
+  }
+
+  reattach_ns_ = monotonic_ns();
+
+  libusb_device_handle *handle = open ( identity_ );
+  if ( handle == NULL )
+    return;
+
+  if ( libusb_set_configuration ( handle, kNxtConfig ) != LIBUSB_SUCCESS ||
+       libusb_claim_interface ( handle, kNxtInterface ) != LIBUSB_SUCCESS )
+    {
+      libusb_close ( handle ); // Not ready yet (e.g. device permissions); tried again later
+      return;
+    }
+
+  {
+    scoped_lock lock ( inflight_mutex_ );
+
+    libusb_close ( handle_ );
+    handle_   = handle;
+    arrived_  = false;
+    attached_ = true;
+  }
+
+  stats_.reconnects.add();
+}
+
+int LIBUSB_CALL USB_transport::on_hotplug ( libusb_context *, libusb_device *device,
+    libusb_hotplug_event event, void *self )
+{
+  USB_transport &t = *static_cast<USB_transport*> ( self );
+
+  // Both run in the event thread, as reattach does, so handle_ is stable here
+  if ( event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT )
+    {
+      if ( t.attached_ && libusb_get_device ( t.handle_ ) == device )
+        t.detach ( "brick detached" );
+    }
+  else if ( ! t.attached_ )
+    t.arrived_ = true; // Maybe ours: reattach tells, out of this callback
+
+  return 0; // Stay registered
+}
+
+void LIBUSB_CALL USB_transport::on_transfer ( libusb_transfer *transfer )
+{
+  transfer_slot *slot = static_cast<transfer_slot*> ( transfer->user_data );
+  slot->owner->completed ( slot );
+}
+
+void *USB_transport::event_loop ( void * )
+{
+  // Completions wake this at once whichever brick they belong to; on_transfer dispatches them
+  while ( ! stopping_ )
+    {
+      struct timeval tv = { 0, 100000 }; // Bounds the time to notice stopping_
+      libusb_handle_events_timeout ( context_, &tv );
+
+      // Detached bricks are looked for as soon as one is enumerated, or every so often without hotplug
+      scoped_lock lock ( registry_mutex_ );
+
+      const int64_t now = monotonic_ns();
+
+      for ( size_t i = 0; i < registry_.size(); i++ )
+        {
+          USB_transport &t = *registry_[i];
+
+          if ( ! t.attached_ && ( t.arrived_ || ( ! t.hotplug_ && now - t.reattach_ns_ > kReattachPoll ) ) )
+            t.reattach();
+        }
+    }
+
+  return NULL;
+}
+
+play_tone_telegram::play_tone_telegram ( uint16_t tone_Hz, uint16_t duration_ms )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_play_tone ).
+  append_word ( tone_Hz ).
+  append_word ( duration_ms );
+}
+
+play_tone_telegram & play_tone_telegram::set_tone ( uint16_t tone_Hz )
+{
+  put_word ( 2, tone_Hz );
+  return *this;
+}
+
+play_tone_telegram & play_tone_telegram::set_duration ( uint16_t duration_ms )
+{
+  put_word ( 4, duration_ms );
+  return *this;
+}
+
+set_output_state_telegram::set_output_state_telegram (
+  motors           motor       ,
+  int8_t           power_pct   ,
+  motor_modes      mode        ,
+  regulation_modes regulation  ,
+  int8_t           turn_ratio  ,
+  motor_run_states state       ,
+  uint32_t         tacho_limit )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_set_output_state ).
+  append_byte ( motor ).
+  append_byte ( power_pct ).
+  append_byte ( mode ).
+  append_byte ( regulation ).
+  append_byte ( turn_ratio ).
+  append_byte ( state ).
+  append_long ( tacho_limit );
+}
+
+set_output_state_telegram & set_output_state_telegram::set_motor ( motors motor )
+{
+  ( *this ) [2] = motor;
+  return *this;
+}
+
+set_output_state_telegram & set_output_state_telegram::set_power ( int8_t power_pct )
+{
+  ( *this ) [3] = power_pct;
+  return *this;
+}
+
+set_output_state_telegram & set_output_state_telegram::set_mode ( motor_modes mode )
+{
+  ( *this ) [4] = mode;
+  return *this;
+}
+
+set_output_state_telegram & set_output_state_telegram::set_regulation ( regulation_modes regulation )
+{
+  ( *this ) [5] = regulation;
+  return *this;
+}
+
+set_output_state_telegram & set_output_state_telegram::set_turn_ratio ( int8_t turn_ratio )
+{
+  ( *this ) [6] = turn_ratio;
+  return *this;
+}
+
+set_output_state_telegram & set_output_state_telegram::set_run_state ( motor_run_states state )
+{
+  ( *this ) [7] = state;
+  return *this;
+}
+
+set_output_state_telegram & set_output_state_telegram::set_tacho_limit ( uint32_t tacho_limit )
+{
+  put_long ( 8, tacho_limit );
+  return *this;
+}
+
+get_output_state_telegram::get_output_state_telegram ( motors motor )
+{
+  append_byte ( brick::direct_command_with_response ).
+  append_byte ( command_get_output_state ).
+  append_byte ( motor );
+}
+
+get_output_state_telegram & get_output_state_telegram::set_motor ( motors motor )
+{
+  ( *this ) [2] = motor;
+  return *this;
+}
+
+reset_motor_position_telegram::reset_motor_position_telegram ( motors motor, bool relative_to_last_position )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_reset_motor_position ).
+  append_byte ( motor ).
+  append_byte ( relative_to_last_position );
+}
+
+get_battery_level_telegram::get_battery_level_telegram ( void )
+{
+  append_byte ( brick::direct_command_with_response ).
+  append_byte ( command_get_battery_level );
+}
+
+stop_sound_playback_telegram::stop_sound_playback_telegram ( void )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_stop_sound_playback );
+}
+
+keep_alive_telegram::keep_alive_telegram ( void )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_keep_alive );
+}
+
+set_input_mode_telegram::set_input_mode_telegram ( sensors port, sensor_types type, sensor_modes mode )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_set_input_mode ).
+  append_byte ( port ).
+  append_byte ( type ).
+  append_byte ( mode );
+}
+
+get_input_values_telegram::get_input_values_telegram ( sensors port )
+{
+  append_byte ( brick::direct_command_with_response ).
+  append_byte ( command_get_input_values ).
+  append_byte ( port );
+}
+
+get_input_values_telegram & get_input_values_telegram::set_port ( sensors port )
+{
+  ( *this ) [2] = port;
+  return *this;
+}
+
+reset_input_scaled_value_telegram::reset_input_scaled_value_telegram ( sensors port )
+{
+  append_byte ( brick::direct_command_without_response ).
+  append_byte ( command_reset_input_scaled ).
+  append_byte ( port );
+}
+
+ls_write_telegram::ls_write_telegram ( sensors port, const uint8_t *tx, uint8_t tx_len, uint8_t rx_len )
+{
+  if ( tx_len > kMaxLsData || rx_len > kMaxLsData )
+    throw nxt_error ( "LS transaction too long" );
+
+  append_byte ( brick::direct_command_with_response ).
+  append_byte ( command_ls_write ).
+  append_byte ( port ).
+  append_byte ( tx_len ).
+  append_byte ( rx_len );
+
+  for ( int i = 0; i < tx_len; i++ )
+    append_byte ( tx[i] );
+}
+
+ls_get_status_telegram::ls_get_status_telegram ( sensors port )
+{
+  append_byte ( brick::direct_command_with_response ).
+  append_byte ( command_ls_get_status ).
+  append_byte ( port );
+}
+
+ls_read_telegram::ls_read_telegram ( sensors port )
+{
+  append_byte ( brick::direct_command_with_response ).
+  append_byte ( command_ls_read ).
+  append_byte ( port );
+}
+
+output_state NXT::decode_output_state ( const telegram &reply )
+{
+  const output_state state =
+  {
+    reply[3],                                          // motor
+    static_cast<int8_t> ( reply[4] ),                  // power_pct
+    static_cast<motor_modes> ( reply[5] ),             // motor_modes
+    static_cast<regulation_modes> ( reply[6] ),        // regulation_modes
+    static_cast<int8_t> ( reply[7] ),                  // turn_ratio
+    static_cast<motor_run_states> ( reply[8] ),        // motor_run_states
+    static_cast<int32_t> ( reply.long_at ( 9 ) ),      // tacho_limit
+    static_cast<int32_t> ( reply.long_at ( 13 ) ),     // tacho_count
+    static_cast<int32_t> ( reply.long_at ( 17 ) ),     // block_tacho_count
+    static_cast<int32_t> ( reply.long_at ( 21 ) ),     // rotation_count
+  };
+  return state;
+}
+
+input_values NXT::decode_input_values ( const telegram &reply )
+{
+  const input_values values =
+  {
+    reply[3],                                          // port
+    reply[4] != 0,                                     // valid
+    reply[5] != 0,                                     // is_calibrated
+    static_cast<sensor_types> ( reply[6] ),            // type
+    static_cast<sensor_modes> ( reply[7] ),            // mode
+    reply.word_at ( 8 ),                               // raw
+    reply.word_at ( 10 ),                              // normalized
+    static_cast<int16_t> ( reply.word_at ( 12 ) ),     // scaled
+    static_cast<int16_t> ( reply.word_at ( 14 ) ),     // calibrated
+  };
+  return values;
+}
+
+uint16_t NXT::decode_battery_level ( const telegram &reply )
+{
+  return reply.word_at ( 3 );
+}
+
+uint8_t NXT::decode_ls_bytes_ready ( const telegram &reply )
+{
+  return reply[3];
+}
+
+uint8_t NXT::decode_ls_read ( const telegram &reply, uint8_t *rx )
+{
+  const uint8_t len = std::min ( reply[3], kMaxLsData );
+
+  for ( int i = 0; i < len; i++ )
+    rx[i] = reply[4 + i];
+
+  return len;
+}
+
+brick::brick ( const string &which, bool fast_attach )
+    : link_ ( new USB_transport ( which, fast_attach ) ), owns_link_ ( true ), timeout_ns_ ( 0 ), retries_ ( 0 ),
+    num_pending_ ( 0 ), peak_pending_ ( 0 )
+{
+  pthread_mutex_init ( &send_mutex_, NULL );
+  pthread_mutex_init ( &pending_mutex_, NULL );
+  init_monotonic_cond ( &pending_freed_ );
+
+  link_->set_listener ( this );
+}
+
+brick::brick ( transport &link )
+    : link_ ( &link ), owns_link_ ( false ), timeout_ns_ ( 0 ), retries_ ( 0 ),
+    num_pending_ ( 0 ), peak_pending_ ( 0 )
+{
+  pthread_mutex_init ( &send_mutex_, NULL );
+  pthread_mutex_init ( &pending_mutex_, NULL );
+  init_monotonic_cond ( &pending_freed_ );
+
+  link_->set_listener ( this );
+}
+
+brick::~brick ( void )
+{
+  link_->set_listener ( NULL );
+
+  on_error ( "Brick closed" );
+
+  if ( owns_link_ )
+    delete link_;
+
+  pthread_cond_destroy ( &pending_freed_ );
+  pthread_mutex_destroy ( &pending_mutex_ );
+  pthread_mutex_destroy ( &send_mutex_ );
+}
+
+buffer brick::execute ( const buffer &command, bool with_feedback )
+{
+  assert ( command.size() >= 2 );
+
+  if ( with_feedback )
+    return query ( telegram ( command ) ).get().to_buffer();
+  else
+    {
+      execute ( telegram ( command ) );
+      return buffer();
+    }
+}
+
+reply_future brick::execute_async ( const buffer &command, reply_callback *callback )
+{
+  return execute_async ( telegram ( command ), callback );
+}
+
+void brick::execute ( const telegram &command )
+{
+  assert ( command.size() >= 2 );
+
+  scoped_lock lock ( send_mutex_ );
+  send ( command, false );
+
+  stats_of ( command[1] ).sent.add();
+}
+
+void brick::execute ( const telegram &command, telegram &reply )
+{
+  reply = query ( command ).get();
+}
+
+void brick::set_timeout ( int64_t timeout_ns, int retries )
+{
+  timeout_ns_ = std::max<int64_t> ( timeout_ns, 0 );
+  retries_    = std::max ( retries, 0 );
+
+  link_->set_timeout ( timeout_ns_ );
+}
+
+reply_future brick::execute_async ( const telegram &command, reply_callback *callback )
+{
+  assert ( command.size() >= 2 );
+
+  reply_future future ( command, callback );
+  reply_future expired[kMaxInFlight];
+  int          num_expired;
+
+  scoped_lock lock ( send_mutex_ );
+
+  {
+    scoped_lock lock ( pending_mutex_ );
+
+    num_expired = expire_pending ( monotonic_ns(), expired );
+
+    // Too many in flight: the transport is the bottleneck anyway, so just wait, at most till the oldest expires
+    while ( num_pending_ == kMaxInFlight )
+      if ( timeout_ns_ == 0 )
+        pthread_cond_wait ( &pending_freed_, &pending_mutex_ );
+      else if ( ! timed_wait ( &pending_freed_, &pending_mutex_, sent_ns_[0] + timeout_ns_ ) )
+        num_expired += expire_pending ( monotonic_ns(), expired + num_expired );
+
+    const int64_t now = monotonic_ns();
+
+    if ( timeout_ns_ > 0 )
+      future.set_deadline ( now + timeout_ns_ );
+
+    sent_ns_[num_pending_]   = now;
+    pending_[num_pending_++] = future;
+    peak_pending_            = std::max ( peak_pending_, num_pending_ );
+  }
+
+  for ( int i = 0; i < num_expired; i++ )
+    expired[i].fail ( kTimedOut, true );
+
+  try
+    {
+      send ( command, true );
+    }
+  catch ( ... )
+    {
+      scoped_lock lock ( pending_mutex_ );
+      for ( int i = num_pending_ - 1; i >= 0; i-- )
+        if ( pending_[i].state_ == future.state_ )
+          {
+            remove_pending ( i );
+            break;
+          }
+      throw;
+    }
+
+  stats_of ( command[1] ).sent.add();
+
+  return future;
+}
+
+void brick::send ( const telegram &command, bool with_feedback )
+{
+  if ( with_feedback && ( ! ( command[0] & 0x80 ) ) )
+    link_->post ( command, true );
+  else if ( ( !with_feedback ) && ( command[0] & 0x80 ) )
+    link_->post ( command, false );
+  else
+    {
+      telegram newcomm ( command );
+
+      // Set or reset 0x80 bit (confirmation request)
+      newcomm[0] = ( with_feedback ? command[0] & 0x7F : command[0] | 0x80 );
+
+      link_->post ( newcomm, with_feedback );
+    }
+}
+
+void brick::remove_pending ( int i )
+{
+  for ( ; i < num_pending_ - 1; i++ )
+    {
+      pending_[i] = pending_[i + 1];
+      sent_ns_[i] = sent_ns_[i + 1];
+    }
+
+  pending_[--num_pending_] = reply_future();
+
+  pthread_cond_signal ( &pending_freed_ );
+}
+
+// Requests past their deadline, which are the oldest ones, go into expired
+int brick::expire_pending ( int64_t now_ns, reply_future *expired )
+{
+  int num_expired = 0;
+
+  while ( timeout_ns_ > 0 && num_pending_ > 0 && now_ns - sent_ns_[0] >= timeout_ns_ )
+    {
+      stats_of ( pending_[0].opcode() ).timeouts.add();
+      expired[num_expired++] = pending_[0];
+      remove_pending ( 0 );
+    }
+
+  return num_expired;
+}
+
+reply_future brick::query ( const telegram &command )
+{
+  for ( int attempt = 0; ; attempt++ )
+    {
+      reply_future reply = execute_async ( command );
+
+      try
+        {
+          reply.get();
+          return reply;
+        }
+      catch ( nxt_timeout & )
+        {
+          if ( attempt >= retries_ )
+            throw;
+
+          stats_of ( command[1] ).retries.add();
+        }
+    }
+}
+
+void brick::on_read ( const telegram &reply )
+{
+  reply_future matched;
+  int64_t      sent_ns = 0;
+  reply_future expired[kMaxInFlight];
+  int          num_expired;
+
+  {
+    scoped_lock lock ( pending_mutex_ );
+
+    // A late reply is taken for the next request of its opcode, rather than for one that was given up
+    num_expired = expire_pending ( monotonic_ns(), expired );
+
+    if ( num_pending_ == 0 )
+      return; // Stray reply, nobody waits for it
+
+    if ( reply.size() < 3 || reply[0] != brick::reply )
+      {
+        // Can't tell whose it is; the oldest request is the best guess
+        matched = pending_[0];
+        sent_ns = sent_ns_[0];
+        remove_pending ( 0 );
+      }
+    else
+      {
+        for ( int i = 0; i < num_pending_; i++ )
+          if ( pending_[i].matches ( reply ) )
+            {
+              matched = pending_[i];
+              sent_ns = sent_ns_[i];
+              remove_pending ( i );
+              break;
+            }
+      }
+  }
+
+  // Completion happens outside the lock, so waking waiters doesn't hold up matching
+  for ( int i = 0; i < num_expired; i++ )
+    expired[i].fail ( kTimedOut, true );
+
+  if ( ! matched.valid() )
+    return; // Stray reply for an opcode nobody waits for
+
+  const int64_t arrived_ns = monotonic_ns();
+  matched.stamp ( sent_ns, arrived_ns );
+
+  opcode_stats &st = stats_of ( matched.opcode() );
+  st.replies.add();
+  st.round_trip.add ( arrived_ns - sent_ns );
+  if ( reply.size() < 3 || reply[0] != brick::reply ||
+       ( reply[2] != 0 && reply[2] != kStatusPendingTransaction ) )
+    st.errors.add();
+
+  if ( reply.size() < 3 )
+    {
+      stringstream s;
+      s << "Reply too short: " << static_cast<int> ( reply.size() ) << " bytes";
+      matched.fail ( s.str () );
+    }
+  else if ( reply[0] != brick::reply )
+    {
+      char s[100];
+      snprintf ( s, 100, "Unexpected telegram: 0x%02x != 0x%02x", reply[0], brick::reply );
+      matched.fail ( s );
+    }
+  else
+    matched.fulfil ( reply );
+}
+
+void brick::on_error ( const string &error )
+{
+  // We can't know which telegram was lost, so every waiter is released
+  reply_future failed[kMaxInFlight];
+  int          num_failed;
+
+  {
+    scoped_lock lock ( pending_mutex_ );
+
+    num_failed = num_pending_;
+    for ( int i = 0; i < num_pending_; i++ )
+      {
+        failed[i]   = pending_[i];
+        pending_[i] = reply_future();
+      }
+    num_pending_ = 0;
+
+    pthread_cond_broadcast ( &pending_freed_ );
+  }
+
+  for ( int i = 0; i < num_failed; i++ )
+    {
+      stats_of ( failed[i].opcode() ).errors.add();
+      failed[i].fail ( error );
+    }
+}
+
+buffer brick::prepare_play_tone ( uint16_t tone_Hz, uint16_t duration_ms )
+{
+  return play_tone_telegram ( tone_Hz, duration_ms ).to_buffer();
+}
+
+buffer brick::prepare_output_state (
+  motors           motor       ,
+  int8_t           power_pct   ,
+  motor_modes      mode        ,
+  regulation_modes regulation  ,
+  int8_t           turn_ratio  ,
+  motor_run_states state       ,
+  uint32_t         tacho_count )
+{
+  return
+    set_output_state_telegram ( motor, power_pct, mode, regulation,
+                                turn_ratio, state, tacho_count ).to_buffer();
+}
+
+buffer brick::prepare_reset_motor_position ( motors motor, bool relative_to_last_position )
+{
+  return reset_motor_position_telegram ( motor, relative_to_last_position ).to_buffer();
+}
+
+buffer brick::prepare_stop_sound_playback ( void )
+{
+  return stop_sound_playback_telegram().to_buffer();
+}
+
+buffer brick::prepare_keep_alive ( void )
+{
+  return keep_alive_telegram().to_buffer();
+}
+
+void brick::play_tone ( uint16_t tone_Hz, uint16_t duration_ms )
+{
+  execute ( play_tone_telegram ( tone_Hz, duration_ms ) );
+}
+
+void brick::set_motor ( motors motor, int8_t power_pct )
+{
+  execute
+  ( set_output_state_telegram
+    ( motor,
+      power_pct,
+      motor_brake,            // Brake uses a bit more power but gives finer control at low speeds
+      regulation_motor_speed, // Better Idle than Running, which tries to compensate loads?
+      0,                      // TURN_RATIO
+      power_pct == 0 ? motor_run_state_idle : motor_run_state_running,
+      0 ) );                  // Tacho count (unlimited)
+}
+
+output_state brick::get_motor_state ( motors motor )
+{
+  const output_state state = decode_output_state ( query ( get_output_state_telegram ( motor ) ).get() );
+
+  check_motor ( state, motor );
+
+  return state;
+}
+
+// Replies are matched by port already (see reply_future::matches); this catches what that lets through
+void brick::check_motor ( const output_state &state, motors motor )
+{
+  if ( state.motor != motor )
+    {
+      char s[100];
+      snprintf ( s, 100, "Reply for motor %d to a query for motor %d", state.motor, motor );
+      throw nxt_error ( s );
+    }
+}
+
+motor_states brick::get_motor_states ( uint8_t mask )
+{
+  motor_states states;
+
+  states.mask = mask & mask_All;
+
+  // The batch is retried whole, so its readings stay near simultaneous
+  for ( int attempt = 0; ; attempt++ )
+    {
+      reply_future replies[kNumMotors];
+
+      const int64_t start = monotonic_ns();
+
+      try
+        {
+          for ( int i = 0; i < kNumMotors; i++ )
+            if ( states.mask & ( 1 << i ) )
+              replies[i] = execute_async ( get_output_state_telegram ( static_cast<motors> ( i ) ) );
+
+          for ( int i = 0; i < kNumMotors; i++ )
+            if ( states.mask & ( 1 << i ) )
+              {
+                states.state[i]     = decode_output_state ( replies[i].get() );
+                states.sample_ns[i] = replies[i].sample_ns();
+
+                check_motor ( states.state[i], static_cast<motors> ( i ) );
+              }
+        }
+      catch ( nxt_timeout & )
+        {
+          if ( attempt >= retries_ )
+            throw;
+
+          stats_of ( command_get_output_state ).retries.add();
+          continue;
+        }
+
+      states.timestamp_ns = start + ( monotonic_ns() - start ) / 2;
+
+      return states;
+    }
+}
+
+void brick::set_input_mode ( sensors port, sensor_types type, sensor_modes mode )
+{
+  query ( set_input_mode_telegram ( port, type, mode ) );
+}
+
+input_values brick::get_input_values ( sensors port )
+{
+  return decode_input_values ( query ( get_input_values_telegram ( port ) ).get() );
+}
+
+void brick::reset_input_scaled_value ( sensors port )
+{
+  execute ( reset_input_scaled_value_telegram ( port ) );
+}
+
+versions brick::get_version ( void )
+{
+  const buffer reply =
+    execute
+    ( assemble
+      ( system_command_with_response,
+        system_get_firmware_version,
+        buffer() ) , true );
+
+  const versions v = { reply.at ( 3 ), reply.at ( 4 ), reply.at ( 5 ), reply.at ( 6 ) };
+  return v;
+}
+
+device_info brick::get_device_info ( void )
+{
+  const buffer reply =
+    execute
+    ( assemble
+      ( system_command_with_response,
+        system_get_device_info,
+        buffer() ) , true );
+
+  device_info info;
+  strncpy ( info.brick_name, reinterpret_cast<const char*> ( &reply[3] ), 14 );
+  info.brick_name[14] = '\0';
+  strncpy ( info.bluetooth_address, reinterpret_cast<const char*> ( &reply[18] ), 6 );
+  info.bluetooth_address[6] = '\0';
+
+  return info;
+}
+
+uint16_t brick::get_battery_level ( void )
+{
+  return decode_battery_level ( query ( get_battery_level_telegram() ).get() );
+}
+
+int64_t NXT::monotonic_ns ( void )
+{
+  struct timespec now;
+
+  if ( clock_gettime ( CLOCK_MONOTONIC, &now ) != 0 )
+    throw runtime_error ( strerror ( errno ) );
+
+  return static_cast<int64_t> ( now.tv_sec ) * 1000000000LL + now.tv_nsec;
+}
+
+sync_drive NXT::sync_drive_for ( int first_pct, int second_pct )
+{
+  sync_drive drive = { 0, 0 };
+
+  // The faster one leads; the other runs at ( 1 - |turn_ratio| / 50 ) of its power
+  const bool   first_leads = abs ( first_pct ) >= abs ( second_pct );
+  const int    lead        = first_leads ? first_pct : second_pct;
+  const int    follow      = first_leads ? second_pct : first_pct;
+
+  if ( lead == 0 )
+    return drive;
+
+  const double ratio = 50.0 * ( 1.0 - static_cast<double> ( follow ) / lead );
+  const int    turn  = static_cast<int> ( floor ( ratio + 0.5 ) );
+
+  drive.power_pct  = static_cast<int8_t> ( max ( -100, min ( 100, lead ) ) );
+  drive.turn_ratio = static_cast<int8_t> ( first_leads ? turn : -turn );
+
+  return drive;
+}
+
+buffer brick::assemble ( telegram_types teltype,
+                         uint8_t        command,
+                         const buffer & payload )
+{
+  return
+    buffer ().
+    append_byte ( teltype ).
+    append_byte ( command ).
+    append ( payload );
+}
+
+ls_transaction::ls_transaction ( void ) : state_ ( idle ), port_ ( S1 ), tx_len_ ( 0 ), rx_len_ ( 0 ), deadline_ns_ ( 0 )
+{
+  ;
+}
+
+void ls_transaction::start ( sensors port, const uint8_t *tx, uint8_t tx_len, uint8_t rx_len, int64_t timeout_ns )
+{
+  if ( tx_len > kMaxLsData || rx_len > kMaxLsData )
+    throw nxt_error ( "LS transaction too long" );
+
+  state_       = writing;
+  port_        = port;
+  tx_len_      = tx_len;
+  rx_len_      = rx_len;
+  deadline_ns_ = monotonic_ns() + timeout_ns;
+  pending_     = reply_future(); // An older reply, if any, is abandoned
+  error_.clear();
+
+  std::copy ( tx, tx + tx_len, tx_ );
+}
+
+bool ls_transaction::step ( brick &b )
+{
+  if ( ! busy() )
+    return state_ != idle;
+
+  if ( pending_.valid() && ! pending_.ready() )
+    {
+      if ( monotonic_ns() > deadline_ns_ )
+        fail ( "LS transaction timed out" );
+      return ! busy();
+    }
+
+  try
+    {
+      switch ( state_ )
+        {
+        case writing:
+          if ( ! pending_.valid() )
+            {
+              pending_ = b.execute_async ( ls_write_telegram ( port_, tx_, tx_len_, rx_len_ ) );
+              break;
+            }
+
+          pending_.get(); // Throws if the write was refused
+
+          if ( rx_len_ == 0 )
+            {
+              state_ = done;
+              break;
+            }
+
+          state_   = polling;
+          pending_ = b.execute_async ( ls_get_status_telegram ( port_ ) );
+          break;
+
+        case polling:
+          if ( pending_.status() != kStatusPendingTransaction &&
+               decode_ls_bytes_ready ( pending_.get() ) >= rx_len_ )
+            {
+              state_   = reading;
+              pending_ = b.execute_async ( ls_read_telegram ( port_ ) );
+            }
+          else if ( monotonic_ns() > deadline_ns_ )
+            fail ( "LS transaction timed out" );
+          else
+            pending_ = b.execute_async ( ls_get_status_telegram ( port_ ) );
+          break;
+
+        case reading:
+          rx_len_  = decode_ls_read ( pending_.get(), rx_ );
+          state_   = done;
+          pending_ = reply_future();
+          break;
+
+        default:
+          break;
+        }
+    }
+  catch ( nxt_error &e )
+    {
+      fail ( e.what() );
+    }
+
+  return ! busy();
+}
+
+void ls_transaction::fail ( const string &error )
+{
+  state_   = failed;
+  error_   = error;
+  pending_ = reply_future();
+}
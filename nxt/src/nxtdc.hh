@@ -1,5 +1,11 @@
+#ifndef _nxtdc_
+#define _nxtdc_
+
+#include <algorithm>
 #include <libusb.h>
+#include <pthread.h>
 #include <stdexcept>
+#include "stats.hh"
 #include <vector>
 
 namespace NXT
@@ -20,32 +26,290 @@ namespace NXT
       void dump ( const string & header ) const; // Debug to stdout
     };
 
-  class transport
+  class nxt_error : public runtime_error
+    {
+    public :
+      nxt_error ( const char *s )    : runtime_error ( s ) {};
+      nxt_error ( const string & s ) : runtime_error ( s ) {};
+    };
+
+  // A reply that didn't arrive by its deadline (see brick::set_timeout); the brick may still be there
+  class nxt_timeout : public nxt_error
+    {
+    public :
+      nxt_timeout ( const string & s ) : nxt_error ( s ) {};
+    };
+
+  const uint8_t kMaxTelegramSize = 64; // Per NXT spec.
+
+  enum direct_commands
+  {
+    command_play_tone            = 0x03,
+    command_set_output_state     = 0x04,
+    command_set_input_mode       = 0x05,
+    command_get_output_state     = 0x06,
+    command_get_input_values     = 0x07,
+    command_reset_input_scaled   = 0x08,
+    command_reset_motor_position = 0x0A,
+    command_get_battery_level    = 0x0B,
+    command_stop_sound_playback  = 0x0C,
+    command_keep_alive           = 0x0D,
+    command_ls_get_status        = 0x0E,
+    command_ls_write             = 0x0F,
+    command_ls_read              = 0x10
+  };
+
+  enum system_commands
+  {
+    system_get_firmware_version  = 0x88,
+    system_get_device_info       = 0x9B
+  };
+
+  // Reply statuses that aren't plain errors
+  const uint8_t kStatusPendingTransaction = 0x20; // I2C exchange still in progress
+
+  // Fixed-capacity telegram, for the allocation-free paths
+  // Multi-byte fields are little-endian and accessed bytewise, so there are no alignment concerns
+  class telegram
+    {
+    public:
+      telegram ( void ) : size_ ( 0 ) {};
+      explicit telegram ( const buffer &buf );
+
+      buffer to_buffer ( void ) const;
+
+      uint8_t size ( void ) const { return size_; };
+      void    resize ( uint8_t size );
+      void    clear ( void ) { size_ = 0; };
+
+      uint8_t       * data ( void )       { return data_; };
+      const uint8_t * data ( void ) const { return data_; };
+
+      uint8_t & operator[] ( uint8_t pos )       { return data_[pos]; };
+      uint8_t   operator[] ( uint8_t pos ) const { return data_[pos]; };
+
+      bool operator== ( const telegram &other ) const;
+      bool operator!= ( const telegram &other ) const { return ! ( *this == other ); };
+
+      telegram & append_byte ( uint8_t byte );
+      telegram & append_word ( uint16_t word );
+      telegram & append_long ( uint32_t value );
+      // return self to chain calls
+
+      void put_word ( uint8_t pos, uint16_t word );
+      void put_long ( uint8_t pos, uint32_t value );
+
+      uint16_t word_at ( uint8_t pos ) const;
+      uint32_t long_at ( uint8_t pos ) const;
+
+    private:
+      uint8_t size_;
+      uint8_t data_[kMaxTelegramSize];
+    };
+
+  // Receives replies for telegrams posted through execute_async
+  // Called from the transport event thread (or from the sending one, with blocking transports):
+  //   keep it short and do not execute on the same brick from here.
+  class reply_callback
     {
     public:
-      virtual void write ( const buffer &buf ) = 0;
-      virtual buffer read ( void ) = 0;
+      virtual ~reply_callback ( void ) {};
+      virtual void on_reply ( const telegram &reply ) = 0;
+      virtual void on_error ( const nxt_error &error ) = 0;
     };
 
-  class USB_transport : public transport
+  // Handle to the reply of an in-flight telegram.
+  // Copies share the same reply; it can be waited upon from any thread.
+  // Released handles are recycled, so they cost no allocation in steady operation.
+  class reply_future
     {
     public:
-      USB_transport ( void );
-      ~USB_transport ( void );
-      virtual void write ( const buffer &buf );
-      virtual buffer read ( void );
+      reply_future ( void ); // Invalid until returned by brick::execute_async
+      reply_future ( const reply_future &other );
+      reply_future & operator= ( const reply_future &other );
+      ~reply_future ( void );
+
+      bool valid ( void ) const;
+      bool ready ( void ) const; // True once the reply or an error has arrived
+
+      // Once ready, the NXT status byte of a failed reply (see NXT docs), or 0
+      // Lets callers tell expected statuses (e.g. a pending I2C transaction) from real errors
+      uint8_t status ( void ) const;
+
+      // Blocks until the reply arrives, or its deadline passes. Errors are thrown as nxt_error,
+      //   a missed deadline as nxt_timeout
+      // The reply stays valid as long as this future (or a copy) exists
+      const telegram & get ( void ) const;
+
+      // Once ready, the midpoint of the round trip (see monotonic_ns): the best guess of when
+      //   the brick answered, e.g. sampled a motor
+      int64_t sample_ns ( void ) const;
+
     private:
-      libusb_context *context_;
-      libusb_device_handle *handle_;
+      friend class brick;
+
+      struct shared_state;
+      shared_state *state_;
+
+      reply_future ( const telegram &command, reply_callback *callback );
+
+      // Retired states are kept for reuse; the pool only grows up to the peak of live futures
+      static pthread_mutex_t        pool_mutex_;
+      static vector<shared_state*>  pool_;
+
+      static shared_state * acquire ( void );
+      static void           release ( shared_state *state );
 
-      void usb_check ( int usb_error );
+      uint8_t opcode ( void ) const;
+      bool    matches ( const telegram &reply ) const; // Same opcode, and same port if the reply tells
+      void    set_deadline ( int64_t deadline_ns ); // 0 for none
+      void    stamp ( int64_t sent_ns, int64_t arrived_ns );
+      void    fulfil ( const telegram &reply );
+      void    fail ( const string &error, bool timed_out = false );
     };
 
-  class nxt_error : public runtime_error
+  // Whoever consumes the replies of a transport (i.e. the brick)
+  class transport_listener
     {
-    public :
-      nxt_error ( const char *s )    : runtime_error ( s ) {};
-      nxt_error ( const string & s ) : runtime_error ( s ) {};
+    public:
+      virtual ~transport_listener ( void ) {};
+      virtual void on_read ( const telegram &reply ) = 0;
+      virtual void on_error ( const string &error ) = 0;
+    };
+
+  // Traffic through a transport, kept by each kind of transport as it can
+  typedef struct
+    {
+      counter telegrams_out;
+      counter telegrams_in;
+      counter bytes_out;
+      counter bytes_in;
+      counter errors;        // Failed reads and writes, timeouts aside
+      counter timeouts;
+      counter reconnects;    // After the device went away and came back
+    } transport_stats;
+
+  class transport
+    {
+    public:
+      transport ( void ) : listener_ ( NULL ) {};
+      virtual ~transport ( void ) {};
+
+      virtual void write ( const telegram &buf ) = 0;
+      virtual void read ( telegram &reply ) = 0;
+
+      // Pipelined interface: telegrams go out in posting order, and each one that
+      //   expects a reply gets it delivered to the listener in arrival order.
+      // This default does a blocking round trip; transports able to keep several
+      //   telegrams in flight override it.
+      virtual void post ( const telegram &buf, bool expect_reply );
+
+      // Once this returns, the previous listener will not be called anymore
+      virtual void set_listener ( transport_listener *listener ) { listener_ = listener; };
+
+      // Bound of each transfer, for transports that wait on their own; 0 waits forever
+      virtual void set_timeout ( int64_t timeout_ns ) {};
+
+      virtual const transport_stats & stats ( void ) const { return stats_; };
+
+    protected:
+      transport_listener *listener_;
+      transport_stats     stats_;
+    };
+
+  // A brick attached to the USB bus, as found by USB_transport::enumerate
+  typedef struct
+    {
+      string serial; // USB serial number, which is the bluetooth address of the brick
+      string path;   // Bus and ports, as in "1-2.4"; stable as long as the cabling
+      string name;   // Empty if it couldn't be asked (e.g. the brick is in use)
+    } usb_brick;
+
+  // If the brick goes away (unplugged, or reset), posting fails at once with nxt_error and
+  //   everything in flight is failed; the same brick is reattached as soon as it is enumerated
+  //   again, by libusb hotplug events where available, or by polling for it otherwise.
+  class USB_transport : public transport
+    {
+    public:
+      // Connects to the brick whose serial number, bus path or name is which (tried in this order),
+      //   or to the first one found if which is empty.
+      // The device is reset unless fast_attach, which keeps its configuration if already right and just
+      //   drains replies left over by a previous user: milliseconds instead of a re-enumeration.
+      explicit USB_transport ( const string &which = "", bool fast_attach = false );
+      ~USB_transport ( void );
+
+      // Bricks currently attached. Those not in use are asked for their name.
+      static vector<usb_brick> enumerate ( void );
+      virtual void write ( const telegram &buf );
+      virtual void read ( telegram &reply );
+
+      // Asynchronous libusb transfers, completed by an internal event thread
+      // Transfers and their buffers are pooled and reused
+      virtual void post ( const telegram &buf, bool expect_reply );
+      virtual void set_listener ( transport_listener *listener );
+
+      // Transfers that time out are counted, not reported: the brick has deadlines of its own
+      virtual void set_timeout ( int64_t timeout_ns );
+
+      bool attached ( void ) const { return attached_; };
+
+    private:
+      libusb_device_handle *handle_;
+      unsigned int          timeout_ms_;
+
+      // To find the brick again; its serial number, or its path if it has none
+      string                identity_;
+      volatile bool         attached_;
+      volatile bool         arrived_;     // A brick was enumerated while detached
+      int64_t               reattach_ns_; // Of the last attempt, when polling
+      bool                  hotplug_;
+      libusb_hotplug_callback_handle hotplug_handle_;
+
+      // A single libusb context and event thread serve the transfers of all bricks in the process,
+      //   so each new brick adds neither threads nor polling latency.
+      // Held (and the thread started) while there are users; the first one creates them.
+      static pthread_mutex_t  context_mutex_;
+      static libusb_context  *context_;
+      static int              context_users_;
+      static pthread_t        event_thread_;
+      static volatile bool    stopping_;
+
+      // Transports that the event thread may reattach
+      static pthread_mutex_t         registry_mutex_;
+      static vector<USB_transport*>  registry_;
+
+      static void acquire_context ( void );
+      static void release_context ( void );
+
+      static libusb_device_handle * open ( const string &which );
+
+      struct transfer_slot
+        {
+          USB_transport   *owner;
+          libusb_transfer *transfer;
+          telegram         data;     // Transfer buffer, delivered in place as the reply
+          bool             drain;    // Armed for the late reply of a timed out read
+        };
+
+      pthread_mutex_t listener_mutex_; // Held while delivering to the listener
+      pthread_mutex_t inflight_mutex_;
+      pthread_cond_t  inflight_cond_;
+      vector<transfer_slot*> inflight_;
+      vector<transfer_slot*> idle_;    // Pool of reusable transfers
+
+      static void usb_check ( int usb_error );
+      int         count ( int usb_error ); // Into stats, returning it
+
+      void submit ( unsigned char endpoint, const telegram &buf, bool drain = false );
+      void completed ( transfer_slot *slot );
+
+      void detach ( const string &why ); // Fails everything in flight, till reattached
+      void reattach ( void );            // From the event thread
+
+      static void  LIBUSB_CALL on_transfer ( libusb_transfer *transfer );
+      static int   LIBUSB_CALL on_hotplug ( libusb_context *context, libusb_device *device,
+                                            libusb_hotplug_event event, void *self );
+      static void *event_loop ( void * );
     };
 
   enum motors
@@ -78,6 +342,63 @@ namespace NXT
     motor_run_state_rampdown = 0x40
   };
 
+  // Input ports
+  enum sensors
+  {
+    S1 = 0x00,
+    S2 = 0x01,
+    S3 = 0x02,
+    S4 = 0x03
+  };
+
+  const int kNumSensors = 4;
+
+  enum sensor_types
+  {
+    sensor_type_none           = 0x00,
+    sensor_type_switch         = 0x01, // Touch sensor
+    sensor_type_temperature    = 0x02,
+    sensor_type_reflection     = 0x03,
+    sensor_type_angle          = 0x04,
+    sensor_type_light_active   = 0x05, // Light sensor, with its led on
+    sensor_type_light_inactive = 0x06,
+    sensor_type_sound_db       = 0x07,
+    sensor_type_sound_dba      = 0x08,
+    sensor_type_custom         = 0x09,
+    sensor_type_lowspeed       = 0x0A, // I2C
+    sensor_type_lowspeed_9v    = 0x0B, // I2C, powered (e.g. ultrasonic)
+    sensor_type_color_full     = 0x0D, // NXT 2.0 color sensor, reports color number 1-6
+    sensor_type_color_red      = 0x0E,
+    sensor_type_color_green    = 0x0F,
+    sensor_type_color_blue     = 0x10,
+    sensor_type_color_none     = 0x11
+  };
+
+  enum sensor_modes
+  {
+    sensor_mode_raw              = 0x00,
+    sensor_mode_boolean          = 0x20,
+    sensor_mode_transition_count = 0x40,
+    sensor_mode_period_count     = 0x60,
+    sensor_mode_pct_full_scale   = 0x80,
+    sensor_mode_celsius          = 0xA0,
+    sensor_mode_fahrenheit       = 0xC0,
+    sensor_mode_angle_steps      = 0xE0
+  };
+
+  typedef struct
+    {
+      uint8_t      port;
+      bool         valid;            // False until a reading in the current mode is available
+      bool         is_calibrated;
+      sensor_types type;
+      sensor_modes mode;
+      uint16_t     raw;              // A/D value
+      uint16_t     normalized;
+      int16_t      scaled;           // As per mode: 0/1 for boolean, 0-100 for percentages...
+      int16_t      calibrated;
+    } input_values;
+
   typedef struct
     {
       uint8_t protocol_minor;
@@ -107,15 +428,162 @@ namespace NXT
     } output_state;
     // Beware: the delta is since last command, not since last reading!    
 
-  class brick
+  // Selection of motors for multi-motor calls
+  enum motor_masks
+  {
+    mask_A   = 1 << A,
+    mask_B   = 1 << B,
+    mask_C   = 1 << C,
+    mask_All = mask_A | mask_B | mask_C
+  };
+
+  const int kNumMotors = 3;
+
+  typedef struct
+    {
+      uint8_t      mask;                // Motors read; others in state are left untouched
+      int64_t      timestamp_ns;        // Single sample time for all of them (see monotonic_ns)
+      int64_t      sample_ns[kNumMotors]; // Of each reading, see reply_future::sample_ns
+      output_state state[kNumMotors];   // Indexed by motors
+    } motor_states;
+
+  // Monotonic clock used to stamp samples, in nanoseconds
+  int64_t monotonic_ns ( void );
+
+  // Drive of a pair of motors in regulation_motor_sync, which the brick keeps in lockstep
+  // Turn ratio 0 runs both alike, 50 stops one and 100 runs them opposite;
+  //   positive ratios slow down the motor in the higher port, negative ones the other.
+  typedef struct
+    {
+      int8_t power_pct;  // Of the faster motor
+      int8_t turn_ratio;
+    } sync_drive;
+
+  // Closest drive to the given powers of the lower and the higher port motors
+  sync_drive sync_drive_for ( int first_pct, int second_pct );
+
+  // PREBUILT TELEGRAMS
+  // One per direct command; their fields can be patched in place and the
+  //   telegram executed over and over without encoding anything again.
+
+  class play_tone_telegram : public telegram
+    {
+    public:
+      play_tone_telegram ( uint16_t tone_Hz, uint16_t duration_ms );
+      play_tone_telegram & set_tone ( uint16_t tone_Hz );
+      play_tone_telegram & set_duration ( uint16_t duration_ms );
+    };
+
+  class set_output_state_telegram : public telegram
+    {
+    public:
+      set_output_state_telegram (
+        motors           motor       = A,
+        int8_t           power_pct   = 0,
+        motor_modes      mode        = motor_brake,
+        regulation_modes regulation  = regulation_motor_speed,
+        int8_t           turn_ratio  = 0,
+        motor_run_states state       = motor_run_state_running,
+        uint32_t         tacho_limit = 0 );
+
+      set_output_state_telegram & set_motor       ( motors motor );
+      set_output_state_telegram & set_power       ( int8_t power_pct );
+      set_output_state_telegram & set_mode        ( motor_modes mode );
+      set_output_state_telegram & set_regulation  ( regulation_modes regulation );
+      set_output_state_telegram & set_turn_ratio  ( int8_t turn_ratio );
+      set_output_state_telegram & set_run_state   ( motor_run_states state );
+      set_output_state_telegram & set_tacho_limit ( uint32_t tacho_limit );
+    };
+
+  class get_output_state_telegram : public telegram
+    {
+    public:
+      get_output_state_telegram ( motors motor );
+      get_output_state_telegram & set_motor ( motors motor );
+    };
+
+  class reset_motor_position_telegram : public telegram
+    {
+    public:
+      reset_motor_position_telegram ( motors motor, bool relative_to_last_position = false );
+    };
+
+  class get_battery_level_telegram : public telegram
+    {
+    public:
+      get_battery_level_telegram ( void );
+    };
+
+  class stop_sound_playback_telegram : public telegram
+    {
+    public:
+      stop_sound_playback_telegram ( void );
+    };
+
+  class keep_alive_telegram : public telegram
+    {
+    public:
+      keep_alive_telegram ( void );
+    };
+
+  class set_input_mode_telegram : public telegram
+    {
+    public:
+      set_input_mode_telegram ( sensors port, sensor_types type, sensor_modes mode );
+    };
+
+  class get_input_values_telegram : public telegram
+    {
+    public:
+      get_input_values_telegram ( sensors port = S1 );
+      get_input_values_telegram & set_port ( sensors port );
+    };
+
+  class reset_input_scaled_value_telegram : public telegram
+    {
+    public:
+      reset_input_scaled_value_telegram ( sensors port );
+    };
+
+  const uint8_t kMaxLsData = 16; // Per low speed (I2C) transaction, each way
+
+  class ls_write_telegram : public telegram
+    {
+    public:
+      ls_write_telegram ( sensors port, const uint8_t *tx, uint8_t tx_len, uint8_t rx_len );
+    };
+
+  class ls_get_status_telegram : public telegram
+    {
+    public:
+      ls_get_status_telegram ( sensors port );
+    };
+
+  class ls_read_telegram : public telegram
+    {
+    public:
+      ls_read_telegram ( sensors port );
+    };
+
+  // Decoders for replies, reading directly from the received telegram
+  output_state decode_output_state ( const telegram &reply );
+  input_values decode_input_values ( const telegram &reply );
+  uint16_t     decode_battery_level ( const telegram &reply );
+  uint8_t      decode_ls_bytes_ready ( const telegram &reply );
+  uint8_t      decode_ls_read ( const telegram &reply, uint8_t *rx ); // Returns bytes read
+
+  class brick : private transport_listener
     {
 
     public:
 
-      // Connect to the first brick found
-      // TODO: give some means of connecting to a particular brick.
-      // As is, this library serves only for using with a single brick.
-      brick ( void );
+      // Connect via USB to the brick whose serial number, bus path or name is which,
+      //   or to the first one found if empty (see USB_transport, also for fast_attach).
+      // Several bricks can be used at once, each through its own brick object.
+      explicit brick ( const string &which = "", bool fast_attach = false );
+
+      // Use the given transport (e.g. an emulator), which must outlive the brick
+      explicit brick ( transport &link );
 
       ~brick ( void );
 
@@ -125,6 +593,18 @@ namespace NXT
       //   or an empty buffer if !with_feedback
       buffer execute ( const buffer &command, bool with_feedback = false );
 
+      // Pipelined execution: the command is sent (always with feedback) and this returns
+      //   at once, so several telegrams can be in flight over the same link.
+      // Replies are matched to requests by opcode, in order of sending.
+      // The callback, if any, is invoked from the transport thread upon completion.
+      // Safe to call from several threads; execute above is built upon this.
+      reply_future execute_async ( const buffer &command, reply_callback *callback = NULL );
+
+      // Same, for prebuilt telegrams: these do no heap allocation
+      void         execute ( const telegram &command );                  // Without feedback
+      void         execute ( const telegram &command, telegram &reply ); // With feedback
+      reply_future execute_async ( const telegram &command, reply_callback *callback = NULL );
+
       // PREPARED COMMANDS
       // That you an store and execute with or without feedback
 
@@ -155,6 +635,16 @@ namespace NXT
 
       output_state get_motor_state ( motors motor );
 
+      // Reads several motors with all requests sent back-to-back,
+      //   so it costs about one round trip and the readings are near simultaneous.
+      // The timestamp is the midpoint between the first request and the last reply.
+      motor_states get_motor_states ( uint8_t mask = mask_All );
+
+      // Sensors
+      void         set_input_mode ( sensors port, sensor_types type, sensor_modes mode );
+      input_values get_input_values ( sensors port );
+      void         reset_input_scaled_value ( sensors port ); // e.g. transition counters
+
       // In millivolts
       uint16_t get_battery_level ( void );
 
@@ -162,11 +652,31 @@ namespace NXT
 
       device_info get_device_info ( void );
 
-      // Run a 10-second loop of play_tone, to get the average time per commands
-      // For testing purposes, yes.
-      void msg_rate_check ( void );
-
-    private:
+      // Deadline of each reply from its sending, after which waiting on it throws nxt_timeout,
+      //   and its entry is dropped (a late reply goes to the next request of the same opcode).
+      // Blocking queries are sent again up to retries times, so none takes longer than
+      //   ( retries + 1 ) * timeout. 0, the default, waits forever.
+      // Also bounds the transfers of the transport, where it can.
+      void set_timeout ( int64_t timeout_ns, int retries = 0 );
+
+      // Hot path statistics since construction, per opcode
+      // Round trips go from sending to the reply being matched, so they include queueing in the link.
+      typedef struct
+        {
+          counter           sent;       // With or without feedback
+          counter           replies;
+          counter           errors;     // Replies with an error status, or lost to the link
+          counter           timeouts;   // Replies past their deadline
+          counter           retries;    // Of blocking queries
+          latency_histogram round_trip;
+        } opcode_stats;
+
+      static const int kNumOpcodeStats = 0x21; // Direct commands, and a last entry shared by all other opcodes
+
+      const opcode_stats    & stats ( uint8_t opcode ) const { return stats_[ std::min<int> ( opcode, kNumOpcodeStats - 1 ) ]; };
+      const transport_stats & link_stats ( void ) const { return link_->stats(); };
+      int                     in_flight ( void ) const { return num_pending_; };      // Awaiting reply now
+      int                     peak_in_flight ( void ) const { return peak_pending_; };
 
       enum telegram_types
       {
@@ -177,14 +687,85 @@ namespace NXT
         system_command_without_response = 0x80
       };
 
+    private:
+
       buffer assemble ( telegram_types teltype,
                         uint8_t        command,
                         const buffer & payload );
       //  Assembles the full telegram to be sent over usb or bluetooth.
 
-      USB_transport link_;
-      //  For now is a fixed USB transport, but we could easily add bluetooth here
+      transport *link_;
+      bool       owns_link_;
+
+      static const int kMaxInFlight = 32;
+
+      volatile int64_t     timeout_ns_;
+      volatile int         retries_;
+
+      pthread_mutex_t      send_mutex_;    // Keeps pending_ in the same order as the wire
+      pthread_mutex_t      pending_mutex_;
+      pthread_cond_t       pending_freed_; // On the monotonic clock
+      reply_future         pending_[kMaxInFlight]; // Sent, awaiting reply, oldest first
+      int64_t              sent_ns_[kMaxInFlight]; // Of each pending one
+      volatile int         num_pending_;
+      volatile int         peak_pending_;
+
+      opcode_stats         stats_[kNumOpcodeStats];
+
+      void send ( const telegram &command, bool with_feedback );
+      void remove_pending ( int i );
+      static void check_motor ( const output_state &state, motors motor ); // Throws if the reply is another motor's
+      int  expire_pending ( int64_t now_ns, reply_future *expired ); // Returns how many
+
+      // Blocking round trip, sent again on timeouts as set_timeout says
+      reply_future query ( const telegram &command );
+
+      opcode_stats & stats_of ( uint8_t opcode ) { return stats_[ std::min<int> ( opcode, kNumOpcodeStats - 1 ) ]; };
 
+      // transport_listener
+      virtual void on_read ( const telegram &reply );
+      virtual void on_error ( const string &error );
+
+    };
+
+  // A low speed (I2C) exchange with a digital sensor:
+  //   LSWRITE -> LSGETSTATUS (until the answer is ready) -> LSREAD
+  // It is advanced by calling step, which never waits for the brick, so a control
+  //   loop can interleave it with other traffic and not be blocked for its duration.
+  class ls_transaction
+    {
+    public:
+      enum states { idle, writing, polling, reading, done, failed };
+
+      ls_transaction ( void );
+
+      // Aborts any exchange in progress. rx_len may be 0 for write-only commands
+      void start ( sensors port, const uint8_t *tx, uint8_t tx_len, uint8_t rx_len,
+                   int64_t timeout_ns = 100000000LL );
+
+      // Sends the next telegram if the previous one was answered. True once done or failed
+      bool step ( brick &b );
+
+      states         state ( void ) const { return state_; };
+      bool           busy ( void ) const { return state_ != idle && state_ != done && state_ != failed; };
+      const uint8_t *data ( void ) const { return rx_; };    // Valid once done
+      uint8_t        size ( void ) const { return rx_len_; };
+      const string & error ( void ) const { return error_; }; // Valid once failed
+
+    private:
+      states       state_;
+      sensors      port_;
+      uint8_t      tx_[kMaxLsData];
+      uint8_t      tx_len_;
+      uint8_t      rx_[kMaxLsData];
+      uint8_t      rx_len_;
+      int64_t      deadline_ns_;
+      reply_future pending_;
+      string       error_;
+
+      void fail ( const string &error );
     };
 
 }
+
+#endif
@@ -0,0 +1,341 @@
+#include <fcntl.h>
+#include "odometry_ring.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace nxt_driver;
+
+// The writer bumps generation whenever it starts over. head counts samples written, modulo 2^32.
+// A slot's seq is odd while it's being written, and 2 * ( index + 1 ) (modulo 2^32) once it holds index.
+struct nxt_driver::odometry_ring_header
+  {
+    uint32_t          magic;
+    uint32_t          version;
+    uint32_t          capacity;    // Power of two
+    uint32_t          sample_size;
+    volatile uint32_t generation;
+    volatile uint32_t head;
+  };
+
+struct nxt_driver::odometry_ring_slot
+  {
+    volatile uint32_t seq;
+    uint32_t          pad;
+    odometry_sample   sample;
+  };
+
+const uint32_t kMagic       = 0x52545844; // "DXTR"
+const uint32_t kVersion     = 1;
+const uint32_t kMaxCapacity = 1 << 20;
+const int      kMaxRetries  = 4;          // Of a slot being rewritten while copied, before giving it up as lost
+
+// Room for the header, rounded so slots are aligned
+const size_t kSlotsOffset = ( sizeof ( odometry_ring_header ) + 63 ) & ~static_cast<size_t> ( 63 );
+
+size_t ring_size ( uint32_t capacity )
+{
+  return kSlotsOffset + capacity * sizeof ( odometry_ring_slot );
+}
+
+uint32_t seq_of ( uint64_t index )
+{
+  return static_cast<uint32_t> ( 2 * ( index + 1 ) );
+}
+
+OdometryRing::OdometryRing ( void ) : header_ ( NULL ), slots_ ( NULL ), size_ ( 0 ), capacity_ ( 0 ), next_ ( 0 )
+{
+  ;
+}
+
+OdometryRing::~OdometryRing ( void )
+{
+  close();
+}
+
+bool OdometryRing::open ( const std::string &path, uint32_t capacity )
+{
+  close();
+
+  uint32_t rounded = 1;
+  while ( rounded < capacity && rounded < kMaxCapacity )
+    rounded <<= 1;
+
+  const int fd = ::open ( path.c_str(), O_RDWR | O_CREAT, 0644 );
+  if ( fd < 0 )
+    return false;
+
+  // Never shrunk, so readers still mapping a larger ring don't fault
+  const size_t size = ring_size ( rounded );
+  struct stat  st;
+  const bool   sized =
+    fstat ( fd, &st ) == 0 &&
+    ( st.st_size >= static_cast<off_t> ( size ) || ftruncate ( fd, size ) == 0 );
+
+  void *map = sized ? mmap ( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+
+  ::close ( fd );
+
+  if ( map == MAP_FAILED )
+    return false;
+
+  header_   = static_cast<odometry_ring_header*> ( map );
+  slots_    = reinterpret_cast<odometry_ring_slot*> ( static_cast<char*> ( map ) + kSlotsOffset );
+  size_     = size;
+  capacity_ = rounded;
+  next_     = 0;
+
+  const bool     ours       = header_->magic == kMagic && header_->version == kVersion;
+  const uint32_t generation = ours ? header_->generation + 1 : 1;
+
+  // Readers following the previous stream see its generation end before anything else changes
+  header_->generation = 0;
+  __sync_synchronize();
+
+  header_->magic       = kMagic;
+  header_->version     = kVersion;
+  header_->capacity    = capacity_;
+  header_->sample_size = sizeof ( odometry_sample );
+  header_->head        = 0;
+
+  for ( uint32_t i = 0; i < capacity_; i++ )
+    slots_[i].seq = 0;
+
+  __sync_synchronize();
+  header_->generation = generation == 0 ? 1 : generation;
+
+  return true;
+}
+
+void OdometryRing::close ( void )
+{
+  if ( header_ != NULL )
+    munmap ( header_, size_ );
+
+  header_ = NULL;
+  slots_  = NULL;
+}
+
+void OdometryRing::push ( odometry_sample &sample )
+{
+  if ( header_ == NULL )
+    return;
+
+  sample.index = next_;
+
+  odometry_ring_slot &s = slots_[next_ & ( capacity_ - 1 )];
+
+  s.seq = seq_of ( next_ ) - 1;
+  __sync_synchronize();
+  s.sample = sample;
+  __sync_synchronize();
+  s.seq = seq_of ( next_ );
+
+  next_++;
+
+  __sync_synchronize();
+  header_->head = static_cast<uint32_t> ( next_ );
+}
+
+OdometryReader::OdometryReader ( void )
+    : header_ ( NULL ),
+    slots_ ( NULL ),
+    size_ ( 0 ),
+    capacity_ ( 0 ),
+    generation_ ( 0 ),
+    next_ ( 0 ),
+    lost_ ( 0 )
+{
+  ;
+}
+
+OdometryReader::~OdometryReader ( void )
+{
+  close();
+}
+
+bool OdometryReader::open ( const std::string &path )
+{
+  close();
+
+  const int fd = ::open ( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    return false;
+
+  struct stat st;
+  void       *map = MAP_FAILED;
+
+  if ( fstat ( fd, &st ) == 0 && st.st_size >= static_cast<off_t> ( kSlotsOffset ) )
+    {
+      // The header tells the size of the rest
+      const odometry_ring_header *h = static_cast<const odometry_ring_header*> (
+                                        mmap ( NULL, kSlotsOffset, PROT_READ, MAP_SHARED, fd, 0 ) );
+
+      if ( h != MAP_FAILED )
+        {
+          const uint32_t capacity = h->capacity;
+          const bool     valid    = h->magic == kMagic && h->version == kVersion &&
+                                    h->sample_size == sizeof ( odometry_sample ) &&
+                                    capacity > 0 && capacity <= kMaxCapacity && ( capacity & ( capacity - 1 ) ) == 0 &&
+                                    st.st_size >= static_cast<off_t> ( ring_size ( capacity ) );
+
+          munmap ( const_cast<odometry_ring_header*> ( h ), kSlotsOffset );
+
+          if ( valid )
+            {
+              map       = mmap ( NULL, ring_size ( capacity ), PROT_READ, MAP_SHARED, fd, 0 );
+              size_     = ring_size ( capacity );
+              capacity_ = capacity;
+            }
+        }
+    }
+
+  ::close ( fd );
+
+  if ( map == MAP_FAILED )
+    return false;
+
+  header_     = static_cast<const odometry_ring_header*> ( map );
+  slots_      = reinterpret_cast<const odometry_ring_slot*> ( static_cast<const char*> ( map ) + kSlotsOffset );
+  generation_ = 0; // So the first read takes up the current stream
+  lost_       = 0;
+
+  return true;
+}
+
+void OdometryReader::close ( void )
+{
+  if ( header_ != NULL )
+    munmap ( const_cast<odometry_ring_header*> ( header_ ), size_ );
+
+  header_ = NULL;
+  slots_  = NULL;
+}
+
+// Onto the current stream, from its oldest sample still there if new to it
+bool OdometryReader::follow ( void )
+{
+  const uint32_t generation = header_->generation;
+  __sync_synchronize();
+
+  if ( generation == generation_ || generation == 0 )
+    return true;
+
+  if ( header_->capacity != capacity_ )
+    {
+      close();
+      return false;
+    }
+
+  const uint32_t head = header_->head;
+
+  next_       = generation_ == 0 && head > capacity_ ? head - capacity_ : 0;
+  generation_ = generation;
+
+  return true;
+}
+
+// False if the slot doesn't hold index: gone if because it was overwritten, rather than not written yet
+//   (or the writer started over, which the next follow() takes up)
+bool OdometryReader::copy ( uint64_t index, odometry_sample &sample, bool &gone ) const
+  {
+    const odometry_ring_slot &s      = slots_[index & ( capacity_ - 1 )];
+    const uint32_t            wanted = seq_of ( index );
+
+    gone = false;
+
+    for ( int retry = 0; retry < kMaxRetries; retry++ )
+      {
+        const uint32_t before = s.seq;
+        __sync_synchronize();
+
+        // Ahead of wanted, even if odd, once a later lap writes the slot
+        if ( before != wanted )
+          {
+            gone = static_cast<int32_t> ( before - wanted ) > 0;
+            return false;
+          }
+
+        sample = const_cast<const odometry_sample&> ( s.sample );
+        __sync_synchronize();
+
+        if ( header_->generation != generation_ )
+          return false;
+
+        if ( s.seq == before )
+          return true;
+      }
+
+    gone = true;
+    return false;
+  }
+
+int OdometryReader::read ( odometry_sample *samples, int max )
+{
+  if ( header_ == NULL || ! follow() )
+    return -1;
+
+  if ( generation_ == 0 ) // The writer is starting
+    return 0;
+
+  int done = 0;
+
+  while ( done < max )
+    {
+      const uint32_t head  = header_->head;
+      const uint32_t ahead = head - static_cast<uint32_t> ( next_ );
+
+      if ( ahead == 0 || ahead > 0x80000000u ) // Nothing new
+        break;
+
+      // Fallen behind by more than the ring: the oldest ones are gone for sure
+      if ( ahead > capacity_ )
+        {
+          lost_ += ahead - capacity_;
+          next_ += ahead - capacity_;
+        }
+
+      bool gone = false;
+
+      if ( copy ( next_, samples[done], gone ) )
+        {
+          next_++;
+          done++;
+        }
+      else if ( gone )
+        {
+          lost_++;
+          next_++;
+        }
+      else
+        break;
+    }
+
+  return done;
+}
+
+bool OdometryReader::latest ( odometry_sample &sample )
+{
+  if ( header_ == NULL || ! follow() || generation_ == 0 )
+    return false;
+
+  for ( int retry = 0; retry < kMaxRetries; retry++ )
+    {
+      const uint32_t head  = header_->head;
+      const uint32_t ahead = head - static_cast<uint32_t> ( next_ );
+
+      if ( ahead == 0 || ahead > 0x80000000u )
+        return false;
+
+      bool gone = false;
+
+      if ( copy ( next_ + ahead - 1, sample, gone ) )
+        {
+          lost_ += ahead - 1;
+          next_ += ahead;
+          return true;
+        }
+    }
+
+  return false;
+}
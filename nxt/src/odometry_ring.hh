@@ -0,0 +1,119 @@
+#ifndef _odometry_ring_
+#define _odometry_ring_
+
+#include <stdint.h>
+#include <string>
+
+namespace nxt_driver
+  {
+
+  // Samples of motors and sensors, as read by the driver, exported through a memory-mapped file
+  //   (e.g. under /dev/shm) to processes on the same host: each one reads every sample, about
+  //   microseconds after it was taken, without going through the Player server.
+  // A single writer appends to a ring; any number of readers follow it at their own pace, never
+  //   blocking it nor each other. Each slot is a seqlock: readers retry or skip a slot being
+  //   rewritten, and learn how many samples they lost for falling more than a ring behind.
+  // This unit needs nothing but libc, so readers can build it on its own.
+
+  // Times are of CLOCK_MONOTONIC, in ns (as NXT::monotonic_ns)
+  typedef struct
+    {
+      uint64_t index;            // In the stream of samples, from 0 since the writer started
+      int64_t  stamp_ns;         // Of the whole sample
+      uint8_t  kind;             // odometry_sample_kinds
+      uint8_t  mask;             // Motors: the ones read (as NXT::motor_masks). Sensor: its port (0-3)
+      uint8_t  stale;            // The brick is not answering: this repeats the last good readings
+      uint8_t  pad;
+
+      // Motors
+      int64_t  motor_ns[3];      // Of each motor's reading
+      int32_t  tacho[3];         // [deg]
+      int8_t   power[3];         // [%]
+      uint8_t  run_state[3];     // NXT::motor_run_states
+      double   position[3];      // [length] tacho * odom_rate
+      double   velocity[3];      // [length/s] Filtered
+      double   pose[3];          // [length, length, rad] Of position2d, if provided
+      double   pose_vel[2];      // [length/s, rad/s]
+
+      // Sensor
+      int32_t  raw;
+      int32_t  scaled;
+      double   value;            // As published: scaled, 0/1 for touch, [m] for ultrasonic
+    } odometry_sample;
+
+  enum odometry_sample_kinds
+  {
+    odometry_motors = 1,
+    odometry_sensor = 2
+  };
+
+  // Layout of the file, in odometry_ring.cc
+  struct odometry_ring_header;
+  struct odometry_ring_slot;
+
+  // Producer side, used by the driver
+  class OdometryRing
+    {
+    public:
+      OdometryRing ( void );
+      ~OdometryRing ( void );
+
+      // Maps path with room for capacity samples (rounded up to a power of two), starting a new
+      //   stream that readers notice; false if that fails, leaving it closed
+      bool open ( const std::string &path, uint32_t capacity );
+      void close ( void );
+      bool is_open ( void ) const { return header_ != NULL; };
+
+      // Sets its index, and makes it visible to readers
+      void push ( odometry_sample &sample );
+
+      uint64_t written ( void ) const { return next_; };
+
+    private:
+      odometry_ring_header *header_;
+      odometry_ring_slot   *slots_;
+      size_t                size_;
+      uint32_t              capacity_;
+      uint64_t              next_;
+    };
+
+  // Consumer side
+  class OdometryReader
+    {
+    public:
+      OdometryReader ( void );
+      ~OdometryReader ( void );
+
+      // Maps path read-only, and starts at the oldest sample still in the ring;
+      //   false if it can't be mapped or was not written by an OdometryRing
+      bool open ( const std::string &path );
+      void close ( void );
+      bool is_open ( void ) const { return header_ != NULL; };
+
+      // Copies up to max samples not read yet, in order, never waiting; returns how many.
+      // Samples overwritten before being read are skipped, and counted in lost().
+      // If the writer started over, reading goes on from its first sample. If it did with
+      //   another capacity, the reader is closed and -1 returned: open it again.
+      int read ( odometry_sample *samples, int max );
+
+      // The newest sample, skipping anything before it; false if there is none
+      bool latest ( odometry_sample &sample );
+
+      uint64_t lost ( void ) const { return lost_; };
+
+    private:
+      const odometry_ring_header *header_;
+      const odometry_ring_slot   *slots_;
+      size_t                      size_;
+      uint32_t                    capacity_;
+      uint32_t                    generation_;
+      uint64_t                    next_;     // Index of the next sample to read
+      uint64_t                    lost_;
+
+      bool follow ( void );                                         // False if the layout changed
+      bool copy ( uint64_t index, odometry_sample &sample, bool &gone ) const;
+    };
+
+}
+
+#endif
@@ -0,0 +1,171 @@
+#include <algorithm>
+#include "poll_scheduler.hh"
+
+using namespace nxt_driver;
+
+const double kInitialQueryCost = 2e6; // [ns] A USB round trip, as measured empirically
+
+PollScheduler::PollScheduler ( double period, double budget )
+    : period_ns_ ( static_cast<int64_t> ( period * 1e9 ) ),
+    budget_ns_ ( static_cast<int64_t> ( period * budget * 1e9 ) ),
+    query_cost_ns_ ( kInitialQueryCost ),
+    last_queries_ ( 0 )
+{
+  ;
+}
+
+int PollScheduler::add_source ( const std::string &name, double period, int queries,
+                               traffic_class traffic, double deadline )
+{
+  source src;
+
+  src.name        = name;
+  src.period_ns   = static_cast<int64_t> ( period * 1e9 );
+  src.queries     = queries;
+  src.traffic     = traffic;
+  src.deadline_ns = static_cast<int64_t> ( ( deadline > 0.0 ? deadline : period ) * 1e9 );
+  src.planned     = false;
+  src.next_ns     = 0;        // Due at once
+  src.last_ns     = 0;
+
+  src.stats.polls    = 0;
+  src.stats.deferred = 0;
+  src.stats.expired  = 0;
+  src.stats.rate     = 0.0;
+
+  sources_.push_back ( src );
+
+  return sources_.size() - 1;
+}
+
+int PollScheduler::plan ( int64_t now_ns, int *due, int max_due )
+{
+  int num_due = 0;
+  last_queries_ = 0;
+
+  // Whatever is due before the middle of this cycle is served now rather than a whole cycle late
+  const int64_t horizon = now_ns + period_ns_ / 2;
+
+  // A late background poll is worth nothing: it waits for its next period instead of taking room
+  for ( size_t i = 0; i < sources_.size(); i++ )
+    {
+      source &src = sources_[i];
+
+      src.planned = false;
+
+      if ( src.next_ns == 0 ) // Due at once, as of the first plan
+        src.next_ns = now_ns;
+
+      const int64_t late = now_ns - ( src.next_ns + src.deadline_ns );
+
+      if ( src.traffic == background_traffic && late > 0 )
+        {
+          src.stats.expired++;
+          src.next_ns += ( late / src.period_ns + 1 ) * src.period_ns;
+        }
+    }
+
+  for ( size_t i = 0; i < sources_.size() && num_due < max_due; i++ )
+    if ( sources_[i].traffic == control_traffic && sources_[i].next_ns <= horizon )
+      {
+        select ( i, now_ns );
+        due[num_due++] = i;
+      }
+
+  // Then the rest, by class and earliest deadline, while they fit
+  while ( num_due < max_due )
+    {
+      int best = -1;
+
+      for ( size_t i = 0; i < sources_.size(); i++ )
+        if ( ! sources_[i].planned && sources_[i].next_ns <= horizon && ( best < 0 || precedes ( i, best ) ) )
+          best = i;
+
+      if ( best < 0 )
+        break;
+
+      // Something always goes, or a too tight budget would starve everything
+      if ( last_queries_ > 0 &&
+           ( last_queries_ + sources_[best].queries ) * query_cost_ns_ > budget_ns_ )
+        break;
+
+      select ( best, now_ns );
+      due[num_due++] = best;
+    }
+
+  for ( size_t i = 0; i < sources_.size(); i++ )
+    if ( ! sources_[i].planned && sources_[i].next_ns <= horizon )
+      sources_[i].stats.deferred++;
+
+  return num_due;
+}
+
+bool PollScheduler::precedes ( int a, int b ) const
+  {
+    const source &sa = sources_[a];
+    const source &sb = sources_[b];
+
+    if ( sa.traffic != sb.traffic )
+      return sa.traffic < sb.traffic;
+
+    return sa.next_ns + sa.deadline_ns < sb.next_ns + sb.deadline_ns;
+  }
+
+void PollScheduler::select ( int id, int64_t now_ns )
+{
+  source &src = sources_[id];
+
+  src.planned    = true;
+  last_queries_ += src.queries;
+
+  if ( src.last_ns != 0 && now_ns > src.last_ns )
+    {
+      const double rate = 1e9 / ( now_ns - src.last_ns );
+      src.stats.rate = ( src.stats.rate == 0.0 ? rate : 0.9 * src.stats.rate + 0.1 * rate );
+    }
+
+  src.stats.polls++;
+  src.last_ns = now_ns;
+
+  // Keep the phase, unless we fell a whole period behind
+  src.next_ns += src.period_ns;
+  if ( src.next_ns <= now_ns )
+    src.next_ns = now_ns + src.period_ns;
+}
+
+void PollScheduler::set_period ( int id, double period )
+{
+  source &src = sources_[id];
+
+  src.period_ns = static_cast<int64_t> ( period * 1e9 );
+
+  if ( src.last_ns != 0 )
+    src.next_ns = std::min ( src.next_ns, src.last_ns + src.period_ns );
+}
+
+void PollScheduler::completed ( int64_t elapsed_ns )
+{
+  if ( last_queries_ > 0 )
+    query_cost_ns_ = 0.8 * query_cost_ns_ + 0.2 * elapsed_ns / last_queries_;
+}
+
+double PollScheduler::utilization ( void ) const
+  {
+    if ( budget_ns_ <= 0 )
+      return 0.0;
+
+    // Queries per cycle; no source goes more than once in a cycle
+    double queries = 0.0;
+
+    for ( size_t i = 0; i < sources_.size(); i++ )
+      {
+        const source &src = sources_[i];
+
+        if ( src.traffic == control_traffic || src.period_ns <= period_ns_ )
+          queries += src.queries;
+        else
+          queries += src.queries * static_cast<double> ( period_ns_ ) / src.period_ns;
+      }
+
+    return queries * query_cost_ns_ / budget_ns_;
+  }
@@ -0,0 +1,93 @@
+#ifndef _poll_scheduler_
+#define _poll_scheduler_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace nxt_driver
+  {
+
+  // Decides, once per driver cycle, which periodic queries ride in the batch sent to the brick.
+  // Control sources (the motors) go whenever due, whatever the budget. Every other source is polled at its own
+  //   period, as long as the whole batch is expected to fit in the time budget of the cycle:
+  //   sensors first, then background queries in whatever room is left. Within a class, the
+  //   earliest deadline goes first; those that don't fit wait for the next cycle, except
+  //   background queries past their deadline, which are dropped till their next period.
+  // Motor commands are not scheduled here: they are written before any batch.
+  class PollScheduler
+    {
+    public:
+      // In order of precedence
+      typedef enum
+        {
+          control_traffic,    // Whenever due, whatever the budget
+          sensor_traffic,
+          background_traffic  // Dropped once late
+        } traffic_class;
+
+      typedef struct
+        {
+          uint64_t polls;
+          uint64_t deferred; // Cycles it was due but left out for lack of budget
+          uint64_t expired;  // Background polls dropped for missing their deadline
+          double   rate;     // Achieved polls per second (smoothed)
+        } source_stats;
+
+      // period: of the driver cycle [s]
+      // budget: fraction of the period that queries may take
+      PollScheduler ( double period, double budget );
+
+      // Returns the id of the new source; period [s] is rounded up to whole cycles in practice
+      // queries: number of telegrams the source costs
+      // deadline: [s] after being due by which a poll must go; 0 for a whole period
+      int add_source ( const std::string &name, double period, int queries,
+                       traffic_class traffic = sensor_traffic, double deadline = 0.0 );
+
+      // Selects the sources to poll in the cycle starting at now_ns, writing their ids to due
+      // Returns how many were selected
+      int plan ( int64_t now_ns, int *due, int max_due );
+
+      // Changes the period of a source; if shorter, the next poll is due that much after the last one
+      void set_period ( int id, double period );
+
+      // Reports how long the batch of the last plan took, to refine the cost per query
+      void completed ( int64_t elapsed_ns );
+
+      int                  num_sources ( void ) const { return sources_.size(); };
+      const std::string  & name ( int id ) const { return sources_[id].name; };
+      const source_stats & get_stats ( int id ) const { return sources_[id].stats; };
+      double               query_cost ( void ) const { return query_cost_ns_ * 1e-9; }; // [s]
+
+      // Admission check: fraction of the budget that all sources at their periods need, at the
+      //   current cost per query; over 1 means some of them can't get their rates
+      double               utilization ( void ) const;
+
+    private:
+      typedef struct
+        {
+          std::string   name;
+          int64_t       period_ns;
+          int           queries;
+          traffic_class traffic;
+          int64_t       deadline_ns; // Relative to next_ns
+          bool          planned;  // In the current cycle
+          int64_t       next_ns;  // Due time
+          int64_t       last_ns;  // Of last poll, 0 if none yet
+          source_stats  stats;
+        } source;
+
+      std::vector<source> sources_;
+
+      int64_t period_ns_;
+      int64_t budget_ns_;
+      double  query_cost_ns_;  // Smoothed duration of a batch divided by its queries
+      int     last_queries_;   // In the last planned batch
+
+      void select ( int id, int64_t now_ns );
+      bool precedes ( int a, int b ) const; // In dispatch order
+    };
+
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include <fcntl.h>
+#include "pose_snapshot.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace nxt_driver;
+
+struct PoseSnapshot::layout
+  {
+    uint32_t          magic;
+    uint32_t          version;
+    volatile uint32_t seq;   // Odd while storing; 0 if nothing was stored
+    pose              saved;
+  };
+
+const uint32_t kMagic   = 0x504e5854; // "TXNP"
+const uint32_t kVersion = 1;
+
+PoseSnapshot::PoseSnapshot ( void ) : data_ ( NULL )
+{
+  ;
+}
+
+PoseSnapshot::~PoseSnapshot ( void )
+{
+  close();
+}
+
+bool PoseSnapshot::open ( const std::string &path )
+{
+  close();
+
+  const int fd = ::open ( path.c_str(), O_RDWR | O_CREAT, 0644 );
+  if ( fd < 0 )
+    return false;
+
+  struct stat st;
+  const bool sized =
+    fstat ( fd, &st ) == 0 &&
+    ( st.st_size >= static_cast<off_t> ( sizeof ( layout ) ) || ftruncate ( fd, sizeof ( layout ) ) == 0 );
+
+  void *map = sized ? mmap ( NULL, sizeof ( layout ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+
+  ::close ( fd ); // The mapping holds the file
+
+  if ( map == MAP_FAILED )
+    return false;
+
+  data_ = static_cast<layout*> ( map );
+
+  // New, or of something else: starts empty
+  if ( data_->magic != kMagic || data_->version != kVersion )
+    {
+      data_->seq     = 0;
+      data_->version = kVersion;
+      data_->magic   = kMagic;
+    }
+
+  return true;
+}
+
+void PoseSnapshot::close ( void )
+{
+  if ( data_ != NULL )
+    munmap ( data_, sizeof ( layout ) );
+
+  data_ = NULL;
+}
+
+bool PoseSnapshot::load ( pose &p ) const
+  {
+    if ( data_ == NULL )
+      return false;
+
+    const uint32_t seq = data_->seq;
+    if ( seq == 0 || ( seq & 1 ) != 0 )
+      return false;
+
+    __sync_synchronize();
+    p = data_->saved;
+    __sync_synchronize();
+
+    return data_->seq == seq;
+  }
+
+void PoseSnapshot::store ( const pose &p )
+{
+  if ( data_ == NULL )
+    return;
+
+  data_->seq = data_->seq | 1;
+  __sync_synchronize();
+  data_->saved = p;
+  __sync_synchronize();
+  data_->seq = data_->seq + 1;
+}
@@ -0,0 +1,43 @@
+#ifndef _pose_snapshot_
+#define _pose_snapshot_
+
+#include <stdint.h>
+#include <string>
+
+namespace nxt_driver
+  {
+
+  // Last pose of a differential drive, kept in a small memory-mapped file so a restarted
+  //   driver goes on from it. Stores are plain writes to the mapping, with no system calls,
+  //   bracketed by a sequence count so that one torn by a crash is told apart and ignored.
+  // The page cache keeps it across driver restarts; the kernel writes it back at its own pace.
+  class PoseSnapshot
+    {
+    public:
+      typedef struct
+        {
+          double  px;       // [length]
+          double  py;
+          double  pa;       // [rad]
+          int32_t tacho[2]; // Of the left and right wheels at that pose
+        } pose;
+
+      PoseSnapshot ( void );
+      ~PoseSnapshot ( void );
+
+      // Maps path, creating it if needed; false if that fails, leaving it closed
+      bool open ( const std::string &path );
+      void close ( void );
+      bool is_open ( void ) const { return data_ != NULL; };
+
+      bool load ( pose &p ) const; // False if none was stored, or the last store was torn
+      void store ( const pose &p );
+
+    private:
+      struct layout;
+      layout *data_;
+    };
+
+}
+
+#endif
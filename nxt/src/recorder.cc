@@ -0,0 +1,414 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include "recorder.hh"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace NXT;
+using namespace std;
+
+// Records follow the header back to back, each 8-byte aligned: a record_header and its data.
+// Writers reserve room by bumping used, then fill it in; tag is set last, so a record left
+//   half written by a crash (and anything after it) is ignored on reading.
+struct NXT::recording_header
+  {
+    uint32_t          magic;
+    uint32_t          version;
+    uint64_t          size;      // Room for records [bytes]
+    int64_t           start_ns;  // When recording started, on the monotonic clock
+    volatile uint64_t used;      // Reserved so far; may pass size once full
+  };
+
+typedef struct
+  {
+    volatile uint32_t tag;
+    uint8_t           kind;      // record_kinds
+    uint8_t           size;      // Of the data
+    uint16_t          pad;
+    int64_t           ns;        // Monotonic time
+  } record_header;
+
+enum record_kinds
+{
+  record_query   = 1, // Sent, expecting a reply
+  record_command = 2, // Sent, without reply
+  record_reply   = 3,
+  record_error   = 4  // Of the link; the data is its message, truncated
+};
+
+const uint32_t kMagic     = 0x4c52544e; // "NTRL"
+const uint32_t kVersion   = 1;
+const uint32_t kCommitted = 0x4d4d4f43; // "COMM"
+
+const size_t kRecordsOffset = ( sizeof ( recording_header ) + 7 ) & ~static_cast<size_t> ( 7 );
+
+size_t record_length ( uint8_t size )
+{
+  return ( sizeof ( record_header ) + size + 7 ) & ~static_cast<size_t> ( 7 );
+}
+
+// A query while loading a recording, until its reply is found
+typedef struct
+  {
+    uint8_t opcode;
+    size_t  index;     // In the queries of its opcode
+    int64_t sent_ns;
+  } unanswered;
+
+bool expects_reply ( const telegram &buf )
+{
+  return buf.size() > 0 && ! ( buf[0] & 0x80 );
+}
+
+recording_transport::recording_transport ( transport &link, const string &path, size_t size )
+    : link_ ( link ), header_ ( NULL ), records_ ( NULL ), size_ ( kRecordsOffset + size )
+{
+  const int fd = ::open ( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+  if ( fd < 0 )
+    throw nxt_error ( "recording_transport: cannot open " + path );
+
+  // Sparse: disk is only taken as the log fills
+  void *map = ftruncate ( fd, size_ ) == 0 ? mmap ( NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+
+  ::close ( fd );
+
+  if ( map == MAP_FAILED )
+    throw nxt_error ( "recording_transport: cannot map " + path );
+
+  header_  = static_cast<recording_header*> ( map );
+  records_ = static_cast<uint8_t*> ( map ) + kRecordsOffset;
+
+  header_->magic    = kMagic;
+  header_->version  = kVersion;
+  header_->size     = size;
+  header_->start_ns = monotonic_ns();
+  header_->used     = 0;
+
+  pthread_mutex_init ( &listener_mutex_, NULL );
+
+  link_.set_listener ( this );
+}
+
+recording_transport::~recording_transport ( void )
+{
+  link_.set_listener ( NULL );
+
+  pthread_mutex_destroy ( &listener_mutex_ );
+
+  munmap ( header_, size_ );
+}
+
+void recording_transport::record ( uint8_t kind, const uint8_t *data, uint8_t size )
+{
+  const size_t   length = record_length ( size );
+  const uint64_t at     = __sync_fetch_and_add ( &header_->used, length );
+
+  if ( at + length > header_->size )
+    {
+      dropped_.add();
+      return;
+    }
+
+  record_header *r = reinterpret_cast<record_header*> ( records_ + at );
+
+  r->kind = kind;
+  r->size = size;
+  r->ns   = monotonic_ns();
+  memcpy ( r + 1, data, size );
+
+  __sync_synchronize();
+  r->tag = kCommitted;
+
+  recorded_.add();
+}
+
+void recording_transport::write ( const telegram &buf )
+{
+  record ( expects_reply ( buf ) ? record_query : record_command, buf.data(), buf.size() );
+  link_.write ( buf );
+}
+
+void recording_transport::read ( telegram &reply )
+{
+  link_.read ( reply );
+  record ( record_reply, reply.data(), reply.size() );
+}
+
+// Recorded before it goes, so its reply can't be recorded first
+void recording_transport::post ( const telegram &buf, bool expect_reply )
+{
+  record ( expect_reply ? record_query : record_command, buf.data(), buf.size() );
+  link_.post ( buf, expect_reply );
+}
+
+void recording_transport::set_listener ( transport_listener *listener )
+{
+  pthread_mutex_lock ( &listener_mutex_ );
+  listener_ = listener;
+  pthread_mutex_unlock ( &listener_mutex_ );
+}
+
+void recording_transport::on_read ( const telegram &reply )
+{
+  record ( record_reply, reply.data(), reply.size() );
+
+  pthread_mutex_lock ( &listener_mutex_ );
+  if ( listener_ != NULL )
+    listener_->on_read ( reply );
+  pthread_mutex_unlock ( &listener_mutex_ );
+}
+
+void recording_transport::on_error ( const string &error )
+{
+  record ( record_error, reinterpret_cast<const uint8_t*> ( error.data() ),
+           static_cast<uint8_t> ( std::min ( error.size(), static_cast<size_t> ( kMaxTelegramSize ) ) ) );
+
+  pthread_mutex_lock ( &listener_mutex_ );
+  if ( listener_ != NULL )
+    listener_->on_error ( error );
+  pthread_mutex_unlock ( &listener_mutex_ );
+}
+
+replay_transport::replay_transport ( const string &path, double speed )
+    : num_queries_ ( 0 ), speed_ ( speed ), stopping_ ( false )
+{
+  const int fd = ::open ( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+    throw nxt_error ( "replay_transport: cannot open " + path );
+
+  struct stat st;
+  void       *map = MAP_FAILED;
+
+  if ( fstat ( fd, &st ) == 0 && st.st_size >= static_cast<off_t> ( kRecordsOffset ) )
+    map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+
+  ::close ( fd );
+
+  if ( map == MAP_FAILED )
+    throw nxt_error ( "replay_transport: cannot map " + path );
+
+  const recording_header &h = *static_cast<const recording_header*> ( map );
+  const bool valid = h.magic == kMagic && h.version == kVersion && kRecordsOffset + h.size <= static_cast<uint64_t> ( st.st_size );
+
+  if ( valid )
+    load ( static_cast<const uint8_t*> ( map ) + kRecordsOffset, std::min ( static_cast<uint64_t> ( h.used ), h.size ) );
+
+  munmap ( map, st.st_size );
+
+  if ( ! valid )
+    throw nxt_error ( "replay_transport: not a recording: " + path );
+
+  for ( int i = 0; i < 256; i++ )
+    next_[i] = 0;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init ( &attr );
+  pthread_condattr_setclock ( &attr, CLOCK_MONOTONIC );
+
+  pthread_mutex_init ( &mutex_, NULL );
+  pthread_mutex_init ( &listener_mutex_, NULL );
+  pthread_cond_init ( &changed_, &attr );
+  pthread_condattr_destroy ( &attr );
+
+  if ( pthread_create ( &delivery_thread_, NULL, delivery_loop, this ) != 0 )
+    throw nxt_error ( "replay_transport: cannot start delivery thread" );
+}
+
+replay_transport::~replay_transport ( void )
+{
+  pthread_mutex_lock ( &mutex_ );
+  stopping_ = true;
+  pthread_cond_broadcast ( &changed_ );
+  pthread_mutex_unlock ( &mutex_ );
+
+  pthread_join ( delivery_thread_, NULL );
+
+  pthread_cond_destroy ( &changed_ );
+  pthread_mutex_destroy ( &listener_mutex_ );
+  pthread_mutex_destroy ( &mutex_ );
+}
+
+// Pairs each reply with the oldest query still unanswered of its opcode, as brick::on_read does
+void replay_transport::load ( const uint8_t *log, size_t size )
+{
+  std::deque<unanswered> waiting;
+
+  for ( size_t at = 0; at + sizeof ( record_header ) <= size; )
+    {
+      const record_header &r = *reinterpret_cast<const record_header*> ( log + at );
+
+      if ( r.tag != kCommitted || r.size > kMaxTelegramSize || at + record_length ( r.size ) > size )
+        break;
+
+      telegram data;
+      data.resize ( r.size );
+      memcpy ( data.data(), &r + 1, r.size );
+
+      at += record_length ( r.size );
+
+      if ( r.kind == record_query && r.size >= 2 )
+        {
+          const recorded_query q = { false, 0, telegram() };
+          const unanswered     u = { data[1], queries_[data[1]].size(), r.ns };
+
+          queries_[data[1]].push_back ( q );
+          waiting.push_back ( u );
+          num_queries_++;
+        }
+      else if ( r.kind == record_reply && ! waiting.empty() )
+        {
+          std::deque<unanswered>::iterator w = waiting.begin();
+
+          if ( r.size >= 3 && data[0] == brick::reply )
+            while ( w != waiting.end() && w->opcode != data[1] )
+              ++w;
+
+          if ( w == waiting.end() )
+            continue; // Stray reply
+
+          recorded_query &q = queries_[w->opcode][w->index];
+          q.answered      = true;
+          q.round_trip_ns = r.ns - w->sent_ns;
+          q.reply         = data;
+
+          waiting.erase ( w );
+        }
+    }
+}
+
+void replay_transport::write ( const telegram &buf )
+{
+  post ( buf, expects_reply ( buf ) );
+}
+
+void replay_transport::post ( const telegram &buf, bool expect_reply )
+{
+  if ( buf.size() < 2 )
+    throw nxt_error ( "replay_transport: telegram too short" );
+
+  stats_.telegrams_out.add();
+  stats_.bytes_out.add ( buf.size() );
+
+  if ( ! expect_reply )
+    return;
+
+  pthread_mutex_lock ( &mutex_ );
+
+  std::vector<recorded_query> &recorded = queries_[buf[1]];
+
+  if ( next_[buf[1]] == recorded.size() )
+    diverged_.add();
+  else
+    {
+      const recorded_query &q = recorded[next_[buf[1]]++];
+
+      // Went unanswered when recorded, as it will now
+      if ( q.answered )
+        {
+          int64_t due = monotonic_ns() + ( speed_ > 0.0 ? static_cast<int64_t> ( q.round_trip_ns / speed_ ) : 0 );
+
+          // Links don't reorder
+          if ( ! due_.empty() )
+            due = std::max ( due, due_.back().due_ns );
+
+          const scheduled_reply s = { due, q.reply };
+          due_.push_back ( s );
+
+          pthread_cond_broadcast ( &changed_ );
+        }
+    }
+
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void replay_transport::read ( telegram &reply )
+{
+  pthread_mutex_lock ( &mutex_ );
+
+  // The delivery thread leaves replies queued, due or not, only while there is no listener
+  while ( ! stopping_ && ( due_.empty() || due_.front().due_ns > monotonic_ns() ) )
+    {
+      if ( due_.empty() )
+        pthread_cond_wait ( &changed_, &mutex_ );
+      else
+        {
+          struct timespec due;
+          due.tv_sec  = due_.front().due_ns / 1000000000LL;
+          due.tv_nsec = due_.front().due_ns % 1000000000LL;
+          pthread_cond_timedwait ( &changed_, &mutex_, &due );
+        }
+    }
+
+  if ( stopping_ )
+    {
+      pthread_mutex_unlock ( &mutex_ );
+      throw nxt_error ( "replay_transport: closed" );
+    }
+
+  reply = due_.front().reply;
+  due_.pop_front();
+
+  pthread_mutex_unlock ( &mutex_ );
+
+  stats_.telegrams_in.add();
+  stats_.bytes_in.add ( reply.size() );
+}
+
+void replay_transport::set_listener ( transport_listener *listener )
+{
+  pthread_mutex_lock ( &listener_mutex_ );
+  listener_ = listener;
+  pthread_mutex_unlock ( &listener_mutex_ );
+
+  pthread_mutex_lock ( &mutex_ );
+  pthread_cond_broadcast ( &changed_ );
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void *replay_transport::delivery_loop ( void *self )
+{
+  replay_transport &rt = *static_cast<replay_transport*> ( self );
+
+  pthread_mutex_lock ( &rt.mutex_ );
+
+  while ( ! rt.stopping_ )
+    {
+      if ( rt.due_.empty() || rt.listener_ == NULL )
+        {
+          pthread_cond_wait ( &rt.changed_, &rt.mutex_ );
+          continue;
+        }
+
+      const int64_t due_ns = rt.due_.front().due_ns;
+
+      if ( due_ns > monotonic_ns() )
+        {
+          struct timespec due;
+          due.tv_sec  = due_ns / 1000000000LL;
+          due.tv_nsec = due_ns % 1000000000LL;
+          pthread_cond_timedwait ( &rt.changed_, &rt.mutex_, &due );
+          continue;
+        }
+
+      const telegram reply = rt.due_.front().reply;
+      rt.due_.pop_front();
+
+      rt.stats_.telegrams_in.add();
+      rt.stats_.bytes_in.add ( reply.size() );
+
+      pthread_mutex_unlock ( &rt.mutex_ );
+      pthread_mutex_lock ( &rt.listener_mutex_ );
+
+      if ( rt.listener_ != NULL )
+        rt.listener_->on_read ( reply );
+
+      pthread_mutex_unlock ( &rt.listener_mutex_ );
+      pthread_mutex_lock ( &rt.mutex_ );
+    }
+
+  pthread_mutex_unlock ( &rt.mutex_ );
+
+  return NULL;
+}
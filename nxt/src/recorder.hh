@@ -0,0 +1,110 @@
+#ifndef _nxt_recorder_
+#define _nxt_recorder_
+
+#include <deque>
+#include "nxtdc.hh"
+#include <vector>
+
+namespace NXT
+  {
+
+  // Layout of a recording, in recorder.cc
+  struct recording_header;
+
+  const size_t kDefaultRecordingSize = 64 << 20; // [bytes]
+
+  // Flight recorder: passes everything through to another transport, appending each telegram
+  //   sent and received (and each link error) with its monotonic time to a memory-mapped log.
+  // Appending is a copy into the mapping, from whichever thread moves the telegram: no locks,
+  //   formatting nor system calls. The log is complete as of any crash, up to the last telegram.
+  // Once the log is full, further telegrams are only counted as dropped.
+  class recording_transport : public transport, public transport_listener
+    {
+    public:
+      // Starts a new log at path, of size bytes; throws nxt_error if it can't be mapped
+      recording_transport ( transport &link, const string &path, size_t size = kDefaultRecordingSize );
+      ~recording_transport ( void );
+
+      virtual void write ( const telegram &buf );
+      virtual void read ( telegram &reply );
+      virtual void post ( const telegram &buf, bool expect_reply );
+      virtual void set_listener ( transport_listener *listener );
+      virtual void set_timeout ( int64_t timeout_ns ) { link_.set_timeout ( timeout_ns ); };
+
+      // Those of the recorded link
+      virtual const transport_stats & stats ( void ) const { return link_.stats(); };
+
+      uint64_t recorded ( void ) const { return recorded_.get(); };
+      uint64_t dropped ( void ) const { return dropped_.get(); };
+
+      virtual void on_read ( const telegram &reply );
+      virtual void on_error ( const string &error );
+
+    private:
+      transport        &link_;
+      recording_header *header_;
+      uint8_t          *records_;
+      size_t            size_;     // Of the mapping
+      pthread_mutex_t   listener_mutex_;
+      counter           recorded_;
+      counter           dropped_;
+
+      void record ( uint8_t kind, const uint8_t *data, uint8_t size );
+    };
+
+  // Plays a recording back as a brick: each telegram posted that expects a reply gets the one
+  //   recorded for the same query, after the recorded round trip divided by speed (0 for none).
+  // Queries are paired with replies as the brick pairs them live (the oldest query of the same
+  //   opcode), and answered in order of posting per opcode, so a driver sending the same queries
+  //   sees the same replies, timeouts included. Commands without reply are taken and dropped.
+  // A query beyond what was recorded for its opcode goes unanswered, and is counted as diverged.
+  class replay_transport : public transport
+    {
+    public:
+      // Throws nxt_error if path is not a readable recording
+      explicit replay_transport ( const string &path, double speed = 1.0 );
+      ~replay_transport ( void );
+
+      virtual void write ( const telegram &buf );
+      virtual void read ( telegram &reply ); // Replies due while there is no listener
+      virtual void post ( const telegram &buf, bool expect_reply );
+      virtual void set_listener ( transport_listener *listener );
+
+      uint64_t recorded_queries ( void ) const { return num_queries_; };
+      uint64_t diverged ( void ) const { return diverged_.get(); };
+
+    private:
+      typedef struct
+        {
+          bool     answered;
+          int64_t  round_trip_ns;
+          telegram reply;
+        } recorded_query;
+
+      typedef struct
+        {
+          int64_t  due_ns;
+          telegram reply;
+        } scheduled_reply;
+
+      std::vector<recorded_query> queries_[256]; // Per opcode, in order of sending
+      size_t                      next_[256];
+      uint64_t                    num_queries_;
+      double                      speed_;
+
+      pthread_mutex_t             mutex_;
+      pthread_cond_t              changed_;
+      pthread_mutex_t             listener_mutex_;
+      pthread_t                   delivery_thread_;
+      volatile bool               stopping_;
+      std::deque<scheduled_reply> due_;          // In order of delivery
+      counter                     diverged_;
+
+      void load ( const uint8_t *log, size_t size );
+
+      static void *delivery_loop ( void *self );
+    };
+
+}
+
+#endif
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <cmath>
+#include "speed_controller.hh"
+#include <stdexcept>
+
+using namespace nxt_driver;
+
+SpeedController::SpeedController ( NXT::brick &brick, double rate, uint8_t read_mask )
+    : brick_ ( brick ),
+    rate_ ( rate ),
+    read_mask_ ( read_mask ),
+    running_ ( false ),
+    stopping_ ( false ),
+    have_latest_ ( false )
+{
+  if ( rate_ <= 0.0 )
+    throw std::runtime_error ( "SpeedController: rate must be positive" );
+
+  pthread_mutex_init ( &mutex_, NULL );
+
+  for ( int i = 0; i < NXT::kNumMotors; i++ )
+    {
+      loop &l = loops_[i];
+
+      l.controllable = false;
+      l.active       = false;
+      l.restart      = false;
+      l.setpoint     = 0.0;
+      l.integral     = 0.0;
+      l.last_ns      = 0;
+      l.written      = false;
+      l.power        = 0;
+      l.command.set_motor ( static_cast<NXT::motors> ( i ) );
+    }
+}
+
+SpeedController::~SpeedController ( void )
+{
+  stop();
+  pthread_mutex_destroy ( &mutex_ );
+}
+
+void SpeedController::configure ( NXT::motors motor, const gains &g )
+{
+  loops_[motor].controllable = true;
+  loops_[motor].g            = g;
+  loops_[motor].filter.set_tau ( g.filter_tau );
+
+  read_mask_ |= 1 << motor;
+}
+
+bool SpeedController::controllable ( NXT::motors motor ) const
+  {
+    return loops_[motor].controllable;
+  }
+
+void SpeedController::start ( void )
+{
+  if ( running_ )
+    return;
+
+  stopping_ = false;
+
+  if ( pthread_create ( &thread_, NULL, run, this ) != 0 )
+    throw std::runtime_error ( "SpeedController: cannot start thread" );
+
+  running_ = true;
+}
+
+void SpeedController::stop ( void )
+{
+  if ( ! running_ )
+    return;
+
+  stopping_ = true;
+  pthread_join ( thread_, NULL );
+  running_ = false;
+}
+
+void SpeedController::set_speed ( NXT::motors motor, double speed )
+{
+  pthread_mutex_lock ( &mutex_ );
+
+  loop &l = loops_[motor];
+
+  if ( l.controllable )
+    {
+      l.restart  = l.restart || ! l.active;
+      l.active   = true;
+      l.setpoint = speed;
+    }
+
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+void SpeedController::release ( NXT::motors motor )
+{
+  pthread_mutex_lock ( &mutex_ );
+  loops_[motor].active = false;
+  pthread_mutex_unlock ( &mutex_ );
+}
+
+bool SpeedController::latest ( NXT::motor_states &states ) const
+  {
+    pthread_mutex_lock ( &mutex_ );
+
+    const bool have = have_latest_;
+    if ( have )
+      states = latest_;
+
+    pthread_mutex_unlock ( &mutex_ );
+
+    return have;
+  }
+
+void SpeedController::tick ( void )
+{
+  const NXT::motor_states states = brick_.get_motor_states ( read_mask_ );
+
+  bool   active[NXT::kNumMotors];
+  double setpoint[NXT::kNumMotors];
+
+  pthread_mutex_lock ( &mutex_ );
+
+  latest_      = states;
+  have_latest_ = true;
+
+  for ( int i = 0; i < NXT::kNumMotors; i++ )
+    {
+      loop &l = loops_[i];
+
+      active[i]   = l.active;
+      setpoint[i] = l.setpoint;
+
+      if ( l.restart )
+        {
+          l.restart  = false;
+          l.integral = 0.0;
+          l.written  = false;
+        }
+    }
+
+  pthread_mutex_unlock ( &mutex_ );
+
+  for ( int i = 0; i < NXT::kNumMotors; i++ )
+    {
+      loop &l = loops_[i];
+
+      if ( ! l.controllable )
+        continue;
+
+      // Speed is tracked even while released, so control resumes without a transient
+      const int64_t sample_ns = states.sample_ns[i];
+      const double  dt        = l.last_ns > 0 ? ( sample_ns - l.last_ns ) * 1e-9 : 0.0;
+      const double  measured  = l.filter.update ( states.state[i].tacho_count, sample_ns );
+      l.last_ns = sample_ns;
+
+      if ( ! active[i] )
+        continue;
+
+      const int8_t power = control ( l, setpoint[i], measured, dt );
+
+      if ( l.written && power == l.power )
+        continue;
+
+      l.command.
+      set_power ( power ).
+      set_run_state ( power == 0 ? NXT::motor_run_state_idle : NXT::motor_run_state_running );
+
+      // Released since the snapshot, the motor is someone else's: once release() returns, nothing is written
+      pthread_mutex_lock ( &mutex_ );
+
+      if ( ! l.active || l.restart ) // Or taken again, to start over next tick
+        {
+          pthread_mutex_unlock ( &mutex_ );
+          continue;
+        }
+
+      try
+        {
+          brick_.execute ( l.command );
+        }
+      catch ( ... )
+        {
+          pthread_mutex_unlock ( &mutex_ );
+          throw;
+        }
+
+      pthread_mutex_unlock ( &mutex_ );
+
+      l.written = true;
+      l.power   = power;
+      stats_.writes.add();
+    }
+}
+
+int8_t SpeedController::control ( loop &l, double setpoint, double measured, double dt )
+{
+  if ( setpoint == 0.0 )
+    {
+      l.integral = 0.0;
+      return 0;
+    }
+
+  const gains &g     = l.g;
+  const double error = setpoint - measured;
+
+  // The integral only grows if that doesn't push power past its limit
+  const double grown = l.integral + error * dt;
+  const double ideal = g.feedforward * ( setpoint + g.kp * error + g.ki * grown );
+
+  if ( fabs ( ideal ) <= g.max_power || fabs ( grown ) < fabs ( l.integral ) )
+    l.integral = grown;
+
+  const double power = g.feedforward * ( setpoint + g.kp * error + g.ki * l.integral );
+
+  return static_cast<int8_t> ( floor ( std::max ( -g.max_power, std::min ( g.max_power, power ) ) + 0.5 ) );
+}
+
+void *SpeedController::run ( void *self )
+{
+  SpeedController &c = *static_cast<SpeedController*> ( self );
+
+  PeriodicTimer timer ( 1.0 / c.rate_ );
+
+  while ( ! c.stopping_ )
+    {
+      timer.sleep();
+
+      if ( ! timer.start_cycle() )
+        continue;
+
+      c.stats_.ticks.add();
+      c.stats_.jitter.add ( timer.last_late_ns() );
+      c.stats_.missed.add ( timer.last_late_ns() / timer.period_ns() );
+
+      const int64_t start = PeriodicTimer::now_ns();
+
+      try
+        {
+          c.tick();
+        }
+      catch ( NXT::nxt_error & )
+        {
+          c.stats_.errors.add();
+
+          pthread_mutex_lock ( &c.mutex_ );
+          c.have_latest_ = false; // So readers go to the brick, and see it fail for themselves
+          pthread_mutex_unlock ( &c.mutex_ );
+        }
+
+      c.stats_.tick_time.add ( PeriodicTimer::now_ns() - start );
+    }
+
+  return NULL;
+}
@@ -0,0 +1,101 @@
+#ifndef _speed_controller_
+#define _speed_controller_
+
+#include "chronos.hh"
+#include "nxtdc.hh"
+#include <pthread.h>
+#include "stats.hh"
+#include "velocity_filter.hh"
+
+namespace nxt_driver
+  {
+
+  // Closed loop speed of motors, in a thread of its own at a rate independent of the driver's.
+  // Each tick reads all motors of interest in one pipelined batch, and writes the power of the
+  //   controlled ones that changed. Power is a feedforward of the setpoint plus a PI on the speed
+  //   error; the integral stops growing while power saturates.
+  // Speeds are in tacho degrees per second. Gains are relative to the feedforward, so
+  //   power = feedforward * ( setpoint + kp * error + ki * integral of error ).
+  class SpeedController
+    {
+    public:
+      typedef struct
+        {
+          double feedforward; // [% per deg/s] Power expected for a speed
+          double kp;
+          double ki;          // [1/s]
+          double max_power;   // [%]
+          double filter_tau;  // [s] Of the measured speed (see VelocityFilter)
+        } gains;
+
+      typedef struct
+        {
+          NXT::counter           ticks;
+          NXT::counter           missed;    // Ticks skipped for running late
+          NXT::counter           errors;    // Ticks that failed to read or write
+          NXT::counter           writes;    // Power changes sent
+          NXT::latency_histogram tick_time;
+          NXT::latency_histogram jitter;    // Lateness of tick starts
+        } loop_stats;
+
+      // rate [Hz]; read_mask: motors read each tick, whether controlled or not (see NXT::motor_masks)
+      SpeedController ( NXT::brick &brick, double rate, uint8_t read_mask );
+      ~SpeedController ( void );
+
+      void configure ( NXT::motors motor, const gains &g ); // Makes it controllable, before start
+      bool controllable ( NXT::motors motor ) const;
+
+      void start ( void );
+      void stop ( void );
+
+      // Takes the motor under control towards speed [deg/s]
+      void set_speed ( NXT::motors motor, double speed );
+      // Leaves the motor as it is, for other commands; nothing is written to it once this returns
+      void release ( NXT::motors motor );
+
+      // Last reading of the motors in read_mask; false if there is none yet, or the last tick failed
+      bool latest ( NXT::motor_states &states ) const;
+
+      double             rate ( void ) const { return rate_; };
+      const loop_stats & stats ( void ) const { return stats_; };
+
+    private:
+      typedef struct
+        {
+          bool           controllable;
+          gains          g;
+          VelocityFilter filter;
+          bool           active;    // Under control; these three are shared with commanders
+          bool           restart;   // Newly activated
+          double         setpoint;
+          double         integral;  // [deg] The rest, only the thread touches
+          int64_t        last_ns;   // Of the last sample used
+          bool           written;   // Whether power has been written since activation
+          int8_t         power;     // Last written
+          NXT::set_output_state_telegram command;
+        } loop;
+
+      NXT::brick        &brick_;
+      double             rate_;
+      uint8_t            read_mask_;
+
+      mutable pthread_mutex_t mutex_; // Of setpoints and latest_, and held across power writes
+      pthread_t          thread_;
+      bool               running_;
+      volatile bool      stopping_;
+
+      loop               loops_[NXT::kNumMotors];
+      NXT::motor_states  latest_;
+      bool               have_latest_;
+
+      loop_stats         stats_;
+
+      void tick ( void );
+      int8_t control ( loop &l, double setpoint, double measured, double dt );
+
+      static void *run ( void *self );
+    };
+
+}
+
+#endif
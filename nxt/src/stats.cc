@@ -0,0 +1,77 @@
+#include "stats.hh"
+
+using namespace NXT;
+
+latency_histogram::latency_histogram ( void ) : count_ ( 0 ), sum_ns_ ( 0 ), max_ns_ ( 0 )
+{
+  for ( int i = 0; i < kBuckets; i++ )
+    buckets_[i] = 0;
+}
+
+void latency_histogram::add ( int64_t ns )
+{
+  if ( ns < 0 )
+    ns = 0;
+
+  __sync_fetch_and_add ( &buckets_[bucket ( ns )], 1 );
+  __sync_fetch_and_add ( &count_, 1 );
+  __sync_fetch_and_add ( &sum_ns_, ns );
+
+  int64_t max = max_ns_;
+  while ( ns > max )
+    {
+      const int64_t seen = __sync_val_compare_and_swap ( &max_ns_, max, ns );
+      if ( seen == max )
+        break;
+      max = seen;
+    }
+}
+
+double latency_histogram::mean_ns ( void ) const
+  {
+    const uint64_t n = count_;
+    return n == 0 ? 0.0 : static_cast<double> ( sum_ns_ ) / n;
+  }
+
+int64_t latency_histogram::percentile_ns ( double p ) const
+  {
+    const uint64_t n = count_;
+    if ( n == 0 )
+      return 0;
+
+    const uint64_t rank = static_cast<uint64_t> ( p * n + 0.5 );
+
+    uint64_t seen = 0;
+    for ( int i = 0; i < kBuckets; i++ )
+      {
+        seen += buckets_[i];
+        if ( seen >= rank && seen > 0 )
+          return upper_bound ( i ) < max_ns_ ? upper_bound ( i ) : max_ns_;
+      }
+
+    return max_ns_;
+  }
+
+// Bucket 0 holds [0, 1024ns). Then each octave [2^k, 2^(k+1)) is split in four
+int latency_histogram::bucket ( int64_t ns )
+{
+  if ( ns < 1024 )
+    return 0;
+
+  const int octave = 63 - __builtin_clzll ( ns );
+  const int sub    = ( ns >> ( octave - 2 ) ) & 3;
+  const int b      = 1 + ( octave - 10 ) * kSubBuckets + sub;
+
+  return b < kBuckets ? b : kBuckets - 1;
+}
+
+int64_t latency_histogram::upper_bound ( int bucket )
+{
+  if ( bucket == 0 )
+    return 1024;
+
+  const int octave = ( bucket - 1 ) / kSubBuckets + 10;
+  const int sub    = ( bucket - 1 ) % kSubBuckets;
+
+  return static_cast<int64_t> ( kSubBuckets + sub + 1 ) << ( octave - 2 );
+}
@@ -0,0 +1,52 @@
+#ifndef _nxt_stats_
+#define _nxt_stats_
+
+#include <stdint.h>
+
+namespace NXT
+  {
+
+  // Hot path statistics: updated lock-free from any thread, readable at any time.
+  // Several readings taken together aren't a consistent snapshot, which is fine for monitoring.
+
+  class counter
+    {
+    public:
+      counter ( void ) : value_ ( 0 ) {};
+
+      void     add ( uint64_t n = 1 ) { __sync_fetch_and_add ( &value_, n ); };
+      uint64_t get ( void ) const     { return value_; };
+
+    private:
+      volatile uint64_t value_;
+    };
+
+  // Four buckets per octave from 1us up to ~40 minutes, so percentiles are within 25%
+  class latency_histogram
+    {
+    public:
+      latency_histogram ( void );
+
+      void add ( int64_t ns );
+
+      uint64_t count ( void ) const { return count_; };
+      int64_t  max_ns ( void ) const { return max_ns_; };
+      double   mean_ns ( void ) const;
+      int64_t  percentile_ns ( double p ) const; // Upper bound of the bucket where it falls, 0 if empty
+
+    private:
+      static const int kSubBuckets = 4;
+      static const int kBuckets    = 1 + 31 * kSubBuckets; // The first one is below 1us
+
+      volatile uint64_t buckets_[kBuckets];
+      volatile uint64_t count_;
+      volatile uint64_t sum_ns_;
+      volatile int64_t  max_ns_;
+
+      static int     bucket ( int64_t ns );
+      static int64_t upper_bound ( int bucket );
+    };
+
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include <cmath>
+#include "velocity_filter.hh"
+
+using namespace nxt_driver;
+
+VelocityFilter::VelocityFilter ( double tau )
+    : tau_ ( tau )
+{
+  reset();
+}
+
+void VelocityFilter::set_tau ( double tau )
+{
+  tau_ = tau;
+}
+
+void VelocityFilter::reset ( void )
+{
+  primed_   = false;
+  pos_      = 0.0;
+  vel_      = 0.0;
+  stamp_ns_ = 0;
+}
+
+double VelocityFilter::update ( double position, int64_t stamp_ns )
+{
+  if ( ! primed_ )
+    {
+      primed_   = true;
+      pos_      = position;
+      stamp_ns_ = stamp_ns;
+      return vel_;
+    }
+
+  const double dt = ( stamp_ns - stamp_ns_ ) * 1e-9;
+  if ( dt <= 0.0 ) // Same sample again
+    return vel_;
+
+  stamp_ns_ = stamp_ns;
+
+  if ( tau_ <= 0.0 )
+    {
+      vel_ = ( position - pos_ ) / dt;
+      pos_ = position;
+      return vel_;
+    }
+
+  // Critically damped gains for this step: g = 1 - theta^2, h = ( 1 - theta )^2
+  const double theta     = exp ( -dt / tau_ );
+  const double predicted = pos_ + vel_ * dt;
+  const double residual  = position - predicted;
+
+  pos_  = predicted + ( 1.0 - theta * theta ) * residual;
+  vel_ += ( 1.0 - theta ) * ( 1.0 - theta ) * residual / dt;
+
+  return vel_;
+}
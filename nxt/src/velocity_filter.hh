@@ -0,0 +1,36 @@
+#ifndef _velocity_filter_
+#define _velocity_filter_
+
+#include <stdint.h>
+
+namespace nxt_driver
+  {
+
+  // Velocity of a position sampled at irregular times, e.g. a tacho count read over USB.
+  // A critically damped alpha-beta tracker, whose gains follow the real time between samples:
+  //   it has no lag at constant speed, and smooths the quantization of the counts.
+  // tau [s] trades lag under acceleration for smoothing; 0 gives plain differences.
+  class VelocityFilter
+    {
+    public:
+      explicit VelocityFilter ( double tau = 0.0 );
+
+      void   set_tau ( double tau );
+      double tau ( void ) const { return tau_; };
+      void   reset ( void ); // The next sample starts over, at null velocity
+
+      // Returns the velocity after the sample taken at stamp_ns (see NXT::monotonic_ns)
+      double update ( double position, int64_t stamp_ns );
+      double velocity ( void ) const { return vel_; };
+
+    private:
+      double  tau_;
+      bool    primed_;
+      double  pos_;      // Filtered
+      double  vel_;
+      int64_t stamp_ns_; // Of the last sample
+    };
+
+}
+
+#endif